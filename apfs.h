@@ -9,6 +9,7 @@
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
 #include <linux/list.h>
+#include <linux/rbtree.h>
 #include <linux/types.h>
 #include <linux/version.h>
 
@@ -73,18 +74,94 @@ do {									\
 #endif
 
 /*
- * Parameter for the snapshot creation ioctl
+ * Parameter for the snapshot creation and deletion ioctls
  */
 struct apfs_ioctl_snap_name {
 	char name[APFS_SNAP_MAX_NAMELEN + 1];
 };
 
+/*
+ * Parameter for the directory statistics ioctl
+ */
+struct apfs_ioctl_dir_stats {
+	__u64 num_children;	/* Entries in the directory itself */
+	__u64 total_size;	/* Bytes in all files below the directory */
+	__u64 gen_count;	/* Bumped on every change to the stats */
+};
+
+/*
+ * Parameter for the ioctl that reports on the deletion of orphan files
+ */
+struct apfs_ioctl_reclaim_stats {
+	__u64 pending_files;	/* Orphan files still waiting for deletion */
+	__u64 reclaimed_bytes;	/* Bytes of extents released since mount */
+};
+
+/*
+ * A change between two snapshots, as reported by the snapshot diff ioctl
+ */
+struct apfs_snap_diff_entry {
+	__u64 id;		/* Object id, usually an inode number */
+	__u64 offset;		/* First byte of a changed extent range */
+	__u64 length;		/* Length of a changed extent range */
+	__u32 kind;		/* One of the APFS_SNAP_DIFF_* values */
+	__u32 pad;
+};
+
+/* Kinds of snapshot diff entries */
+#define APFS_SNAP_DIFF_CREATED	1	/* Inode only exists in the newer one */
+#define APFS_SNAP_DIFF_DELETED	2	/* Inode only exists in the older one */
+#define APFS_SNAP_DIFF_CHANGED	3	/* Some other record of the object */
+#define APFS_SNAP_DIFF_EXTENT	4	/* Data range, @id is the dstream */
+
+/*
+ * Parameter for the snapshot diff ioctl. The position and flags start out
+ * zeroed and get updated on each call, until APFS_SNAP_DIFF_DONE is set in the
+ * flags. They must be passed back unchanged to continue.
+ */
+struct apfs_ioctl_snap_diff {
+	char from[APFS_SNAP_MAX_NAMELEN + 1];	/* Older snapshot */
+	char to[APFS_SNAP_MAX_NAMELEN + 1];	/* Newer one, empty for the volume */
+	__u64 pos_id;		/* Object id to continue from */
+	__u64 pos_number;	/* Logical address to continue from */
+	__u32 pos_type;		/* Record type to continue from */
+	__u32 flags;		/* Flags returned by the ioctl */
+	__u32 count;		/* Size of the entry array, entries on return */
+	__u32 pad;
+	__u64 entries;		/* Pointer to an apfs_snap_diff_entry array */
+};
+
+/* Flags returned by the snapshot diff ioctl, and passed back in the next call */
+#define APFS_SNAP_DIFF_DONE	0x1	/* All changes have been reported */
+#define APFS_SNAP_DIFF_REPORTED	0x2	/* Object at the position was reported */
+
+/*
+ * Parameter for the defrag ioctl. The extent counts are returned by the
+ * ioctl, for the whole range.
+ */
+struct apfs_ioctl_defrag {
+	__u64 start;		/* First byte of the range */
+	__u64 len;		/* Length of the range, zero to go until EOF */
+	__u32 flags;		/* APFS_DEFRAG_* flags */
+	__u32 pad;
+	__u64 extents_before;	/* Extents in the range before the defrag */
+	__u64 extents_after;	/* Extents in the range after the defrag */
+};
+
+/* Flags for the defrag ioctl */
+#define APFS_DEFRAG_SHARED	0x1	/* Also rewrite cloned or snapshotted data */
+
 #define APFS_IOC_SET_DFLT_PFK	_IOW('@', 0x80, struct apfs_wrapped_crypto_state)
 #define APFS_IOC_SET_DIR_CLASS	_IOW('@', 0x81, u32)
 #define APFS_IOC_SET_PFK	_IOW('@', 0x82, struct apfs_wrapped_crypto_state)
 #define APFS_IOC_GET_CLASS	_IOR('@', 0x83, u32)
 #define APFS_IOC_GET_PFK	_IOR('@', 0x84, struct apfs_wrapped_crypto_state)
 #define APFS_IOC_TAKE_SNAPSHOT	_IOW('@', 0x85, struct apfs_ioctl_snap_name)
+#define APFS_IOC_GET_DIR_STATS	_IOR('@', 0x86, struct apfs_ioctl_dir_stats)
+#define APFS_IOC_GET_RECLAIM_STATS	_IOR('@', 0x87, struct apfs_ioctl_reclaim_stats)
+#define APFS_IOC_DELETE_SNAPSHOT	_IOW('@', 0x88, struct apfs_ioctl_snap_name)
+#define APFS_IOC_SNAP_DIFF	_IOWR('@', 0x89, struct apfs_ioctl_snap_diff)
+#define APFS_IOC_DEFRAG		_IOWR('@', 0x8a, struct apfs_ioctl_defrag)
 
 /*
  * In-memory representation of an APFS object
@@ -108,6 +185,19 @@ struct apfs_object {
 #define APFS_BTREE_TOC_ENTRY_INCREMENT	8
 #define APFS_BTREE_TOC_ENTRY_MAX_UNUSED	(2 * BTREE_TOC_ENTRY_INCREMENT)
 
+/*
+ * Decoded key for a node record, so that searches that go through the same
+ * node more than once don't need to parse every key again. Record names are
+ * not included; they get compared separately when everything else is equal.
+ */
+struct apfs_sort_key {
+	u64 hi;		/* Object id, followed by the record type in 4 bits */
+	u64 lo;		/* Extent offset, name hash or transaction id */
+};
+
+/* Nodes with fewer records are not worth decoding */
+#define APFS_SORT_KEY_MIN_RECORDS	16
+
 /*
  * In-memory representation of an APFS node
  */
@@ -123,6 +213,9 @@ struct apfs_node {
 	int key_free_list_len;	/* Length of the fragmented free key space */
 	int val_free_list_len;	/* Length of the fragmented free value space */
 
+	struct apfs_sort_key *sort_keys; /* Decoded keys (NULL if not built) */
+	atomic_t searches;	/* Bisections run since the last change */
+
 	struct apfs_object object; /* Object holding the node */
 };
 
@@ -135,6 +228,17 @@ static inline bool apfs_node_is_leaf(struct apfs_node *node)
 	return (node->flags & APFS_BTNODE_LEAF) != 0;
 }
 
+/**
+ * apfs_node_level - Get the level of a b-tree node, zero for the leaves
+ * @node: the node to check
+ */
+static inline u16 apfs_node_level(struct apfs_node *node)
+{
+	struct apfs_btree_node_phys *raw = (void *)node->object.data;
+
+	return le16_to_cpu(raw->btn_level);
+}
+
 /**
  * apfs_node_is_root - Check if a b-tree node is the root
  * @node: the node to check
@@ -175,13 +279,15 @@ struct apfs_spaceman {
 	u64 sm_free_count;		/* Number of free blocks */
 	u32 sm_addr_offset;		/* Offset of cib addresses in @sm_raw */
 	u64 sm_main_fq_nodes;		/* Number of nodes in the main fq */
+	u64 sm_data_cursor;		/* Goal for data with no better hint */
 
 	/*
-	 * A range of freed blocks not yet put in the free queue. Extend this as
-	 * much as possible before creating an actual record.
+	 * Ranges of freed blocks not yet put in the free queues, sorted and
+	 * coalesced. They only become actual records when the transaction
+	 * commits.
 	 */
-	u64 sm_free_cache_base;
-	u64 sm_free_cache_blkcnt;
+	struct rb_root sm_free_cache;
+	u64 sm_free_cache_count;	/* Number of ranges in the cache */
 
 	/* Shift to match an ip block with its bitmap in the array */
 	int sm_ip_bmaps_shift;
@@ -193,10 +299,19 @@ struct apfs_spaceman {
 	struct apfs_ip_bitmap_block_info sm_ip_bmaps[];
 };
 
+/* Number of queued blocks to free on each new transaction, if not in a rush */
+#define APFS_FQ_DRAIN_BUDGET		1024
+
 #define APFS_TRANS_MAIN_QUEUE_MAX	10000
 #define APFS_TRANS_BUFFERS_MAX		65536
 #define APFS_TRANS_STARTS_MAX		65536
 
+/* Extents deleted by each orphan cleanup transaction, to keep them short */
+#define APFS_RECLAIM_MAX_EXTENTS	512
+
+/* Records merged or deleted by each transaction of the snapshot reaper */
+#define APFS_REAP_MAX_RECORDS		1024
+
 /* Possible states for the container transaction structure */
 #define APFS_NX_TRANS_FORCE_COMMIT	1	/* Commit guaranteed */
 #define APFS_NX_TRANS_DEFER_COMMIT	2	/* Commit banned right now */
@@ -238,6 +353,10 @@ struct apfs_nx_transaction {
 BUFFER_FNS(TRANS, trans);
 BUFFER_FNS(CSUM, csum);
 
+/* Checksum was already verified, by this or any other mount in the container */
+#define BH_CHECKED	(BH_PrivateStart + 2)
+BUFFER_FNS(CHECKED, checked);
+
 /*
  * Additional information for a buffer in a transaction.
  */
@@ -271,6 +390,13 @@ struct apfs_ephemeral_object_info {
  * future mounts know that has happened already.
  */
 #define APFS_FLAGS_SET		4
+/* Issue discards for blocks as they leave the main free queue */
+#define APFS_DISCARD		8
+/* Start reading the inode records while listing a directory */
+#define APFS_PREFETCH		16
+
+/* Number of inode records to request at once when prefetching for readdir */
+#define APFS_READDIR_RA_BATCH	64
 
 /*
  * Wrapper around block devices for portability.
@@ -327,6 +453,7 @@ struct apfs_nxsb_info {
 
 	/* For now, a single semaphore for every operation */
 	struct rw_semaphore nx_big_sem;
+	u64 nx_btree_gen; /* Count of b-tree changes, to detect stale paths */
 
 	/* List of currently mounted containers */
 	struct list_head nx_list;
@@ -350,17 +477,18 @@ struct apfs_omap_map {
 struct apfs_omap_rec {
 	u64 oid;
 	u64 bno;
+	u64 xid;	/* Transaction id for this version of the object */
+	u64 max_xid;	/* Newest transaction id known to map to this version */
 };
 
 #define APFS_OMAP_CACHE_SLOTS		128
 #define APFS_OMAP_CACHE_SLOT_MASK	(APFS_OMAP_CACHE_SLOTS - 1)
 
 /**
- * Cache of omap records
+ * Cache of omap records, shared by all mounted snapshots of the volume
  */
 struct apfs_omap_cache {
 	struct apfs_omap_rec recs[APFS_OMAP_CACHE_SLOTS];
-	bool disabled;
 	spinlock_t lock;
 };
 
@@ -406,9 +534,26 @@ struct apfs_sb_info {
 
 	struct apfs_crypto_state_val *s_dflt_pfk; /* default per-file key */
 
+	/*
+	 * Name handling features, cached on mount so that rcu-walk lookups
+	 * never need to touch @s_vsb_raw, which may get replaced by a commit.
+	 */
+	bool s_case_insensitive;
+	bool s_norm_insensitive;
+
 	struct inode *s_private_dir;	/* Inode for the private directory */
 	struct work_struct s_orphan_cleanup_work;
 	atomic_t s_orphan_cleanup_err;	/* Error from last orphan cleanup */
+	atomic64_t s_reclaimed_bytes;	/* Extent bytes released by cleanups */
+
+	/* Reaper for deleted snapshots, see snapshot.c */
+	struct work_struct s_reaper_work;
+	u64 s_reap_xid;			/* Snapshot being reaped, or zero */
+	u64 s_reap_oid;			/* Object id for the next omap record */
+	u64 s_reap_ver;			/* Transaction id for that record */
+	bool s_reap_kept;		/* Older versions kept for that object? */
+	bool s_reap_extrefs_done;	/* Are the extrefs all merged? */
+	bool s_reap_omap_done;		/* Are the omap versions all gone? */
 };
 
 static inline struct apfs_sb_info *APFS_SB(struct super_block *sb)
@@ -454,20 +599,12 @@ static inline struct apfs_spaceman *APFS_SM(struct super_block *sb)
 
 static inline bool apfs_is_case_insensitive(struct super_block *sb)
 {
-	return (APFS_SB(sb)->s_vsb_raw->apfs_incompatible_features &
-	       cpu_to_le64(APFS_INCOMPAT_CASE_INSENSITIVE)) != 0;
+	return APFS_SB(sb)->s_case_insensitive;
 }
 
 static inline bool apfs_is_normalization_insensitive(struct super_block *sb)
 {
-	struct apfs_sb_info *sbi = APFS_SB(sb);
-	u64 flags = le64_to_cpu(sbi->s_vsb_raw->apfs_incompatible_features);
-
-	if (apfs_is_case_insensitive(sb))
-		return true;
-	if (flags & APFS_INCOMPAT_NORMALIZATION_INSENSITIVE)
-		return true;
-	return false;
+	return APFS_SB(sb)->s_norm_insensitive;
 }
 
 /**
@@ -534,6 +671,19 @@ static inline void apfs_init_extent_key(u64 bno, struct apfs_key *key)
 	key->name = NULL;
 }
 
+/**
+ * apfs_init_dir_stats_key - Initialize an in-memory key for a dir stats query
+ * @id:		id of the dir stats record
+ * @key:	apfs_key structure to initialize
+ */
+static inline void apfs_init_dir_stats_key(u64 id, struct apfs_key *key)
+{
+	key->id = id;
+	key->type = APFS_TYPE_DIR_STATS;
+	key->number = 0;
+	key->name = NULL;
+}
+
 /**
  * apfs_init_inode_key - Initialize an in-memory key for an inode query
  * @ino:	inode number
@@ -624,9 +774,28 @@ static inline void apfs_init_sibling_map_key(u64 id, struct apfs_key *key)
 	key->name = NULL;
 }
 
+extern u32 apfs_drec_name_hash(struct super_block *sb, const char *name,
+			       unsigned int name_len);
 extern void apfs_init_drec_key(struct super_block *sb, u64 ino, const char *name,
 			       unsigned int name_len, struct apfs_key *key);
 
+/**
+ * apfs_init_drec_hash_key - Initialize a dentry query key from a known hash
+ * @ino:	inode number of the parent directory
+ * @hash:	filename hash, as returned by apfs_drec_name_hash()
+ * @key:	apfs_key structure to initialize
+ *
+ * Only for normalization-insensitive volumes.
+ */
+static inline void apfs_init_drec_hash_key(u64 ino, u32 hash, struct apfs_key *key)
+{
+	key->id = ino;
+	key->type = APFS_TYPE_DIR_REC;
+	key->name = NULL;
+	/* The filename length doesn't matter, so it's left as zero */
+	key->number = hash << APFS_DREC_HASH_SHIFT;
+}
+
 /**
  * apfs_init_xattr_key - Initialize an in-memory key for a xattr query
  * @ino:	inode number of the parent file
@@ -715,6 +884,7 @@ static inline u64 apfs_cat_cnid(struct apfs_key_header *key)
 #define APFS_QUERY_ANY_NUMBER	004000	/* Multiple search for any number */
 #define APFS_QUERY_MULTIPLE	(APFS_QUERY_ANY_NAME | APFS_QUERY_ANY_NUMBER)
 #define APFS_QUERY_PREV		010000	/* Find previous record */
+#define APFS_QUERY_BULK		020000	/* Sorted bulk insertion in progress */
 
 /*
  * Structure used to retrieve data from an APFS B-Tree.
@@ -734,6 +904,56 @@ struct apfs_query {
 	int len;			/* Length of the value */
 
 	int depth;			/* Put a limit on recursion */
+	int ra_edge;			/* Last child requested for readahead */
+};
+
+/*
+ * Nodes with less than this percentage of their space in use get merged with
+ * a sibling after a record removal, if the result stays under the second one.
+ */
+#define APFS_BTREE_UNDERFLOW_PCT	25
+#define APFS_BTREE_MERGE_PCT		75
+
+/*
+ * Percentage of the records that a full node keeps when it gets split during
+ * a sorted bulk insertion, with the new ones going to its right.
+ */
+#define APFS_BTREE_BULK_FILL_PCT	90
+
+/*
+ * A raw b-tree record, for bulk insertions.
+ */
+struct apfs_btree_rec {
+	void *key;			/* On-disk record key */
+	int key_len;			/* Length of @key */
+	void *val;			/* On-disk record value */
+	int val_len;			/* Length of @val */
+};
+
+/* Number of sibling leaves to read ahead of a multiple query */
+#define APFS_BTREE_RA_NODES	8
+
+/* Maximum height for a b-tree, to avoid endless loops on corrupted volumes */
+#define APFS_BTREE_MAX_HEIGHT	12
+
+/* Most entries reported by a single call to the snapshot diff ioctl */
+#define APFS_SNAP_DIFF_MAX_ENTRIES	1024
+
+/*
+ * Iterator over the records of a b-tree in the range [@start, @end). The path
+ * to the current record is kept between steps, and it's only rebuilt from the
+ * root if the container's b-trees were modified in the meantime.
+ */
+struct apfs_btree_iter {
+	struct apfs_node *root;		/* Root of the b-tree */
+	unsigned int flags;		/* Query flags for the b-tree type */
+	struct apfs_key start;		/* First key in range */
+	struct apfs_key end;		/* First key out of range */
+
+	struct apfs_query *query;	/* Path to the current record */
+	u64 gen;			/* Value of nx_btree_gen for the path */
+	struct apfs_key key;		/* Key for the current record */
+	char name[APFS_NAME_LEN + 1];	/* Copy of the name in @key */
 };
 
 /**
@@ -771,6 +991,12 @@ struct apfs_file_extent {
 	u64 crypto_id;
 };
 
+/* Number of extents read at a time when cloning a dstream */
+#define APFS_CLONE_BATCH	32
+
+/* Maximum number of blocks rewritten in a single defrag transaction */
+#define APFS_DEFRAG_MAX_BLOCKS	1024
+
 /*
  * Physical extent record data in memory
  */
@@ -811,6 +1037,12 @@ static inline u64 apfs_alloced_size(struct apfs_dstream_info *dstream)
 	return blks << sb->s_blocksize_bits;
 }
 
+/* Value of i_acct_stats when the parent's dir stats have not been looked up */
+#define APFS_DIR_STATS_UNKNOWN	U64_MAX
+
+/* Sanity limit for the length of a chain of dir stats records */
+#define APFS_DIR_STATS_MAX_CHAIN	4096
+
 /*
  * APFS inode data in memory
  */
@@ -830,6 +1062,12 @@ struct apfs_inode_info {
 	struct apfs_dstream_info i_dstream;	 /* Dstream data, if any */
 
 	bool			i_cleaned;	 /* Orphan data already deleted */
+	bool			i_inplace;	 /* Overwrite unshared blocks? */
+
+	u64			i_dir_stats_id;	 /* Id of own dir stats, or 0 */
+	u64			i_acct_parent;	 /* Parent counting our size */
+	u64			i_acct_stats;	 /* Dir stats of that parent */
+	u64			i_acct_size;	 /* Size counted by the parent */
 
 	struct inode vfs_inode;
 };
@@ -877,6 +1115,12 @@ struct apfs_drec {
 	unsigned int type;
 };
 
+/*
+ * Private xattr that marks a regular file for in-place overwrites, since APFS
+ * has no inode flag for this
+ */
+#define APFS_XATTR_NAME_NOCOW	"org.linux-apfs.nocow"
+
 /*
  * Xattr record data in memory
  */
@@ -931,6 +1175,8 @@ do {									\
 } while (0)
 
 /* btree.c */
+extern int apfs_init_query_cache(void);
+extern void apfs_destroy_query_cache(void);
 extern struct apfs_node *apfs_query_root(const struct apfs_query *query);
 extern struct apfs_query *apfs_alloc_query(struct apfs_node *node,
 					   struct apfs_query *parent);
@@ -938,24 +1184,34 @@ extern void apfs_free_query(struct apfs_query *query);
 extern int apfs_btree_query(struct super_block *sb, struct apfs_query **query);
 extern int apfs_omap_lookup_block(struct super_block *sb, struct apfs_omap *omap, u64 id, u64 *block, bool write);
 extern int apfs_omap_lookup_newest_block(struct super_block *sb, struct apfs_omap *omap, u64 id, u64 *block, bool write);
+extern int apfs_omap_lookup_snap_block(struct super_block *sb, struct apfs_omap *omap, u64 id, u64 xid, u64 *block);
 extern int apfs_create_omap_rec(struct super_block *sb, u64 oid, u64 bno);
 extern int apfs_delete_omap_rec(struct super_block *sb, u64 oid);
+extern int apfs_delete_omap_version(struct super_block *sb, u64 oid, u64 xid);
 extern int apfs_query_join_transaction(struct apfs_query *query);
 extern int __apfs_btree_insert(struct apfs_query *query, void *key, int key_len, void *val, int val_len);
 extern int apfs_btree_insert(struct apfs_query *query, void *key, int key_len,
 			     void *val, int val_len);
+extern int apfs_btree_insert_batch(struct apfs_query *query, struct apfs_btree_rec *recs, int count);
 extern int apfs_btree_remove(struct apfs_query *query);
 extern void apfs_btree_change_node_count(struct apfs_query *query, int change);
 extern int apfs_btree_replace(struct apfs_query *query, void *key, int key_len,
 			      void *val, int val_len);
 extern void apfs_query_direct_forward(struct apfs_query *query);
+extern void apfs_catalog_readahead(struct super_block *sb, u64 *inos, int count);
+extern void apfs_btree_iter_init(struct apfs_btree_iter *iter, struct apfs_node *root, unsigned int flags,
+				 const struct apfs_key *start, const struct apfs_key *end);
+extern void apfs_btree_iter_release(struct apfs_btree_iter *iter);
+extern int apfs_btree_iter_seek(struct super_block *sb, struct apfs_btree_iter *iter, const struct apfs_key *key);
+extern int apfs_btree_iter_next(struct super_block *sb, struct apfs_btree_iter *iter);
+extern int apfs_btree_iter_prev(struct super_block *sb, struct apfs_btree_iter *iter);
 
 /* compress.c */
 extern int apfs_compress_get_size(struct inode *inode, loff_t *size);
 
 /* dir.c */
 extern int apfs_inode_by_name(struct inode *dir, const struct qstr *child,
-			      u64 *ino);
+			      const u32 *hash, u64 *ino);
 extern int apfs_mkany(struct inode *dir, struct dentry *dentry,
 		      umode_t mode, dev_t rdev, const char *symname);
 
@@ -1005,6 +1261,11 @@ extern int apfs_unlink(struct inode *dir, struct dentry *dentry);
 extern int apfs_rmdir(struct inode *dir, struct dentry *dentry);
 extern int apfs_delete_orphan_link(struct inode *inode);
 extern u64 apfs_any_orphan_ino(struct super_block *sb, u64 *ino_p);
+extern int apfs_dir_stats_update(struct super_block *sb, u64 id, int children, s64 size);
+extern int apfs_dir_stats_rechain(struct super_block *sb, u64 id, u64 new_chain);
+extern int apfs_create_dir_stats_rec(struct super_block *sb, u64 id, u64 chain);
+extern int apfs_delete_dir_stats_rec(struct super_block *sb, u64 id);
+extern int apfs_ioc_get_dir_stats(struct file *file, void __user *user_arg);
 
 /* extents.c */
 extern int apfs_extent_from_query(struct apfs_query *query,
@@ -1018,6 +1279,7 @@ extern int apfs_flush_extent_cache(struct apfs_dstream_info *dstream);
 extern int apfs_dstream_get_new_bno(struct apfs_dstream_info *dstream, u64 dsblock, u64 *bno);
 extern int apfs_get_new_block(struct inode *inode, sector_t iblock,
 			      struct buffer_head *bh_result, int create);
+extern int apfs_block_can_overwrite(struct inode *inode, u64 bno, bool *inplace);
 extern int apfs_truncate(struct apfs_dstream_info *dstream, loff_t new_size);
 extern int apfs_inode_delete_front(struct inode *inode);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
@@ -1026,8 +1288,10 @@ extern loff_t apfs_remap_file_range(struct file *src_file, loff_t off, struct fi
 extern int apfs_clone_file_range(struct file *src_file, loff_t off, struct file *dst_file, loff_t destoff, u64 len);
 #endif
 extern int apfs_clone_extents(struct apfs_dstream_info *dstream, u64 new_id);
+extern int apfs_merge_extentref_tree(struct apfs_node *src_root, struct apfs_node *dst_root, int *budget);
 extern int apfs_nonsparse_dstream_read(struct apfs_dstream_info *dstream, void *buf, size_t count, u64 offset);
 extern void apfs_nonsparse_dstream_preread(struct apfs_dstream_info *dstream);
+extern int apfs_ioc_defrag(struct file *file, void __user *user_arg);
 
 /* file.c */
 extern int apfs_file_mmap(struct file *file, struct vm_area_struct *vma);
@@ -1036,14 +1300,19 @@ extern int apfs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 /* inode.c */
 extern struct inode *apfs_iget(struct super_block *sb, u64 cnid);
 extern int apfs_update_inode(struct inode *inode, char *new_name);
+extern struct workqueue_struct *apfs_reclaim_wq;
+extern int apfs_init_reclaim_wq(void);
+extern void apfs_destroy_reclaim_wq(void);
 extern void apfs_schedule_orphan_cleanup(struct super_block *sb);
 extern void apfs_orphan_cleanup_work(struct work_struct *work);
+extern int apfs_ioc_get_reclaim_stats(struct file *file, void __user *user_arg);
 extern void apfs_evict_inode(struct inode *inode);
 extern struct inode *apfs_new_inode(struct inode *dir, umode_t mode,
 				    dev_t rdev);
 extern int apfs_create_inode_rec(struct super_block *sb, struct inode *inode,
 				 struct dentry *dentry);
 extern int apfs_inode_create_exclusive_dstream(struct inode *inode);
+extern int apfs_inode_create_dstream_rec(struct inode *inode);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 17, 0)
 extern int __apfs_write_begin(const struct kiocb *iocb, struct address_space *mapping, loff_t pos, unsigned int len, unsigned int flags, struct page **pagep, void **fsdata);
 extern int __apfs_write_end(const struct kiocb *iocb, struct address_space *mapping, loff_t pos, unsigned int len, unsigned int copied, struct page *page, void *fsdata);
@@ -1052,6 +1321,7 @@ extern int __apfs_write_begin(struct file *file, struct address_space *mapping,
 extern int __apfs_write_end(struct file *file, struct address_space *mapping, loff_t pos, unsigned int len, unsigned int copied, struct page *page, void *fsdata);
 #endif
 extern int apfs_dstream_adj_refcnt(struct apfs_dstream_info *dstream, u32 delta);
+extern int apfs_dir_stats_id_by_ino(struct super_block *sb, u64 ino, u64 *id);
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 12, 0)
 extern int apfs_setattr(struct dentry *dentry, struct iattr *iattr);
@@ -1124,9 +1394,12 @@ extern void apfs_update_node(struct apfs_node *node);
 extern int apfs_delete_node(struct apfs_node *node, int type);
 extern int apfs_node_query(struct super_block *sb, struct apfs_query *query);
 extern void apfs_node_query_first(struct apfs_query *query);
+extern int apfs_node_locate_value(struct apfs_node *node, int index, int *off);
 extern int apfs_omap_map_from_query(struct apfs_query *query, struct apfs_omap_map *map);
 extern int apfs_node_split(struct apfs_query *query);
 extern int apfs_node_locate_key(struct apfs_node *node, int index, int *off);
+extern int apfs_read_raw_key(struct super_block *sb, unsigned int flags, void *raw_key, int len, struct apfs_key *key);
+extern int apfs_key_from_query(struct apfs_query *query, struct apfs_key *key);
 extern void apfs_node_free(struct apfs_node *node);
 extern void apfs_node_free_range(struct apfs_node *node, u16 off, u16 len);
 extern bool apfs_node_has_room(struct apfs_node *node, int length, bool replace);
@@ -1134,6 +1407,10 @@ extern int apfs_node_replace(struct apfs_query *query, void *key, int key_len, v
 extern int apfs_node_insert(struct apfs_query *query, void *key, int key_len, void *val, int val_len);
 extern int apfs_create_single_rec_node(struct apfs_query *query, void *key, int key_len, void *val, int val_len);
 extern int apfs_make_empty_btree_root(struct super_block *sb, u32 subtype, u64 *oid);
+extern bool apfs_node_underflows(struct apfs_node *node);
+extern bool apfs_node_can_merge(struct apfs_node *left, struct apfs_node *right);
+extern int apfs_node_merge(struct apfs_node *left, struct apfs_node *right);
+extern int apfs_btree_dec_height(struct apfs_node *root, struct apfs_node *child);
 
 /* object.c */
 extern int apfs_obj_verify_csum(struct super_block *sb, struct buffer_head *bh);
@@ -1149,15 +1426,24 @@ extern u64 apfs_data_index_to_bno(struct super_block *sb, u32 index);
 
 /* snapshot.c */
 extern int apfs_ioc_take_snapshot(struct file *file, void __user *user_arg);
+extern int apfs_ioc_delete_snapshot(struct file *file, void __user *user_arg);
+extern int apfs_ioc_snap_diff(struct file *file, void __user *user_arg);
 extern int apfs_switch_to_snapshot(struct super_block *sb);
+extern void apfs_schedule_reaper(struct super_block *sb);
+extern void apfs_reaper_work(struct work_struct *work);
 
 /* spaceman.c */
 extern int apfs_read_spaceman(struct super_block *sb);
-extern int apfs_free_queue_insert_nocache(struct super_block *sb, u64 bno, u64 count);
 extern int apfs_free_queue_insert(struct super_block *sb, u64 bno, u64 count);
+extern int apfs_free_queue_flush_cache(struct super_block *sb);
+extern u64 apfs_free_queue_cache_nodes(struct super_block *sb);
+extern void apfs_free_queue_drop_cache(struct apfs_spaceman *sm);
 extern int apfs_spaceman_allocate_block(struct super_block *sb, u64 *bno, bool backwards);
+extern int apfs_spaceman_allocate_block_near(struct super_block *sb, u64 goal, u64 *bno);
 extern int apfs_write_ip_bitmaps(struct super_block *sb);
 extern int apfs_spaceman_get_free_blkcnt(struct super_block *sb, u64 *blkcnt);
+extern bool apfs_discard_supported(struct super_block *sb);
+extern int apfs_ioc_trim(struct file *file, void __user *user_arg);
 
 /* super.c */
 extern int apfs_map_volume_super_bno(struct super_block *sb, u64 bno, bool check);
@@ -1353,6 +1639,27 @@ __apfs_getblk(struct super_block *sb, sector_t block)
 #endif
 }
 
+/* Start a read for a block, but don't wait for it; like sb_breadahead() */
+static inline void
+apfs_sb_breadahead(struct super_block *sb, sector_t block)
+{
+	struct apfs_nxsb_info *nxi = NULL;
+	struct apfs_blkdev_info *info = NULL;
+
+	nxi = APFS_NXI(sb);
+	info = nxi->nx_blkdev_info;
+
+	if (block >= nxi->nx_tier2_bno) {
+		/* Just a hint, so let the actual read report the corruption */
+		if (!nxi->nx_tier2_info)
+			return;
+		info = nxi->nx_tier2_info;
+		block -= nxi->nx_tier2_bno;
+	}
+
+	__breadahead(info->blki_bdev, block, sb->s_blocksize);
+}
+
 /* Use instead of apfs_sb_bread() for blocks that will just be overwritten */
 static inline struct buffer_head *
 apfs_getblk(struct super_block *sb, sector_t block)
@@ -1360,8 +1667,10 @@ apfs_getblk(struct super_block *sb, sector_t block)
 	struct buffer_head *bh = NULL;
 
 	bh = __apfs_getblk(sb, block);
-	if (bh)
+	if (bh) {
 		set_buffer_uptodate(bh);
+		clear_buffer_checked(bh);
+	}
 	return bh;
 }
 
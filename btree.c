@@ -3,8 +3,10 @@
  * Copyright (C) 2018 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
  */
 
+#include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
 #include "apfs.h"
 
 struct apfs_node *apfs_query_root(const struct apfs_query *query)
@@ -27,15 +29,17 @@ static u64 apfs_catalog_base_oid(struct apfs_query *query)
 }
 
 /**
- * apfs_child_from_query - Read the child id found by a successful nonleaf query
- * @query:	the query that found the record
+ * apfs_child_from_value - Read the child id from a nonleaf record value
+ * @query:	query for the nonleaf node
+ * @off:	offset of the value in the node
+ * @len:	length of the value
  * @child:	Return parameter.  The child id found.
  *
  * Reads the child id in the nonleaf node record into @child and performs a
  * basic sanity check as a protection against crafted filesystems.  Returns 0
  * on success or -EFSCORRUPTED otherwise.
  */
-static int apfs_child_from_query(struct apfs_query *query, u64 *child)
+static int apfs_child_from_value(struct apfs_query *query, int off, int len, u64 *child)
 {
 	struct super_block *sb = query->node->object.sb;
 	char *raw = query->node->object.data;
@@ -43,40 +47,52 @@ static int apfs_child_from_query(struct apfs_query *query, u64 *child)
 	if (query->flags & APFS_QUERY_CAT && apfs_is_sealed(sb)) {
 		struct apfs_btn_index_node_val *index_val = NULL;
 
-		if (query->len != sizeof(*index_val)) {
-			apfs_err(sb, "bad sealed index value length (%d)", query->len);
+		if (len != sizeof(*index_val)) {
+			apfs_err(sb, "bad sealed index value length (%d)", len);
 			return -EFSCORRUPTED;
 		}
-		index_val = (struct apfs_btn_index_node_val *)(raw + query->off);
+		index_val = (struct apfs_btn_index_node_val *)(raw + off);
 		*child = le64_to_cpu(index_val->binv_child_oid) + apfs_catalog_base_oid(query);
 	} else {
-		if (query->len != 8) { /* The value on a nonleaf node is the child id */
-			apfs_err(sb, "bad index value length (%d)", query->len);
+		if (len != 8) { /* The value on a nonleaf node is the child id */
+			apfs_err(sb, "bad index value length (%d)", len);
 			return -EFSCORRUPTED;
 		}
-		*child = le64_to_cpup((__le64 *)(raw + query->off));
+		*child = le64_to_cpup((__le64 *)(raw + off));
 	}
 	return 0;
 }
 
+/**
+ * apfs_child_from_query - Read the child id found by a successful nonleaf query
+ * @query:	the query that found the record
+ * @child:	Return parameter.  The child id found.
+ *
+ * Returns 0 on success or -EFSCORRUPTED otherwise.
+ */
+static int apfs_child_from_query(struct apfs_query *query, u64 *child)
+{
+	return apfs_child_from_value(query, query->off, query->len, child);
+}
+
 /**
  * apfs_omap_cache_lookup - Look for an oid in an omap's cache
  * @omap:	the object map
  * @oid:	object id to look up
+ * @xid:	transaction id for the lookup
  * @bno:	on return, the block number for the oid
  *
+ * The cache is shared by all mounts of the volume, including snapshots, so a
+ * record only answers lookups for the range of xids it is known to cover.
  * Returns 0 on success, or -1 if this mapping is not cached.
  */
-static int apfs_omap_cache_lookup(struct apfs_omap *omap, u64 oid, u64 *bno)
+static int apfs_omap_cache_lookup(struct apfs_omap *omap, u64 oid, u64 xid, u64 *bno)
 {
 	struct apfs_omap_cache *cache = &omap->omap_cache;
 	struct apfs_omap_rec *record = NULL;
 	int slot;
 	int ret = -1;
 
-	if (cache->disabled)
-		return -1;
-
 	/* Uninitialized cache records use OID 0, so check this just in case */
 	if (!oid)
 		return -1;
@@ -85,7 +101,7 @@ static int apfs_omap_cache_lookup(struct apfs_omap *omap, u64 oid, u64 *bno)
 	record = &cache->recs[slot];
 
 	spin_lock(&cache->lock);
-	if (record->oid == oid) {
+	if (record->oid == oid && record->xid <= xid && xid <= record->max_xid) {
 		*bno = record->bno;
 		ret = 0;
 	}
@@ -99,22 +115,23 @@ static int apfs_omap_cache_lookup(struct apfs_omap *omap, u64 oid, u64 *bno)
  * @omap:	the object map
  * @oid:	object id of the record
  * @bno:	block number for the oid
+ * @xid:	transaction id for this version of the object
+ * @max_xid:	newest transaction id known to map to this version
  */
-static void apfs_omap_cache_save(struct apfs_omap *omap, u64 oid, u64 bno)
+static void apfs_omap_cache_save(struct apfs_omap *omap, u64 oid, u64 bno, u64 xid, u64 max_xid)
 {
 	struct apfs_omap_cache *cache = &omap->omap_cache;
 	struct apfs_omap_rec *record = NULL;
 	int slot;
 
-	if (cache->disabled)
-		return;
-
 	slot = oid & APFS_OMAP_CACHE_SLOT_MASK;
 	record = &cache->recs[slot];
 
 	spin_lock(&cache->lock);
 	record->oid = oid;
 	record->bno = bno;
+	record->xid = xid;
+	record->max_xid = max_xid;
 	spin_unlock(&cache->lock);
 }
 
@@ -129,9 +146,6 @@ static void apfs_omap_cache_delete(struct apfs_omap *omap, u64 oid)
 	struct apfs_omap_rec *record = NULL;
 	int slot;
 
-	if (cache->disabled)
-		return;
-
 	slot = oid & APFS_OMAP_CACHE_SLOT_MASK;
 	record = &cache->recs[slot];
 
@@ -139,6 +153,8 @@ static void apfs_omap_cache_delete(struct apfs_omap *omap, u64 oid)
 	if (record->oid == oid) {
 		record->oid = 0;
 		record->bno = 0;
+		record->xid = 0;
+		record->max_xid = 0;
 	}
 	spin_unlock(&cache->lock);
 }
@@ -186,10 +202,11 @@ static int apfs_omap_lookup_block_with_xid(struct super_block *sb, struct apfs_o
 	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	struct apfs_query *query;
 	struct apfs_omap_map map = {0};
+	u64 max_xid;
 	int ret = 0;
 
 	if (!write) {
-		if (!apfs_omap_cache_lookup(omap, id, block))
+		if (!apfs_omap_cache_lookup(omap, id, xid, block))
 			return 0;
 	}
 
@@ -212,6 +229,11 @@ static int apfs_omap_lookup_block_with_xid(struct super_block *sb, struct apfs_o
 			   query->node->object.block_nr);
 		goto fail;
 	}
+	/* The object was deleted, only older snapshots still have it */
+	if (map.flags & APFS_OMAP_VAL_DELETED) {
+		ret = -ENODATA;
+		goto fail;
+	}
 	*block = map.bno;
 
 	if (write) {
@@ -243,10 +265,17 @@ static int apfs_omap_lookup_block_with_xid(struct super_block *sb, struct apfs_o
 			apfs_err(sb, "CoW omap update failed (oid 0x%llx, xid 0x%llx)", id, xid);
 
 		*block = new_bh->b_blocknr;
+		map.xid = nxi->nx_xid;
 		brelse(new_bh);
 	}
 
-	apfs_omap_cache_save(omap, id, *block);
+	/*
+	 * A lookup for the current transaction finds the newest version, which
+	 * will stay valid until it gets replaced. Older xids are only known to
+	 * map to this version up to the one that was requested.
+	 */
+	max_xid = xid >= nxi->nx_xid ? U64_MAX : xid;
+	apfs_omap_cache_save(omap, id, *block, map.xid, max_xid);
 
 fail:
 	apfs_free_query(query);
@@ -283,6 +312,22 @@ int apfs_omap_lookup_newest_block(struct super_block *sb, struct apfs_omap *omap
 	return apfs_omap_lookup_block_with_xid(sb, omap, id, -1, block, write);
 }
 
+/**
+ * apfs_omap_lookup_snap_block - Find the bno of a virtual object in a snapshot
+ * @sb:		filesystem superblock
+ * @omap:	object map to be searched
+ * @id:		id of the object
+ * @xid:	transaction id for the snapshot, or -1 for the newest version
+ * @block:	on return, the found block number
+ *
+ * Read-only lookup for any snapshot, not just the mounted one. Returns 0 on
+ * success or a negative error code in case of failure.
+ */
+int apfs_omap_lookup_snap_block(struct super_block *sb, struct apfs_omap *omap, u64 id, u64 xid, u64 *block)
+{
+	return apfs_omap_lookup_block_with_xid(sb, omap, id, xid, block, false /* write */);
+}
+
 /**
  * apfs_create_omap_rec - Create a record in the volume's omap tree
  * @sb:		filesystem superblock
@@ -326,19 +371,69 @@ int apfs_create_omap_rec(struct super_block *sb, u64 oid, u64 bno)
 		goto fail;
 	}
 
-	apfs_omap_cache_save(omap, oid, bno);
+	apfs_omap_cache_save(omap, oid, bno, nxi->nx_xid, U64_MAX);
 
 fail:
 	apfs_free_query(query);
 	return ret;
 }
 
+/**
+ * apfs_omap_has_older_version - Check if an object has an older omap record
+ * @sb:		filesystem superblock
+ * @oid:	object id
+ * @xid:	transaction id for the current record of the object
+ * @found:	on return, the result
+ *
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_omap_has_older_version(struct super_block *sb, u64 oid, u64 xid, bool *found)
+{
+	struct apfs_omap *omap = APFS_SB(sb)->s_omap;
+	struct apfs_omap_key *raw_key = NULL;
+	struct apfs_query *query = NULL;
+	int ret;
+
+	*found = false;
+	if (!xid)
+		return 0;
+
+	query = apfs_alloc_query(omap->omap_root, NULL /* parent */);
+	if (!query)
+		return -ENOMEM;
+	apfs_init_omap_key(oid, xid - 1, &query->key);
+	query->flags |= APFS_QUERY_OMAP;
+
+	ret = apfs_btree_query(sb, &query);
+	if (ret == -ENODATA) {
+		ret = 0;
+		goto out;
+	}
+	if (ret) {
+		apfs_err(sb, "query failed (oid 0x%llx, xid 0x%llx)", oid, xid - 1);
+		goto out;
+	}
+	if (query->key_len != sizeof(*raw_key)) {
+		apfs_err(sb, "bad key length (%d)", query->key_len);
+		ret = -EFSCORRUPTED;
+		goto out;
+	}
+	raw_key = (void *)query->node->object.data + query->key_off;
+	*found = le64_to_cpu(raw_key->ok_oid) == oid;
+out:
+	apfs_free_query(query);
+	return ret;
+}
+
 /**
  * apfs_delete_omap_rec - Delete an existing record from the volume's omap tree
  * @sb:		filesystem superblock
  * @oid:	object id for the record
  *
- * Returns 0 on success or a negative error code in case of failure.
+ * If a snapshot still needs an older version of the object, a deletion marker
+ * is left behind instead, so that the snapshot reaper can tell later when that
+ * version stops being needed. Returns 0 on success or a negative error code in
+ * case of failure.
  */
 int apfs_delete_omap_rec(struct super_block *sb, u64 oid)
 {
@@ -346,6 +441,10 @@ int apfs_delete_omap_rec(struct super_block *sb, u64 oid)
 	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	struct apfs_omap *omap = sbi->s_omap;
 	struct apfs_query *query;
+	struct apfs_omap_map map = {0};
+	struct apfs_omap_key raw_key;
+	struct apfs_omap_val raw_val;
+	bool older = false;
 	int ret;
 
 	query = apfs_alloc_query(omap->omap_root, NULL /* parent */);
@@ -364,40 +463,149 @@ int apfs_delete_omap_rec(struct super_block *sb, u64 oid)
 		apfs_err(sb, "query failed (oid 0x%llx)", oid);
 		goto fail;
 	}
-	ret = apfs_btree_remove(query);
+	ret = apfs_omap_map_from_query(query, &map);
 	if (ret) {
-		apfs_err(sb, "removal failed (oid 0x%llx)", oid);
+		apfs_alert(sb, "bad object map leaf block: 0x%llx", query->node->object.block_nr);
 		goto fail;
 	}
-	apfs_omap_cache_delete(omap, oid);
 
+	if (!omap->omap_latest_snap) {
+		ret = apfs_btree_remove(query);
+		if (ret)
+			apfs_err(sb, "removal failed (oid 0x%llx)", oid);
+		goto out;
+	}
+
+	raw_key.ok_oid = cpu_to_le64(oid);
+	raw_val.ov_flags = cpu_to_le32(APFS_OMAP_VAL_DELETED);
+	raw_val.ov_size = cpu_to_le32(sb->s_blocksize);
+	raw_val.ov_paddr = 0;
+
+	if (apfs_xid_in_snapshot(omap, map.xid)) {
+		/* The current version belongs to a snapshot, so keep it */
+		raw_key.ok_xid = cpu_to_le64(nxi->nx_xid);
+		ret = apfs_btree_insert(query, &raw_key, sizeof(raw_key), &raw_val, sizeof(raw_val));
+		if (ret)
+			apfs_err(sb, "tombstone insertion failed (oid 0x%llx)", oid);
+		goto out;
+	}
+
+	/* Only snapshots can hold on to versions older than the current one */
+	ret = apfs_omap_has_older_version(sb, oid, map.xid, &older);
+	if (ret)
+		goto fail;
+	if (older) {
+		raw_key.ok_xid = cpu_to_le64(map.xid);
+		ret = apfs_btree_replace(query, &raw_key, sizeof(raw_key), &raw_val, sizeof(raw_val));
+		if (ret)
+			apfs_err(sb, "tombstone replacement failed (oid 0x%llx)", oid);
+	} else {
+		ret = apfs_btree_remove(query);
+		if (ret)
+			apfs_err(sb, "removal failed (oid 0x%llx)", oid);
+	}
+out:
+	if (!ret)
+		apfs_omap_cache_delete(omap, oid);
 fail:
 	apfs_free_query(query);
 	return ret;
 }
 
 /**
- * apfs_alloc_query - Allocates a query structure
- * @node:	node to be searched
- * @parent:	query for the parent node
- *
- * Callers other than apfs_btree_query() should set @parent to NULL, and @node
- * to the root of the b-tree. They should also initialize most of the query
- * fields themselves; when @parent is not NULL the query will inherit them.
+ * apfs_delete_omap_version - Delete an old version of a virtual object
+ * @sb:		filesystem superblock
+ * @oid:	object id
+ * @xid:	transaction id for the version to delete
  *
- * Returns the allocated query, or NULL in case of failure.
+ * Removes the exact omap record and frees the block it mapped, for versions
+ * that only a deleted snapshot needed. Returns 0 on success or a negative
+ * error code in case of failure.
  */
-struct apfs_query *apfs_alloc_query(struct apfs_node *node,
-				    struct apfs_query *parent)
+int apfs_delete_omap_version(struct super_block *sb, u64 oid, u64 xid)
 {
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_superblock *vsb_raw = sbi->s_vsb_raw;
+	struct apfs_omap *omap = sbi->s_omap;
+	struct apfs_omap_map map = {0};
 	struct apfs_query *query;
+	int ret;
 
-	query = kzalloc(sizeof(*query), GFP_KERNEL);
+	query = apfs_alloc_query(omap->omap_root, NULL /* parent */);
 	if (!query)
-		return NULL;
+		return -ENOMEM;
+	apfs_init_omap_key(oid, xid, &query->key);
+	query->flags |= APFS_QUERY_OMAP | APFS_QUERY_EXACT;
+
+	ret = apfs_btree_query(sb, &query);
+	if (ret) {
+		apfs_err(sb, "query failed (oid 0x%llx, xid 0x%llx)", oid, xid);
+		goto fail;
+	}
+	ret = apfs_omap_map_from_query(query, &map);
+	if (ret) {
+		apfs_alert(sb, "bad object map leaf block: 0x%llx", query->node->object.block_nr);
+		goto fail;
+	}
+	ret = apfs_btree_remove(query);
+	if (ret) {
+		apfs_err(sb, "removal failed (oid 0x%llx, xid 0x%llx)", oid, xid);
+		goto fail;
+	}
+	apfs_omap_cache_delete(omap, oid);
+
+	/* Deletion markers don't map any block */
+	if (map.flags & APFS_OMAP_VAL_DELETED)
+		goto fail;
+
+	ret = apfs_free_queue_insert(sb, map.bno, 1);
+	if (ret) {
+		apfs_err(sb, "free queue insertion failed for 0x%llx", map.bno);
+		goto fail;
+	}
+	apfs_assert_in_transaction(sb, &vsb_raw->apfs_o);
+	le64_add_cpu(&vsb_raw->apfs_fs_alloc_count, -1);
+	le64_add_cpu(&vsb_raw->apfs_total_blocks_freed, 1);
+
+fail:
+	apfs_free_query(query);
+	return ret;
+}
+
+static struct kmem_cache *apfs_query_cachep;
 
+/**
+ * apfs_init_query_cache - Create the slab cache for query structures
+ *
+ * Returns 0 on success, or -ENOMEM in case of failure.
+ */
+int __init apfs_init_query_cache(void)
+{
+	apfs_query_cachep = kmem_cache_create("apfs_query_cache", sizeof(struct apfs_query), 0, 0, NULL);
+	if (!apfs_query_cachep)
+		return -ENOMEM;
+	return 0;
+}
+
+/**
+ * apfs_destroy_query_cache - Destroy the slab cache for query structures
+ */
+void apfs_destroy_query_cache(void)
+{
+	kmem_cache_destroy(apfs_query_cachep);
+}
+
+/**
+ * apfs_init_query - Set up a zeroed query structure for a node
+ * @query:	the query
+ * @node:	node to be searched
+ * @parent:	query for the parent node
+ */
+static void apfs_init_query(struct apfs_query *query, struct apfs_node *node, struct apfs_query *parent)
+{
 	/* To be released by free_query. */
 	query->node = node;
+	query->ra_edge = -1;
 
 	if (parent) {
 		query->key = parent->key;
@@ -414,10 +622,71 @@ struct apfs_query *apfs_alloc_query(struct apfs_node *node,
 		query->index = -1;
 	else
 		query->index = node->records;
+}
+
+/**
+ * apfs_alloc_query - Allocates a query structure
+ * @node:	node to be searched
+ * @parent:	query for the parent node
+ *
+ * Callers other than apfs_btree_query() should set @parent to NULL, and @node
+ * to the root of the b-tree. They should also initialize most of the query
+ * fields themselves; when @parent is not NULL the query will inherit them.
+ *
+ * Returns the allocated query, or NULL in case of failure.
+ */
+struct apfs_query *apfs_alloc_query(struct apfs_node *node,
+				    struct apfs_query *parent)
+{
+	struct apfs_query *query;
+
+	query = kmem_cache_zalloc(apfs_query_cachep, GFP_KERNEL);
+	if (!query)
+		return NULL;
+	apfs_init_query(query, node, parent);
+	return query;
+}
+
+/**
+ * apfs_reuse_query - Set up a query for a child node, reusing a spare one
+ * @spare:	spare query to reuse, or NULL if none is left; set to NULL
+ * @node:	node to be searched
+ * @parent:	query for the parent node
+ *
+ * Queries that go back up the tree to continue the search in a sibling free
+ * the child query first, only to allocate a new one right after. Reusing it
+ * instead keeps the allocator out of long scans. Returns the query, or NULL
+ * in case of failure.
+ */
+static struct apfs_query *apfs_reuse_query(struct apfs_query **spare, struct apfs_node *node, struct apfs_query *parent)
+{
+	struct apfs_query *query = *spare;
 
+	if (!query)
+		return apfs_alloc_query(node, parent);
+	*spare = NULL;
+
+	memset(query, 0, sizeof(*query));
+	apfs_init_query(query, node, parent);
 	return query;
 }
 
+/**
+ * apfs_release_to_spare - Free a child query's node and keep it as a spare
+ * @query:	the query to release, which must have no parent
+ * @spare:	spare query to keep, freed first if already set
+ */
+static void apfs_release_to_spare(struct apfs_query *query, struct apfs_query **spare)
+{
+	ASSERT(!query->parent && query->depth != 0);
+
+	apfs_node_free(query->node);
+	query->node = NULL;
+	if (*spare)
+		kmem_cache_free(apfs_query_cachep, *spare);
+	*spare = query;
+}
+
 /**
  * apfs_free_query - Free a query structure
  * @query: query to free
@@ -432,7 +701,7 @@ void apfs_free_query(struct apfs_query *query)
 		/* The caller decides whether to free the root node */
 		if (query->depth != 0)
 			apfs_node_free(query->node);
-		kfree(query);
+		kmem_cache_free(apfs_query_cachep, query);
 		query = parent;
 	}
 }
@@ -491,6 +760,56 @@ static int apfs_query_set_before_first(struct super_block *sb, struct apfs_query
 	return -EFSCORRUPTED;
 }
 
+/**
+ * apfs_query_readahead - Start reading the next few leaves for a b-tree scan
+ * @sb:		filesystem superblock
+ * @query:	multiple query for the parent of the leaves
+ * @step:	direction of the scan (1 for forwards, -1 for backwards)
+ *
+ * Scans step from leaf to leaf, and each one is read synchronously only once
+ * it's needed. Instead start the reads for the next siblings in the direction
+ * of the scan, a window at a time, so that cold scans don't have to wait for
+ * the device on every single leaf. This is just a hint, so errors are ignored.
+ */
+static void apfs_query_readahead(struct super_block *sb, struct apfs_query *query, int step)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_node *node = query->node;
+	u32 storage = apfs_query_storage(query);
+	struct blk_plug plug;
+	int i, index, off, len;
+	u64 child, bno;
+
+	/* Ephemeral nodes are in memory, and index nodes are usually cached */
+	if (storage == APFS_OBJ_EPHEMERAL || apfs_node_level(node) != 1)
+		return;
+	/* Wait until the scan reaches the end of the last window */
+	if (query->ra_edge >= 0 && query->index != query->ra_edge)
+		return;
+
+	blk_start_plug(&plug);
+	for (i = 1; i <= APFS_BTREE_RA_NODES; ++i) {
+		index = query->index + i * step;
+		if (index < 0 || index >= node->records)
+			break;
+		len = apfs_node_locate_value(node, index, &off);
+		if (!len || apfs_child_from_value(query, off, len, &child))
+			break;
+
+		if (storage == APFS_OBJ_PHYSICAL)
+			bno = child;
+		else if (apfs_omap_lookup_block(sb, sbi->s_omap, child, &bno, false /* write */))
+			break;
+		apfs_sb_breadahead(sb, bno);
+		query->ra_edge = index;
+	}
+	blk_finish_plug(&plug);
+
+	/* Don't try again for this window if it got cut short */
+	if (query->ra_edge < 0)
+		query->ra_edge = query->index;
+}
+
 /**
  * apfs_btree_query - Execute a query on a b-tree
  * @sb:		filesystem superblock
@@ -509,12 +828,14 @@ int apfs_btree_query(struct super_block *sb, struct apfs_query **query)
 {
 	struct apfs_node *node;
 	struct apfs_query *parent;
+	struct apfs_query *spare = NULL;
 	u64 child_id;
 	u32 storage = apfs_query_storage(*query);
+	bool crossed = false;
 	int err;
 
 next_node:
-	if ((*query)->depth >= 12) {
+	if ((*query)->depth >= APFS_BTREE_MAX_HEIGHT) {
 		/*
 		 * We need a maximum depth for the tree so we can't loop
 		 * forever if the filesystem is damaged. 12 should be more
@@ -548,14 +869,15 @@ next_node:
 		/* Move back up one level and continue the query */
 		parent = (*query)->parent;
 		(*query)->parent = NULL; /* Don't free the parent */
-		apfs_free_query(*query);
+		apfs_release_to_spare(*query, &spare);
 		*query = parent;
+		crossed = true;
 		goto next_node;
 	} else if (err) {
 		goto fail;
 	}
 	if (apfs_node_is_leaf((*query)->node)) /* All done */
-		return 0;
+		goto out;
 
 	err = apfs_child_from_query(*query, &child_id);
 	if (err) {
@@ -564,6 +886,14 @@ next_node:
 		goto fail;
 	}
 
+	/*
+	 * A multiple query that moved on to a sibling will probably need the
+	 * next ones as well. Most lookups never leave their first leaf, so
+	 * don't bother on the initial descent.
+	 */
+	if (crossed && (*query)->flags & (APFS_QUERY_NEXT | APFS_QUERY_PREV))
+		apfs_query_readahead(sb, *query, (*query)->flags & APFS_QUERY_PREV ? 1 : -1);
+
 	/* Now go a level deeper and search the child */
 	node = apfs_read_node(sb, child_id, storage, false /* write */);
 	if (IS_ERR(node)) {
@@ -580,7 +910,7 @@ next_node:
 	 * to be continued later.
 	 */
 	parent = *query;
-	*query = apfs_alloc_query(node, parent);
+	*query = apfs_reuse_query(&spare, node, parent);
 	if (!*query) {
 		apfs_node_free(node);
 		*query = parent;
@@ -593,49 +923,165 @@ next_node:
 fail:
 	/* Don't leave stale record info here or some callers will use it */
 	(*query)->key_len = (*query)->len = 0;
+out:
+	if (spare)
+		kmem_cache_free(apfs_query_cachep, spare);
 	return err;
 }
 
-static int __apfs_btree_replace(struct apfs_query *query, void *key, int key_len, void *val, int val_len);
-
 /**
- * apfs_query_join_transaction - Add the found node to the current transaction
- * @query: query that found the node
+ * apfs_query_leaf_block - Find the block for the leaf that may hold a record
+ * @sb:		filesystem superblock
+ * @query:	the query to execute
+ * @bno:	on return, the block number for the leaf
+ *
+ * Like apfs_btree_query(), but stops at the last index level and doesn't read
+ * the leaf itself. Returns 0 on success, -ENODATA if the root is a leaf or the
+ * key comes before all records, or another negative error code in case of
+ * failure.
  */
-int apfs_query_join_transaction(struct apfs_query *query)
+static int apfs_query_leaf_block(struct super_block *sb, struct apfs_query **query, u64 *bno)
 {
-	struct apfs_node *node = query->node;
-	struct super_block *sb = node->object.sb;
-	u64 oid = node->object.oid;
-	u32 storage = apfs_query_storage(query);
-	struct apfs_obj_phys *raw = NULL;
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_node *node;
+	struct apfs_query *parent;
+	u32 storage = apfs_query_storage(*query);
+	u64 child_id;
+	int err;
 
-	/*
-	 * Ephemeral objects are checkpoint data, and all of their xids get
-	 * updated on commit. There is no real need to do it here as well, but
-	 * it's better for consistency with the other object types.
-	 */
-	if (storage == APFS_OBJ_EPHEMERAL) {
-		ASSERT(node->object.ephemeral);
-		raw = (void *)node->object.data;
-		raw->o_xid = cpu_to_le64(APFS_NXI(sb)->nx_xid);
-		return 0;
-	}
+	while ((*query)->depth < 12) {
+		if (apfs_node_is_leaf((*query)->node))
+			return -ENODATA;
 
-	if (buffer_trans(node->object.o_bh)) /* Already in the transaction */
-		return 0;
-	/* Root nodes should join the transaction before the query is created */
-	ASSERT(!apfs_node_is_root(node));
+		err = apfs_node_query(sb, *query);
+		if (err)
+			return err;
+		err = apfs_child_from_query(*query, &child_id);
+		if (err)
+			return err;
 
-	node = apfs_read_node(sb, oid, storage, true /* write */);
-	if (IS_ERR(node)) {
-		apfs_err(sb, "Cow failed for node 0x%llx", oid);
-		return PTR_ERR(node);
-	}
-	apfs_node_free(query->node);
-	query->node = node;
+		if (apfs_node_level((*query)->node) == 1) {
+			if (storage == APFS_OBJ_PHYSICAL) {
+				*bno = child_id;
+				return 0;
+			}
+			if (storage != APFS_OBJ_VIRTUAL)
+				return -EOPNOTSUPP;
+			return apfs_omap_lookup_block(sb, sbi->s_omap, child_id, bno, false /* write */);
+		}
 
-	if (storage == APFS_OBJ_PHYSICAL && query->parent) {
+		node = apfs_read_node(sb, child_id, storage, false /* write */);
+		if (IS_ERR(node))
+			return PTR_ERR(node);
+		parent = *query;
+		*query = apfs_alloc_query(node, parent);
+		if (!*query) {
+			apfs_node_free(node);
+			*query = parent;
+			return -ENOMEM;
+		}
+	}
+	return -EFSCORRUPTED;
+}
+
+static int apfs_cmp_u64(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	if (x == y)
+		return 0;
+	return x < y ? -1 : 1;
+}
+
+/**
+ * apfs_catalog_readahead - Start reading the catalog leaves for some inodes
+ * @sb:		filesystem superblock
+ * @inos:	inode numbers, will be sorted in place
+ * @count:	number of entries in @inos
+ *
+ * Descends the catalog index for each inode record and starts reading the
+ * leaves, without waiting for them. The records for files in one directory
+ * are usually clustered together, so each leaf is only requested once. This
+ * is just a hint for later reads, so errors are ignored.
+ */
+void apfs_catalog_readahead(struct super_block *sb, u64 *inos, int count)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_query *query = NULL;
+	struct blk_plug plug;
+	u64 bno, last_bno = 0;
+	int i, err;
+
+	sort(inos, count, sizeof(*inos), apfs_cmp_u64, NULL);
+
+	blk_start_plug(&plug);
+	for (i = 0; i < count; ++i) {
+		if (i > 0 && inos[i] == inos[i - 1])
+			continue;
+
+		query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
+		if (!query)
+			break;
+		apfs_init_inode_key(inos[i], &query->key);
+		query->flags = APFS_QUERY_CAT | APFS_QUERY_EXACT;
+
+		err = apfs_query_leaf_block(sb, &query, &bno);
+		apfs_free_query(query);
+		query = NULL;
+		if (err == -ENODATA)
+			continue;
+		if (err)
+			break;
+
+		if (bno != last_bno)
+			apfs_sb_breadahead(sb, bno);
+		last_bno = bno;
+	}
+	blk_finish_plug(&plug);
+}
+
+static int __apfs_btree_replace(struct apfs_query *query, void *key, int key_len, void *val, int val_len);
+
+/**
+ * apfs_query_join_transaction - Add the found node to the current transaction
+ * @query: query that found the node
+ */
+int apfs_query_join_transaction(struct apfs_query *query)
+{
+	struct apfs_node *node = query->node;
+	struct super_block *sb = node->object.sb;
+	u64 oid = node->object.oid;
+	u32 storage = apfs_query_storage(query);
+	struct apfs_obj_phys *raw = NULL;
+
+	/*
+	 * Ephemeral objects are checkpoint data, and all of their xids get
+	 * updated on commit. There is no real need to do it here as well, but
+	 * it's better for consistency with the other object types.
+	 */
+	if (storage == APFS_OBJ_EPHEMERAL) {
+		ASSERT(node->object.ephemeral);
+		raw = (void *)node->object.data;
+		raw->o_xid = cpu_to_le64(APFS_NXI(sb)->nx_xid);
+		return 0;
+	}
+
+	if (buffer_trans(node->object.o_bh)) /* Already in the transaction */
+		return 0;
+	/* Root nodes should join the transaction before the query is created */
+	ASSERT(!apfs_node_is_root(node));
+
+	node = apfs_read_node(sb, oid, storage, true /* write */);
+	if (IS_ERR(node)) {
+		apfs_err(sb, "Cow failed for node 0x%llx", oid);
+		return PTR_ERR(node);
+	}
+	apfs_node_free(query->node);
+	query->node = node;
+	/* Any other path that goes through this node is now stale */
+	++APFS_NXI(sb)->nx_btree_gen;
+
+	if (storage == APFS_OBJ_PHYSICAL && query->parent) {
 		__le64 bno = cpu_to_le64(node->object.block_nr);
 
 		/* The parent node needs to report the new location */
@@ -803,6 +1249,7 @@ int __apfs_btree_insert(struct apfs_query *query, void *key, int key_len, void *
 		apfs_err(sb, "query join failed");
 		return err;
 	}
+	++APFS_NXI(sb)->nx_btree_gen;
 
 	node = query->node;
 	node_raw = (void *)node->object.data;
@@ -890,6 +1337,160 @@ int apfs_btree_insert(struct apfs_query *query, void *key, int key_len, void *va
 	return 0;
 }
 
+/**
+ * apfs_query_reseek - Move a leaf query to the insertion point for its key
+ * @query:	query chain to move
+ * @root:	root node of the query chain
+ *
+ * Like apfs_query_refresh(), but the search may end up in a different leaf.
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_query_reseek(struct apfs_query *query, struct apfs_node *root)
+{
+	struct super_block *sb = root->object.sb;
+	struct apfs_query *new_query = NULL;
+	int err;
+
+	new_query = apfs_alloc_query(root, NULL /* parent */);
+	if (!new_query)
+		return -ENOMEM;
+	new_query->key = query->key;
+	new_query->flags = query->flags & ~(APFS_QUERY_DONE | APFS_QUERY_NEXT);
+
+	err = apfs_btree_query(sb, &new_query);
+	if (err && err != -ENODATA) {
+		apfs_err(sb, "failed to rerun");
+		goto out;
+	}
+	err = 0;
+
+	/* The old path gets freed along with the new query structures */
+	ASSERT(new_query->depth == query->depth);
+	swap(query->node, new_query->node);
+	swap(query->parent, new_query->parent);
+	query->index = new_query->index;
+	query->key_off = new_query->key_off;
+	query->key_len = new_query->key_len;
+	query->off = new_query->off;
+	query->len = new_query->len;
+
+out:
+	apfs_free_query(new_query);
+	return err;
+}
+
+/**
+ * apfs_query_key_fits_next - Check if a key belongs right after a leaf record
+ * @query:	query for the leaf record, with all of its ancestors
+ * @key:	the key to check, which must come after the record
+ *
+ * Returns 1 if @key comes before the next record in the tree, so that it can
+ * be inserted without a new search; 0 if it doesn't; or a negative error code
+ * in case of failure.
+ */
+static int apfs_query_key_fits_next(struct apfs_query *query, struct apfs_key *key)
+{
+	struct super_block *sb = query->node->object.sb;
+	struct apfs_query *curr = NULL;
+	struct apfs_node *node = NULL;
+	struct apfs_key next_key;
+	int off, len, err;
+
+	/* The first key in the next subtree is the lower bound for the next one */
+	for (curr = query; curr; curr = curr->parent) {
+		node = curr->node;
+		if (curr->index + 1 >= node->records)
+			continue;
+		len = apfs_node_locate_key(node, curr->index + 1, &off);
+		if (!len) {
+			apfs_err(sb, "bad key for index %d", curr->index + 1);
+			return -EFSCORRUPTED;
+		}
+		err = apfs_read_raw_key(sb, curr->flags, node->object.data + off, len, &next_key);
+		if (err) {
+			apfs_err(sb, "bad node key in block 0x%llx", node->object.block_nr);
+			return err;
+		}
+		return apfs_keycmp(key, &next_key) < 0;
+	}
+	return 1;
+}
+
+/**
+ * apfs_btree_set_bulk - Set or clear the bulk insertion flag on a query chain
+ * @query:	the query
+ * @bulk:	set the flag?
+ */
+static void apfs_btree_set_bulk(struct apfs_query *query, bool bulk)
+{
+	for (; query; query = query->parent) {
+		if (bulk)
+			query->flags |= APFS_QUERY_BULK;
+		else
+			query->flags &= ~APFS_QUERY_BULK;
+	}
+}
+
+/**
+ * apfs_btree_insert_batch - Insert a sorted array of records into a b-tree
+ * @query:	query run to search for the first record
+ * @recs:	the records, sorted by key, none of them already in the tree
+ * @count:	number of records in @recs
+ *
+ * Each record is placed right after the previous one, with no new search from
+ * the root as long as no other record in the tree gets in the way. Nodes that
+ * fill up this way are split near their end, so that the records are packed
+ * tightly. On success, returns 0 and sets @query to the last new record;
+ * returns a negative error code in case of failure.
+ */
+int apfs_btree_insert_batch(struct apfs_query *query, struct apfs_btree_rec *recs, int count)
+{
+	struct super_block *sb = NULL;
+	struct apfs_node *root = NULL;
+	struct apfs_btree_rec *rec = NULL;
+	struct apfs_key key;
+	int err = 0;
+	int i;
+
+	root = apfs_query_root(query);
+	ASSERT(apfs_node_is_root(root));
+	ASSERT(apfs_node_is_leaf(query->node));
+	sb = root->object.sb;
+
+	apfs_btree_set_bulk(query, true);
+	for (i = 0; i < count; ++i) {
+		rec = &recs[i];
+		err = apfs_read_raw_key(sb, query->flags, rec->key, rec->key_len, &key);
+		if (err) {
+			apfs_err(sb, "bad key for record %d", i);
+			break;
+		}
+
+		if (i > 0) {
+			err = apfs_query_key_fits_next(query, &key);
+			if (err < 0)
+				break;
+			query->key = key;
+			if (!err) {
+				/* Some other record is in the way, search again */
+				err = apfs_query_reseek(query, root);
+				if (err) {
+					apfs_err(sb, "query reseek failed");
+					break;
+				}
+			}
+		}
+
+		err = apfs_btree_insert(query, rec->key, rec->key_len, rec->val, rec->val_len);
+		if (err) {
+			apfs_err(sb, "insertion failed for record %d", i);
+			break;
+		}
+	}
+	apfs_btree_set_bulk(query, false);
+	return err;
+}
+
 /**
  * __apfs_btree_remove - Remove a record from a b-tree (at any level)
  * @query:	exact query that found the record
@@ -912,6 +1513,7 @@ static int __apfs_btree_remove(struct apfs_query *query)
 		apfs_err(sb, "query join failed");
 		return err;
 	}
+	++APFS_NXI(sb)->nx_btree_gen;
 
 	node = query->node;
 	node_raw = (void *)query->node->object.data;
@@ -990,6 +1592,252 @@ static int __apfs_btree_remove(struct apfs_query *query)
 	return 0;
 }
 
+/**
+ * apfs_query_set_index - Point a query to a given record in its node
+ * @query:	the query
+ * @index:	index of the record (may be -1)
+ *
+ * Returns 0 on success, or -EFSCORRUPTED if the record can't be located.
+ */
+static int apfs_query_set_index(struct apfs_query *query, int index)
+{
+	struct apfs_node *node = query->node;
+
+	query->index = index;
+	if (index < 0) {
+		query->key_len = query->len = 0;
+		return 0;
+	}
+	query->key_len = apfs_node_locate_key(node, index, &query->key_off);
+	query->len = apfs_node_locate_value(node, index, &query->off);
+	if (!query->key_len || !query->len) {
+		apfs_err(node->object.sb, "bad record for index %d", index);
+		return -EFSCORRUPTED;
+	}
+	return 0;
+}
+
+/**
+ * apfs_btree_merge_node - Merge a sparse node with one of its siblings
+ * @query:	query for the node, with all of its ancestors
+ *
+ * The records of the right node of the pair get moved to the left one, and the
+ * right node is deleted. On success returns 0, and @query and its ancestors are
+ * left pointing to the same records as before, wherever they are now. Returns
+ * a negative error code in case of failure.
+ */
+static int apfs_btree_merge_node(struct apfs_query *query)
+{
+	struct apfs_node *node = query->node;
+	struct super_block *sb = node->object.sb;
+	struct apfs_query *parent = query->parent;
+	struct apfs_query *sib_query = NULL;
+	struct apfs_node *sibling = NULL, *left = NULL, *right = NULL;
+	u32 storage = apfs_query_storage(query);
+	int index, sib_index, left_count, off, len;
+	u64 child_id;
+	int err;
+
+	if (!parent || !apfs_node_underflows(node))
+		return 0;
+
+	/* Prefer the left sibling, so that the query's node is the one removed */
+	index = parent->index;
+	if (index > 0)
+		sib_index = index - 1;
+	else if (index + 1 < parent->node->records)
+		sib_index = index + 1;
+	else
+		return 0;
+
+	len = apfs_node_locate_value(parent->node, sib_index, &off);
+	if (!len || apfs_child_from_value(parent, off, len, &child_id)) {
+		apfs_alert(sb, "bad index block: 0x%llx", parent->node->object.block_nr);
+		return -EFSCORRUPTED;
+	}
+	sibling = apfs_read_node(sb, child_id, storage, false /* write */);
+	if (IS_ERR(sibling)) {
+		apfs_err(sb, "failed to read sibling 0x%llx of node 0x%llx", child_id, node->object.oid);
+		return PTR_ERR(sibling);
+	}
+	if (!(sib_index < index ? apfs_node_can_merge(sibling, node) : apfs_node_can_merge(node, sibling))) {
+		apfs_node_free(sibling);
+		return 0;
+	}
+
+	/* Both nodes get changed or deleted, so they must join the transaction */
+	err = apfs_query_set_index(parent, index);
+	if (err)
+		goto fail_sibling;
+	err = apfs_query_join_transaction(query);
+	if (err) {
+		apfs_err(sb, "query join failed");
+		goto fail_sibling;
+	}
+	node = query->node;
+	err = apfs_query_set_index(parent, sib_index);
+	if (err)
+		goto fail_sibling;
+	sib_query = apfs_alloc_query(sibling, parent);
+	if (!sib_query) {
+		err = -ENOMEM;
+		goto fail_sibling;
+	}
+	sibling = NULL;
+	err = apfs_query_join_transaction(sib_query);
+	if (err) {
+		apfs_err(sb, "query join failed");
+		goto out;
+	}
+
+	if (sib_index < index) {
+		left = sib_query->node;
+		right = node;
+	} else {
+		left = node;
+		right = sib_query->node;
+	}
+	left_count = left->records;
+	err = apfs_node_merge(left, right);
+	if (err) {
+		apfs_err(sb, "failed to merge node 0x%llx into 0x%llx", right->object.oid, left->object.oid);
+		goto out;
+	}
+
+	/* The index record for the right node is never the first in the parent */
+	err = apfs_query_set_index(parent, max(index, sib_index));
+	if (err)
+		goto out;
+	err = __apfs_btree_remove(parent);
+	if (err) {
+		apfs_err(sb, "parent index removal failed");
+		goto out;
+	}
+	err = apfs_query_set_index(parent, parent->index);
+	if (err)
+		goto out;
+
+	apfs_btree_change_node_count(query, -1 /* change */);
+	err = apfs_delete_node(right, query->flags & APFS_QUERY_TREE_MASK);
+	if (err) {
+		apfs_err(sb, "node deletion failed");
+		goto out;
+	}
+
+	if (right == node) {
+		/* The records from this node now follow those of its sibling */
+		query->node = left;
+		sib_query->node = right;
+		err = apfs_query_set_index(query, query->index + left_count);
+	} else {
+		err = apfs_query_set_index(query, query->index);
+	}
+
+out:
+	sib_query->parent = NULL; /* Don't free the parent */
+	apfs_free_query(sib_query);
+	return err;
+
+fail_sibling:
+	apfs_node_free(sibling);
+	apfs_query_set_index(parent, index);
+	return err;
+}
+
+/**
+ * apfs_btree_collapse_root - Decrease the height of a b-tree if possible
+ * @query:	query for a node, with all of its ancestors
+ *
+ * Root nodes with a single child get replaced by that child, and the query
+ * chain loses its top level. Returns 0 on success, or a negative error code
+ * in case of failure.
+ */
+static int apfs_btree_collapse_root(struct apfs_query *query)
+{
+	struct super_block *sb = query->node->object.sb;
+	struct apfs_query *root_query = NULL, *child_query = NULL;
+	struct apfs_query *curr = NULL;
+	struct apfs_node *root = NULL, *child = NULL;
+	int err;
+
+	while (true) {
+		child_query = NULL;
+		root_query = query;
+		while (root_query->parent) {
+			child_query = root_query;
+			root_query = root_query->parent;
+		}
+		root = root_query->node;
+		if (!child_query || root->records != 1)
+			return 0;
+
+		err = apfs_query_set_index(root_query, 0);
+		if (err)
+			return err;
+		err = apfs_query_join_transaction(child_query);
+		if (err) {
+			apfs_err(sb, "query join failed");
+			return err;
+		}
+		child = child_query->node;
+
+		err = apfs_btree_dec_height(root, child);
+		if (err > 0) /* Doesn't fit */
+			return 0;
+		if (err) {
+			apfs_err(sb, "failed to move child 0x%llx to the root", child->object.oid);
+			return err;
+		}
+
+		apfs_btree_change_node_count(child_query, -1 /* change */);
+		err = apfs_delete_node(child, query->flags & APFS_QUERY_TREE_MASK);
+		if (err) {
+			apfs_err(sb, "node deletion failed");
+			return err;
+		}
+
+		/* The child query takes the place of the root query */
+		apfs_node_free(child);
+		child_query->node = root;
+		child_query->parent = NULL;
+		apfs_free_query(root_query);
+		for (curr = query; curr; curr = curr->parent)
+			--curr->depth;
+		err = apfs_query_set_index(child_query, child_query->index);
+		if (err)
+			return err;
+	}
+}
+
+/**
+ * apfs_btree_rebalance - Merge the sparse nodes left behind by a removal
+ * @query:	query for the lowest node that lost a record, with its ancestors
+ *
+ * Frequent removals would otherwise leave the tree full of nearly empty nodes,
+ * and taller than needed. Returns 0 on success, or a negative error code in
+ * case of failure. @query still points to the same record, but its node and
+ * those of its ancestors may have changed.
+ */
+static int apfs_btree_rebalance(struct apfs_query *query)
+{
+	struct super_block *sb = query->node->object.sb;
+	struct apfs_query *curr = NULL;
+	int err;
+
+	/* Free queues drain from the front, their nodes just get emptied */
+	if (apfs_query_storage(query) == APFS_OBJ_EPHEMERAL)
+		return 0;
+
+	for (curr = query; curr->parent; curr = curr->parent) {
+		err = apfs_btree_merge_node(curr);
+		if (err) {
+			apfs_err(sb, "failed to merge node at depth %d", curr->depth);
+			return err;
+		}
+	}
+	return apfs_btree_collapse_root(query);
+}
+
 /**
  * apfs_btree_remove - Remove a record from a b-tree leaf
  * @query:	exact query that found the record
@@ -1000,6 +1848,7 @@ int apfs_btree_remove(struct apfs_query *query)
 {
 	struct super_block *sb = NULL;
 	struct apfs_node *root = NULL, *leaf = NULL;
+	struct apfs_query *bottom = NULL;
 	int err;
 
 	root = apfs_query_root(query);
@@ -1009,6 +1858,11 @@ int apfs_btree_remove(struct apfs_query *query)
 	sb = root->object.sb;
 
 	while (true) {
+		/* Nodes left with no records get deleted, find the first one kept */
+		bottom = query;
+		while (bottom->parent && bottom->node->records == 1)
+			bottom = bottom->parent;
+
 		err = __apfs_btree_remove(query);
 		if (err != -EAGAIN) {
 			if (err)
@@ -1024,6 +1878,12 @@ int apfs_btree_remove(struct apfs_query *query)
 
 	apfs_assert_query_is_valid(query);
 	apfs_btree_change_rec_count(query, -1 /* change */, 0 /* key_len */, 0 /* val_len */);
+
+	err = apfs_btree_rebalance(bottom);
+	if (err) {
+		apfs_err(sb, "rebalance failed");
+		return err;
+	}
 	return 0;
 }
 
@@ -1059,6 +1919,7 @@ static int __apfs_btree_replace(struct apfs_query *query, void *key, int key_len
 		apfs_err(sb, "query join failed");
 		return err;
 	}
+	++APFS_NXI(sb)->nx_btree_gen;
 
 	node = query->node;
 	node_raw = (void *)node->object.data;
@@ -1172,3 +2033,339 @@ void apfs_query_direct_forward(struct apfs_query *query)
 		query = query->parent;
 	}
 }
+
+/**
+ * apfs_btree_iter_init - Set up an iterator for a range of b-tree records
+ * @iter:	iterator to initialize
+ * @root:	root node of the b-tree (must stay valid until release)
+ * @flags:	query flags for the type of b-tree
+ * @start:	first key in the range
+ * @end:	first key past the range
+ *
+ * Keys with a name must have it set, or they won't give a well defined place
+ * in the tree. The names must not go away before the iterator is released.
+ * The iterator must be positioned with apfs_btree_iter_seek() before use.
+ */
+void apfs_btree_iter_init(struct apfs_btree_iter *iter, struct apfs_node *root, unsigned int flags,
+			  const struct apfs_key *start, const struct apfs_key *end)
+{
+	memset(iter, 0, sizeof(*iter));
+	iter->root = root;
+	iter->flags = flags;
+	iter->start = *start;
+	iter->end = *end;
+}
+
+/**
+ * apfs_btree_iter_release - Drop the path kept by a b-tree iterator
+ * @iter: the iterator
+ */
+void apfs_btree_iter_release(struct apfs_btree_iter *iter)
+{
+	apfs_free_query(iter->query);
+	iter->query = NULL;
+}
+
+/**
+ * apfs_btree_iter_search - Build a new path for a b-tree iterator
+ * @sb:		filesystem superblock
+ * @iter:	the iterator
+ * @key:	key to search for
+ *
+ * Sets the path of @iter to the last record that comes before @key or matches
+ * it, or to right before the first record if there is none. Returns 0 on
+ * success, or a negative error code in case of failure, in which case the path
+ * is released.
+ */
+static int apfs_btree_iter_search(struct super_block *sb, struct apfs_btree_iter *iter, struct apfs_key *key)
+{
+	struct apfs_query *query = NULL;
+	int err;
+
+	apfs_btree_iter_release(iter);
+
+	query = apfs_alloc_query(iter->root, NULL /* parent */);
+	if (!query)
+		return -ENOMEM;
+	query->key = *key;
+	query->flags = iter->flags;
+	iter->query = query;
+
+	err = apfs_btree_query(sb, &iter->query);
+	/* The query gets set before the first record if there are none left */
+	if (err && err != -ENODATA) {
+		apfs_err(sb, "query failed for id 0x%llx", key->id);
+		apfs_btree_iter_release(iter);
+		return err;
+	}
+	iter->gen = APFS_NXI(sb)->nx_btree_gen;
+	return 0;
+}
+
+/**
+ * apfs_btree_iter_cmp - Compare the current record of an iterator with a key
+ * @iter:	the iterator
+ * @key:	key to compare with
+ * @cmp:	on return, the result of apfs_keycmp() for the record and @key
+ *
+ * A path set before the first record is considered to come before any key.
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_btree_iter_cmp(struct apfs_btree_iter *iter, struct apfs_key *key, int *cmp)
+{
+	struct apfs_key curr;
+	int err;
+
+	if (iter->query->index < 0) {
+		*cmp = -1;
+		return 0;
+	}
+	err = apfs_key_from_query(iter->query, &curr);
+	if (err)
+		return err;
+	*cmp = apfs_keycmp(&curr, key);
+	return 0;
+}
+
+/**
+ * apfs_btree_iter_step - Move the path of a b-tree iterator to a new record
+ * @sb:		filesystem superblock
+ * @iter:	the iterator
+ * @step:	1 to move to the next record, -1 to move to the previous one
+ *
+ * Only goes up as many levels as needed to find the sibling of the current
+ * leaf, and then back down; sibling leaves are read ahead as the scan reaches
+ * them. Returns 0 on success, -ENODATA if there are no more records, or
+ * another negative error code in case of failure.
+ */
+static int apfs_btree_iter_step(struct super_block *sb, struct apfs_btree_iter *iter, int step)
+{
+	struct apfs_query *query = iter->query;
+	struct apfs_query *parent = NULL;
+	struct apfs_query *spare = NULL;
+	struct apfs_node *node = NULL;
+	u32 storage = apfs_query_storage(query);
+	u64 child_id;
+	int index, err = 0;
+
+	while (true) {
+		node = query->node;
+		index = query->index + step;
+		if (index < 0 || index >= node->records) {
+			/* Nothing left in this node, continue one level up */
+			parent = query->parent;
+			if (!parent) {
+				err = -ENODATA;
+				goto out;
+			}
+			query->parent = NULL; /* Don't free the parent */
+			apfs_release_to_spare(query, &spare);
+			query = parent;
+			continue;
+		}
+
+		query->index = index;
+		query->key_len = apfs_node_locate_key(node, index, &query->key_off);
+		query->len = apfs_node_locate_value(node, index, &query->off);
+		if (!query->key_len || !query->len) {
+			apfs_err(sb, "bad record for index %d", index);
+			err = -EFSCORRUPTED;
+			goto out;
+		}
+		if (apfs_node_is_leaf(node))
+			goto out;
+
+		err = apfs_child_from_query(query, &child_id);
+		if (err) {
+			apfs_alert(sb, "bad index block: 0x%llx", node->object.block_nr);
+			goto out;
+		}
+		apfs_query_readahead(sb, query, step);
+
+		node = apfs_read_node(sb, child_id, storage, false /* write */);
+		if (IS_ERR(node)) {
+			apfs_err(sb, "failed to read node 0x%llx", child_id);
+			err = PTR_ERR(node);
+			goto out;
+		}
+		parent = query;
+		query = apfs_reuse_query(&spare, node, parent);
+		if (!query) {
+			apfs_node_free(node);
+			query = parent;
+			err = -ENOMEM;
+			goto out;
+		}
+		if (query->depth >= APFS_BTREE_MAX_HEIGHT) {
+			apfs_err(sb, "btree is too high");
+			err = -EFSCORRUPTED;
+			goto out;
+		}
+		query->index = step > 0 ? -1 : node->records;
+	}
+
+out:
+	if (spare)
+		kmem_cache_free(apfs_query_cachep, spare);
+	iter->query = query;
+	return err;
+}
+
+/**
+ * apfs_btree_iter_finish - Read the key for the new record of an iterator
+ * @sb:		filesystem superblock
+ * @iter:	the iterator
+ * @step:	direction of the last move (1 for forwards, -1 for backwards)
+ *
+ * Returns 0 on success, -ENODATA if the record is out of range, or another
+ * negative error code in case of failure. The path is released on failure.
+ */
+static int apfs_btree_iter_finish(struct super_block *sb, struct apfs_btree_iter *iter, int step)
+{
+	struct apfs_key *key = &iter->key;
+	int err;
+
+	err = apfs_key_from_query(iter->query, key);
+	if (err) {
+		apfs_err(sb, "bad key for index %d", iter->query->index);
+		goto fail;
+	}
+	/* The name must survive changes to the node */
+	if (key->name) {
+		if (strscpy(iter->name, key->name, sizeof(iter->name)) < 0) {
+			apfs_err(sb, "name is too long for id 0x%llx", key->id);
+			err = -EFSCORRUPTED;
+			goto fail;
+		}
+		key->name = iter->name;
+	}
+
+	if (step > 0 && apfs_keycmp(key, &iter->end) >= 0) {
+		err = -ENODATA;
+		goto fail;
+	}
+	if (step < 0 && apfs_keycmp(key, &iter->start) < 0) {
+		err = -ENODATA;
+		goto fail;
+	}
+	return 0;
+
+fail:
+	apfs_btree_iter_release(iter);
+	return err;
+}
+
+/**
+ * apfs_btree_iter_seek - Move a b-tree iterator to a given key
+ * @sb:		filesystem superblock
+ * @iter:	the iterator
+ * @key:	key to look for (or NULL for the start of the range)
+ *
+ * Sets @iter to the first record in range that matches @key or comes after it.
+ * Returns 0 on success, -ENODATA if there is no such record, or another
+ * negative error code in case of failure.
+ */
+int apfs_btree_iter_seek(struct super_block *sb, struct apfs_btree_iter *iter, const struct apfs_key *key)
+{
+	struct apfs_key target;
+	int cmp, err;
+
+	target = key ? *key : iter->start;
+	if (apfs_keycmp(&target, &iter->start) < 0)
+		target = iter->start;
+
+	err = apfs_btree_iter_search(sb, iter, &target);
+	if (err)
+		return err;
+	err = apfs_btree_iter_cmp(iter, &target, &cmp);
+	if (err) {
+		apfs_err(sb, "bad key for index %d", iter->query->index);
+		goto fail;
+	}
+	if (cmp < 0) {
+		err = apfs_btree_iter_step(sb, iter, 1);
+		if (err)
+			goto fail;
+	}
+	return apfs_btree_iter_finish(sb, iter, 1);
+
+fail:
+	apfs_btree_iter_release(iter);
+	return err;
+}
+
+/**
+ * apfs_btree_iter_next - Move a b-tree iterator to the next record
+ * @sb:		filesystem superblock
+ * @iter:	the iterator
+ *
+ * If the b-trees were modified since the last move, the path is rebuilt from
+ * the root, and the iterator moves to the first record that comes after the
+ * current key, whether that record still exists or not. Returns 0 on success,
+ * -ENODATA if the end of the range was reached, or another negative error code
+ * in case of failure. The iterator must be seeked again after any error.
+ */
+int apfs_btree_iter_next(struct super_block *sb, struct apfs_btree_iter *iter)
+{
+	int err;
+
+	if (!iter->query)
+		return -ENODATA;
+	if (iter->gen != APFS_NXI(sb)->nx_btree_gen) {
+		/* This finds the current record, or the one before it */
+		err = apfs_btree_iter_search(sb, iter, &iter->key);
+		if (err)
+			return err;
+	}
+
+	err = apfs_btree_iter_step(sb, iter, 1);
+	if (err) {
+		apfs_btree_iter_release(iter);
+		return err;
+	}
+	return apfs_btree_iter_finish(sb, iter, 1);
+}
+
+/**
+ * apfs_btree_iter_prev - Move a b-tree iterator to the previous record
+ * @sb:		filesystem superblock
+ * @iter:	the iterator
+ *
+ * Same as apfs_btree_iter_next(), but moving backwards. Returns 0 on success,
+ * -ENODATA if the start of the range was reached, or another negative error
+ * code in case of failure.
+ */
+int apfs_btree_iter_prev(struct super_block *sb, struct apfs_btree_iter *iter)
+{
+	int cmp, err;
+
+	if (!iter->query)
+		return -ENODATA;
+	if (iter->gen != APFS_NXI(sb)->nx_btree_gen) {
+		err = apfs_btree_iter_search(sb, iter, &iter->key);
+		if (err)
+			return err;
+		err = apfs_btree_iter_cmp(iter, &iter->key, &cmp);
+		if (err) {
+			apfs_err(sb, "bad key for index %d", iter->query->index);
+			goto fail;
+		}
+		if (cmp < 0) {
+			/* The current record is gone, and we are right before it */
+			if (iter->query->index < 0) {
+				err = -ENODATA;
+				goto fail;
+			}
+			return apfs_btree_iter_finish(sb, iter, -1);
+		}
+	}
+
+	err = apfs_btree_iter_step(sb, iter, -1);
+	if (err)
+		goto fail;
+	return apfs_btree_iter_finish(sb, iter, -1);
+
+fail:
+	apfs_btree_iter_release(iter);
+	return err;
+}
@@ -5,6 +5,7 @@
 
 #include <linux/slab.h>
 #include <linux/buffer_head.h>
+#include <linux/uaccess.h>
 #include "apfs.h"
 
 /**
@@ -87,6 +88,7 @@ static int apfs_drec_from_query(struct apfs_query *query, struct apfs_drec *drec
  * apfs_dentry_lookup - Lookup a dentry record in the catalog b-tree
  * @dir:	parent directory
  * @child:	filename
+ * @hash:	precomputed hash for @child, or NULL to compute it here
  * @drec:	on return, the directory record found
  *
  * Runs a catalog query for @name in the @dir directory.  On success, sets
@@ -95,6 +97,7 @@ static int apfs_drec_from_query(struct apfs_query *query, struct apfs_drec *drec
  */
 static struct apfs_query *apfs_dentry_lookup(struct inode *dir,
 					     const struct qstr *child,
+					     const u32 *hash,
 					     struct apfs_drec *drec)
 {
 	struct super_block *sb = dir->i_sb;
@@ -107,7 +110,10 @@ static struct apfs_query *apfs_dentry_lookup(struct inode *dir,
 	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
 	if (!query)
 		return ERR_PTR(-ENOMEM);
-	apfs_init_drec_key(sb, cnid, child->name, child->len, &query->key);
+	if (hash && hashed)
+		apfs_init_drec_hash_key(cnid, *hash, &query->key);
+	else
+		apfs_init_drec_key(sb, cnid, child->name, child->len, &query->key);
 
 	/*
 	 * Distinct filenames in the same directory may (rarely) share the same
@@ -150,12 +156,14 @@ fail:
  * apfs_inode_by_name - Find the cnid for a given filename
  * @dir:	parent directory
  * @child:	filename
+ * @hash:	precomputed hash for @child, or NULL if not known
  * @ino:	on return, the inode number found
  *
  * Returns 0 and the inode number (which is the cnid of the file
  * record); otherwise, return the appropriate error code.
  */
-int apfs_inode_by_name(struct inode *dir, const struct qstr *child, u64 *ino)
+int apfs_inode_by_name(struct inode *dir, const struct qstr *child,
+		       const u32 *hash, u64 *ino)
 {
 	struct super_block *sb = dir->i_sb;
 	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
@@ -164,7 +172,7 @@ int apfs_inode_by_name(struct inode *dir, const struct qstr *child, u64 *ino)
 	int err = 0;
 
 	down_read(&nxi->nx_big_sem);
-	query = apfs_dentry_lookup(dir, child, &drec);
+	query = apfs_dentry_lookup(dir, child, hash, &drec);
 	if (IS_ERR(query)) {
 		err = PTR_ERR(query);
 		goto out;
@@ -186,8 +194,14 @@ static int apfs_readdir(struct file *file, struct dir_context *ctx)
 	u64 cnid = apfs_ino(inode);
 	loff_t pos;
 	bool hashed = apfs_is_normalization_insensitive(sb);
+	u64 *ra_inos = NULL;
+	int ra_count = 0;
 	int err = 0;
 
+	/* The inode records will probably be needed soon, by stat() */
+	if (nxi->nx_flags & APFS_PREFETCH)
+		ra_inos = kmalloc_array(APFS_READDIR_RA_BATCH, sizeof(*ra_inos), GFP_KERNEL);
+
 	down_read(&nxi->nx_big_sem);
 
 	/* Inode numbers might overflow here; follow btrfs in ignoring that */
@@ -235,13 +249,24 @@ static int apfs_readdir(struct file *file, struct dir_context *ctx)
 				      drec.ino, drec.type))
 				break;
 			++ctx->pos;
+
+			if (ra_inos) {
+				ra_inos[ra_count++] = drec.ino;
+				if (ra_count == APFS_READDIR_RA_BATCH) {
+					apfs_catalog_readahead(sb, ra_inos, ra_count);
+					ra_count = 0;
+				}
+			}
 		}
 		pos--;
 	}
 	apfs_free_query(query);
+	if (ra_count)
+		apfs_catalog_readahead(sb, ra_inos, ra_count);
 
 out:
 	up_read(&nxi->nx_big_sem);
+	kfree(ra_inos);
 	return err;
 }
 
@@ -606,6 +631,13 @@ static int apfs_create_dentry(struct dentry *dentry, struct inode *inode)
 #endif
 	++APFS_I(parent)->i_nchildren;
 	apfs_inode_join_transaction(parent->i_sb, parent);
+
+	/* The size of the child gets counted later, by apfs_update_inode() */
+	err = apfs_dir_stats_update(sb, APFS_I(parent)->i_dir_stats_id, 1 /* children */, 0 /* size */);
+	if (err) {
+		apfs_err(sb, "failed to update dir stats for ino 0x%llx", apfs_ino(parent));
+		return err;
+	}
 	return 0;
 }
 
@@ -784,7 +816,7 @@ static int apfs_prepare_dentry_for_link(struct dentry *dentry)
 	u64 sibling_id;
 	int ret;
 
-	query = apfs_dentry_lookup(parent, &dentry->d_name, &drec);
+	query = apfs_dentry_lookup(parent, &dentry->d_name, NULL /* hash */, &drec);
 	if (IS_ERR(query)) {
 		apfs_err(sb, "lookup failed in dir 0x%llx", apfs_ino(parent));
 		return PTR_ERR(query);
@@ -995,7 +1027,7 @@ static int apfs_delete_dentry(struct dentry *dentry)
 	struct apfs_drec drec;
 	int err;
 
-	query = apfs_dentry_lookup(parent, &dentry->d_name, &drec);
+	query = apfs_dentry_lookup(parent, &dentry->d_name, NULL /* hash */, &drec);
 	if (IS_ERR(query))
 		return PTR_ERR(query);
 	err = apfs_btree_remove(query);
@@ -1028,6 +1060,10 @@ static int apfs_delete_dentry(struct dentry *dentry)
 #endif
 	--APFS_I(parent)->i_nchildren;
 	apfs_inode_join_transaction(sb, parent);
+
+	err = apfs_dir_stats_update(sb, APFS_I(parent)->i_dir_stats_id, -1 /* children */, 0 /* size */);
+	if (err)
+		apfs_err(sb, "failed to update dir stats for ino 0x%llx", apfs_ino(parent));
 	return err;
 }
 
@@ -1217,7 +1253,7 @@ int apfs_delete_orphan_link(struct inode *inode)
 	if (err)
 		return err;
 
-	query = apfs_dentry_lookup(priv_dir, &qname, &drec);
+	query = apfs_dentry_lookup(priv_dir, &qname, NULL /* hash */, &drec);
 	if (IS_ERR(query)) {
 		apfs_err(sb, "dentry lookup failed");
 		err = PTR_ERR(query);
@@ -1503,3 +1539,231 @@ out:
 	query = NULL;
 	return err;
 }
+
+/**
+ * apfs_dir_stats_lookup - Look up a dir stats record in the catalog
+ * @sb:	filesystem superblock
+ * @id:	id of the dir stats record
+ *
+ * Returns the query that found the record on success, or an error pointer in
+ * case of failure.
+ */
+static struct apfs_query *apfs_dir_stats_lookup(struct super_block *sb, u64 id)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_query *query = NULL;
+	int err;
+
+	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
+	if (!query)
+		return ERR_PTR(-ENOMEM);
+	apfs_init_dir_stats_key(id, &query->key);
+	query->flags |= APFS_QUERY_CAT | APFS_QUERY_EXACT;
+
+	err = apfs_btree_query(sb, &query);
+	if (err) {
+		apfs_err(sb, "query failed for dir stats 0x%llx", id);
+		goto fail;
+	}
+	if (query->len != sizeof(struct apfs_dir_stats_val)) {
+		apfs_err(sb, "bad value length for dir stats 0x%llx (%d)", id, query->len);
+		err = -EFSCORRUPTED;
+		goto fail;
+	}
+	return query;
+
+fail:
+	apfs_free_query(query);
+	return ERR_PTR(err);
+}
+
+/**
+ * apfs_dir_stats_update - Apply a change to a chain of dir stats records
+ * @sb:		filesystem superblock
+ * @id:		id of the first dir stats record in the chain, or 0 for none
+ * @children:	change in the child count, only for the first record
+ * @size:	change in the total size, for every record in the chain
+ *
+ * The total size for a directory includes everything below it, so the change
+ * must be followed all the way up through the chained keys.
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+int apfs_dir_stats_update(struct super_block *sb, u64 id, int children, s64 size)
+{
+	struct apfs_query *query = NULL;
+	struct apfs_dir_stats_val *val = NULL;
+	int depth, err;
+
+	for (depth = 0; depth < APFS_DIR_STATS_MAX_CHAIN; ++depth) {
+		if (!id || (!children && !size))
+			return 0;
+
+		query = apfs_dir_stats_lookup(sb, id);
+		if (IS_ERR(query))
+			return PTR_ERR(query);
+		err = apfs_query_join_transaction(query);
+		if (err) {
+			apfs_err(sb, "query join failed");
+			apfs_free_query(query);
+			return err;
+		}
+		val = (void *)query->node->object.data + query->off;
+
+		le64_add_cpu(&val->num_children, children);
+		le64_add_cpu(&val->total_size, size);
+		le64_add_cpu(&val->gen_count, 1);
+		id = le64_to_cpu(val->chained_key);
+		apfs_free_query(query);
+		children = 0;
+	}
+
+	apfs_err(sb, "dir stats chain is too long");
+	return -EFSCORRUPTED;
+}
+
+/**
+ * apfs_dir_stats_rechain - Attach a dir stats record to a new parent chain
+ * @sb:		filesystem superblock
+ * @id:		id of the dir stats record that moved
+ * @new_chain:	id of the dir stats for the new parent, or 0 for none
+ *
+ * The whole total for the subtree is moved from the old chain to the new one.
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+int apfs_dir_stats_rechain(struct super_block *sb, u64 id, u64 new_chain)
+{
+	struct apfs_query *query = NULL;
+	struct apfs_dir_stats_val *val = NULL;
+	u64 old_chain, total;
+	int err;
+
+	query = apfs_dir_stats_lookup(sb, id);
+	if (IS_ERR(query))
+		return PTR_ERR(query);
+	err = apfs_query_join_transaction(query);
+	if (err) {
+		apfs_err(sb, "query join failed");
+		goto out;
+	}
+	val = (void *)query->node->object.data + query->off;
+
+	old_chain = le64_to_cpu(val->chained_key);
+	total = le64_to_cpu(val->total_size);
+	if (old_chain == new_chain)
+		goto out;
+	val->chained_key = cpu_to_le64(new_chain);
+	le64_add_cpu(&val->gen_count, 1);
+	apfs_free_query(query);
+	query = NULL;
+
+	err = apfs_dir_stats_update(sb, old_chain, 0 /* children */, -(s64)total);
+	if (err)
+		return err;
+	return apfs_dir_stats_update(sb, new_chain, 0 /* children */, total);
+
+out:
+	apfs_free_query(query);
+	return err;
+}
+
+/**
+ * apfs_create_dir_stats_rec - Create an empty dir stats record
+ * @sb:		filesystem superblock
+ * @id:		id for the new record
+ * @chain:	id of the dir stats for the parent directory, or 0 for none
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+int apfs_create_dir_stats_rec(struct super_block *sb, u64 id, u64 chain)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_query *query = NULL;
+	struct apfs_key_header raw_key;
+	struct apfs_dir_stats_val raw_val = {0};
+	int err;
+
+	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
+	if (!query)
+		return -ENOMEM;
+	apfs_init_dir_stats_key(id, &query->key);
+	query->flags |= APFS_QUERY_CAT;
+
+	err = apfs_btree_query(sb, &query);
+	if (err && err != -ENODATA) {
+		apfs_err(sb, "query failed for dir stats 0x%llx", id);
+		goto fail;
+	}
+
+	apfs_key_set_hdr(APFS_TYPE_DIR_STATS, id, &raw_key);
+	raw_val.chained_key = cpu_to_le64(chain);
+	err = apfs_btree_insert(query, &raw_key, sizeof(raw_key), &raw_val, sizeof(raw_val));
+	if (err)
+		apfs_err(sb, "insertion failed for dir stats 0x%llx", id);
+
+fail:
+	apfs_free_query(query);
+	return err;
+}
+
+/**
+ * apfs_delete_dir_stats_rec - Delete the dir stats record for a dead directory
+ * @sb:	filesystem superblock
+ * @id:	id of the record
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+int apfs_delete_dir_stats_rec(struct super_block *sb, u64 id)
+{
+	struct apfs_query *query = NULL;
+	int err;
+
+	query = apfs_dir_stats_lookup(sb, id);
+	if (IS_ERR(query))
+		return PTR_ERR(query);
+	err = apfs_btree_remove(query);
+	if (err)
+		apfs_err(sb, "removal failed for dir stats 0x%llx", id);
+	apfs_free_query(query);
+	return err;
+}
+
+/**
+ * apfs_ioc_get_dir_stats - Ioctl handler to report the dir stats
+ * @file:	directory to report on
+ * @user_arg:	on return, the statistics for the directory
+ *
+ * The size is recursive, so this is much cheaper than walking the tree. Only
+ * directories flagged to maintain their stats have them, otherwise returns
+ * -ENODATA.
+ */
+int apfs_ioc_get_dir_stats(struct file *file, void __user *user_arg)
+{
+	struct inode *inode = file_inode(file);
+	struct super_block *sb = inode->i_sb;
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_ioctl_dir_stats arg = {0};
+	struct apfs_dir_stats_val *val = NULL;
+	struct apfs_query *query = NULL;
+	u64 id = APFS_I(inode)->i_dir_stats_id;
+
+	if (!id)
+		return -ENODATA;
+
+	down_read(&nxi->nx_big_sem);
+	query = apfs_dir_stats_lookup(sb, id);
+	if (IS_ERR(query)) {
+		up_read(&nxi->nx_big_sem);
+		return PTR_ERR(query);
+	}
+	val = (void *)query->node->object.data + query->off;
+	arg.num_children = le64_to_cpu(val->num_children);
+	arg.total_size = le64_to_cpu(val->total_size);
+	arg.gen_count = le64_to_cpu(val->gen_count);
+	apfs_free_query(query);
+	up_read(&nxi->nx_big_sem);
+
+	if (copy_to_user(user_arg, &arg, sizeof(arg)))
+		return -EFAULT;
+	return 0;
+}
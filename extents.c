@@ -6,6 +6,7 @@
 #include <linux/buffer_head.h>
 #include <linux/slab.h>
 #include <linux/blk_types.h>
+#include <linux/mount.h>
 #include "apfs.h"
 
 /**
@@ -1242,15 +1243,16 @@ static void apfs_zero_bh_tail(struct super_block *sb, struct buffer_head *bh, u6
 }
 
 /**
- * apfs_range_in_snap - Check if a given block range overlaps a snapshot
+ * apfs_range_is_shared - Check if a given block range may have other owners
  * @sb:		filesystem superblock
  * @bno:	first block in the range
  * @blkcnt:	block count for the range
- * @in_snap:	on return, the result
+ * @clones:	also check for references from clones, not just snapshots
+ * @shared:	on return, the result
  *
  * Returns 0 on success, or a negative error code in case of failure.
  */
-static int apfs_range_in_snap(struct super_block *sb, u64 bno, u64 blkcnt, bool *in_snap)
+static int apfs_range_is_shared(struct super_block *sb, u64 bno, u64 blkcnt, bool clones, bool *shared)
 {
 	struct apfs_superblock *vsb_raw = APFS_SB(sb)->s_vsb_raw;
 	struct apfs_node *extref_root = NULL;
@@ -1259,8 +1261,8 @@ static int apfs_range_in_snap(struct super_block *sb, u64 bno, u64 blkcnt, bool
 	int ret;
 
 	/* Avoid the tree queries when we don't even have snapshots */
-	if (vsb_raw->apfs_num_snapshots == 0) {
-		*in_snap = false;
+	if (!clones && vsb_raw->apfs_num_snapshots == 0) {
+		*shared = false;
 		return 0;
 	}
 
@@ -1289,7 +1291,7 @@ static int apfs_range_in_snap(struct super_block *sb, u64 bno, u64 blkcnt, bool
 		goto out;
 	}
 	if (ret == -ENODATA) {
-		*in_snap = false;
+		*shared = false;
 		ret = 0;
 		goto out;
 	}
@@ -1301,8 +1303,8 @@ static int apfs_range_in_snap(struct super_block *sb, u64 bno, u64 blkcnt, bool
 	}
 
 	if (pext.bno <= bno && pext.bno + pext.blkcount >= bno + blkcnt) {
-		if (pext.kind == APFS_KIND_NEW) {
-			*in_snap = false;
+		if (pext.kind == APFS_KIND_NEW && (!clones || pext.refcnt == 1)) {
+			*shared = false;
 			goto out;
 		}
 	}
@@ -1312,7 +1314,7 @@ static int apfs_range_in_snap(struct super_block *sb, u64 bno, u64 blkcnt, bool
 	 * physical extents from the current tree, but it's easier to just
 	 * assume the worst here.
 	 */
-	*in_snap = true;
+	*shared = true;
 
 out:
 	apfs_free_query(query);
@@ -1320,6 +1322,20 @@ out:
 	return ret;
 }
 
+/**
+ * apfs_range_in_snap - Check if a given block range overlaps a snapshot
+ * @sb:		filesystem superblock
+ * @bno:	first block in the range
+ * @blkcnt:	block count for the range
+ * @in_snap:	on return, the result
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static inline int apfs_range_in_snap(struct super_block *sb, u64 bno, u64 blkcnt, bool *in_snap)
+{
+	return apfs_range_is_shared(sb, bno, blkcnt, false /* clones */, in_snap);
+}
+
 /**
  * apfs_dstream_cache_in_snap - Check if the cached extent overlaps a snapshot
  * @dstream:	the data stream to check
@@ -1342,6 +1358,59 @@ static int apfs_dstream_cache_in_snap(struct apfs_dstream_info *dstream, bool *i
 	return apfs_range_in_snap(sb, cache->phys_block_num, cache->len >> sb->s_blocksize_bits, in_snap);
 }
 
+/**
+ * apfs_block_can_overwrite - Check if a file block can be overwritten in place
+ * @inode:	the vfs inode
+ * @bno:	physical block currently mapped
+ * @inplace:	on return, the result
+ *
+ * This is only allowed for files in in-place mode, and only if no snapshot or
+ * clone shares the block. Returns 0 on success, or a negative error code in
+ * case of failure.
+ */
+int apfs_block_can_overwrite(struct inode *inode, u64 bno, bool *inplace)
+{
+	struct super_block *sb = inode->i_sb;
+	struct apfs_inode_info *ai = APFS_I(inode);
+	bool shared = true;
+	int err;
+
+	*inplace = false;
+	if (!ai->i_inplace || !ai->i_has_dstream || ai->i_dstream.ds_shared)
+		return 0;
+
+	/* Range clones share extents with other dstreams, so check those too */
+	err = apfs_range_is_shared(sb, bno, 1, true /* clones */, &shared);
+	if (err) {
+		apfs_err(sb, "failed to check block 0x%llx", bno);
+		return err;
+	}
+	*inplace = !shared;
+	return 0;
+}
+
+/**
+ * apfs_dstream_alloc_goal - Pick the preferred physical block for a new block
+ * @dstream:	data stream info
+ * @dsblock:	logical dstream block to be allocated
+ *
+ * Returns the physical block that would keep @dsblock contiguous with the
+ * cached extent, or 0 if there is no useful hint.
+ */
+static u64 apfs_dstream_alloc_goal(struct apfs_dstream_info *dstream, u64 dsblock)
+{
+	struct super_block *sb = dstream->ds_sb;
+	struct apfs_file_extent *cache = &dstream->ds_cached_ext;
+	u64 cache_dsblock;
+
+	if (!cache->len || apfs_ext_is_hole(cache))
+		return 0;
+	cache_dsblock = cache->logical_addr >> sb->s_blocksize_bits;
+	if (dsblock < cache_dsblock)
+		return 0;
+	return cache->phys_block_num + dsblock - cache_dsblock;
+}
+
 /**
  * apfs_dstream_get_new_block - Like the get_block_t function, but for dstreams
  * @dstream:	data stream info
@@ -1363,7 +1432,7 @@ static int apfs_dstream_get_new_block(struct apfs_dstream_info *dstream, u64 dsb
 	/* TODO: preallocate tail blocks */
 	logical_addr = dsblock << sb->s_blocksize_bits;
 
-	err = apfs_spaceman_allocate_block(sb, &phys_bno, false /* backwards */);
+	err = apfs_spaceman_allocate_block_near(sb, apfs_dstream_alloc_goal(dstream, dsblock), &phys_bno);
 	if (err) {
 		apfs_err(sb, "block allocation failed");
 		return err;
@@ -1629,7 +1698,7 @@ int apfs_truncate(struct apfs_dstream_info *dstream, loff_t new_size)
  *
  * Returns 0 on success, or a negative error code in case of failure, which may
  * be -ENODATA if there are no more extents, or -EAGAIN if the free queue is
- * getting too full.
+ * getting too full or the transaction has deleted enough extents already.
  */
 static int apfs_dstream_delete_front(struct super_block *sb, u64 ds_id)
 {
@@ -1640,6 +1709,7 @@ static int apfs_dstream_delete_front(struct super_block *sb, u64 ds_id)
 	struct apfs_query *query = NULL;
 	struct apfs_file_extent head;
 	bool first_match = true;
+	int deleted = 0;
 	int ret;
 
 	fq = &sm_raw->sm_fq[APFS_SFQ_MAIN];
@@ -1700,9 +1770,11 @@ next_extent:
 			apfs_err(sb, "failed to take crypto id 0x%llx", head.crypto_id);
 			goto out;
 		}
+		atomic64_add(head.len, &sbi->s_reclaimed_bytes);
 	}
 
-	if (le64_to_cpu(fq->sfq_count) <= APFS_TRANS_MAIN_QUEUE_MAX)
+	/* Huge files get deleted over many short transactions */
+	if (++deleted < APFS_RECLAIM_MAX_EXTENTS && le64_to_cpu(fq->sfq_count) <= APFS_TRANS_MAIN_QUEUE_MAX)
 		goto next_extent;
 	ret = -EAGAIN;
 out:
@@ -1715,8 +1787,9 @@ out:
  * @inode:	inode to delete
  *
  * Tries to delete all extents for @inode, in which case it returns 0. If the
- * free queue is getting too full, deletes as much as is reasonable and returns
- * -EAGAIN. May return other negative error codes as well.
+ * free queue is getting too full, or if there are too many extents for a
+ * single transaction, deletes as much as is reasonable and returns -EAGAIN.
+ * May return other negative error codes as well.
  */
 int apfs_inode_delete_front(struct inode *inode)
 {
@@ -1742,6 +1815,8 @@ int apfs_inode_delete_front(struct inode *inode)
 }
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+static loff_t apfs_remap_range(struct file *src_file, loff_t off, struct file *dst_file, loff_t destoff, loff_t len, unsigned int remap_flags);
+
 loff_t apfs_remap_file_range(struct file *src_file, loff_t off, struct file *dst_file, loff_t destoff, loff_t len, unsigned int remap_flags)
 #else
 int apfs_clone_file_range(struct file *src_file, loff_t off, struct file *dst_file, loff_t destoff, u64 len)
@@ -1759,13 +1834,20 @@ int apfs_clone_file_range(struct file *src_file, loff_t off, struct file *dst_fi
 	int err;
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
-	if (remap_flags & ~(REMAP_FILE_ADVISORY))
+	if (remap_flags & ~(REMAP_FILE_DEDUP | REMAP_FILE_CAN_SHORTEN | REMAP_FILE_ADVISORY))
 		return -EINVAL;
+
+	/*
+	 * Whole files cloned into a fresh target just share the dstream, like
+	 * in the official driver. Everything else gets its extents remapped.
+	 */
+	if (remap_flags & REMAP_FILE_DEDUP || off != 0 || destoff != 0 || len != 0 || dst_ai->i_has_dstream)
+		return apfs_remap_range(src_file, off, dst_file, destoff, len, remap_flags);
 #endif
 	if (src_inode == dst_inode)
 		return -EINVAL;
 
-	/* We only want to clone whole files, like in the official driver */
+	/* Only whole files are cloned here, like in the official driver */
 	if (off != 0 || destoff != 0 || len != 0)
 		return -EINVAL;
 
@@ -1853,48 +1935,6 @@ fail:
 	return err;
 }
 
-/**
- * apfs_extent_create_record - Create a logical extent record for a dstream id
- * @sb:		filesystem superblock
- * @dstream_id:	the dstream id
- * @extent:	extent info for the record
- *
- * Returns 0 on success, or a negative error code in case of failure.
- */
-static int apfs_extent_create_record(struct super_block *sb, u64 dstream_id, struct apfs_file_extent *extent)
-{
-	struct apfs_sb_info *sbi = APFS_SB(sb);
-	struct apfs_query *query = NULL;
-	struct apfs_file_extent_val raw_val;
-	struct apfs_file_extent_key raw_key;
-	int ret = 0;
-
-	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
-	if (!query)
-		return -ENOMEM;
-	apfs_init_file_extent_key(dstream_id, extent->logical_addr, &query->key);
-	query->flags = APFS_QUERY_CAT | APFS_QUERY_EXACT;
-
-	ret = apfs_btree_query(sb, &query);
-	if (ret && ret != -ENODATA) {
-		apfs_err(sb, "query failed for id 0x%llx, addr 0x%llx", dstream_id, extent->logical_addr);
-		goto out;
-	}
-
-	apfs_key_set_hdr(APFS_TYPE_FILE_EXTENT, dstream_id, &raw_key);
-	raw_key.logical_addr = cpu_to_le64(extent->logical_addr);
-	raw_val.len_and_flags = cpu_to_le64(extent->len);
-	raw_val.phys_block_num = cpu_to_le64(extent->phys_block_num);
-	raw_val.crypto_id = cpu_to_le64(apfs_vol_is_encrypted(sb) ? dstream_id : 0); /* TODO */
-
-	ret = apfs_btree_insert(query, &raw_key, sizeof(raw_key), &raw_val, sizeof(raw_val));
-	if (ret)
-		apfs_err(sb, "insertion failed for id 0x%llx, addr 0x%llx", dstream_id, extent->logical_addr);
-out:
-	apfs_free_query(query);
-	return ret;
-}
-
 /**
  * apfs_put_single_extent - Put a reference to a single extent
  * @sb:		filesystem superblock
@@ -2037,6 +2077,235 @@ static int apfs_range_put_reference(struct super_block *sb, u64 paddr, u64 lengt
 	return 0;
 }
 
+/**
+ * apfs_insert_merged_pext - Insert a physical extent record from a snapshot
+ * @query:	query that searched for the physical extent
+ * @pext:	physical extent to insert
+ * @owner:	owning object id for the record
+ *
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_insert_merged_pext(struct apfs_query *query, const struct apfs_phys_extent *pext, u64 owner)
+{
+	struct apfs_phys_ext_key key = {0};
+	struct apfs_phys_ext_val val = {0};
+
+	apfs_key_set_hdr(APFS_TYPE_EXTENT, pext->bno, &key);
+	val.len_and_kind = cpu_to_le64((u64)pext->kind << APFS_PEXT_KIND_SHIFT | pext->blkcount);
+	val.owning_obj_id = cpu_to_le64(owner);
+	val.refcnt = cpu_to_le32(pext->refcnt);
+	return apfs_btree_insert(query, &key, sizeof(key), &val, sizeof(val));
+}
+
+/**
+ * apfs_merge_single_pext - Merge part of a deleted snapshot's physical extent
+ * @dst_root:	root of the extent reference tree to merge into
+ * @src:	physical extent record from the deleted snapshot
+ * @owner:	owning object id for @src
+ * @paddr_end:	first block after the range to merge
+ *
+ * Merges the tail of @src that ends in @paddr_end with whatever the next tree
+ * has for that range, and sets @paddr_end to the beginning of the part that
+ * got merged, so that the caller can continue with the rest. Any record found
+ * in the next tree can only be a reference count update, so the counts are
+ * added up and the blocks are freed if they drop to zero. Returns 0 on success,
+ * or a negative error code in case of failure.
+ */
+static int apfs_merge_single_pext(struct apfs_node *dst_root, const struct apfs_phys_extent *src, u64 owner, u64 *paddr_end)
+{
+	struct super_block *sb = dst_root->object.sb;
+	struct apfs_query *query = NULL;
+	struct apfs_phys_extent dst_ext, tmp;
+	struct apfs_phys_ext_val *val = NULL;
+	u64 paddr_min = src->bno;
+	u64 dst_start = 0, dst_end;
+	int ret;
+
+restart:
+	query = apfs_alloc_query(dst_root, NULL /* parent */);
+	if (!query)
+		return -ENOMEM;
+	apfs_init_extent_key(*paddr_end - 1, &query->key);
+	query->flags = APFS_QUERY_EXTENTREF;
+
+	ret = apfs_btree_query(sb, &query);
+	if (ret && ret != -ENODATA) {
+		apfs_err(sb, "query failed for paddr 0x%llx", *paddr_end - 1);
+		goto out;
+	}
+
+	dst_end = 0;
+	if (ret == 0) {
+		ret = apfs_phys_ext_from_query(query, &dst_ext);
+		if (ret) {
+			apfs_err(sb, "bad pext record over paddr 0x%llx", *paddr_end - 1);
+			goto out;
+		}
+		dst_start = dst_ext.bno;
+		dst_end = dst_ext.bno + dst_ext.blkcount;
+	}
+	if (dst_end < *paddr_end) {
+		/* Nothing changed for this range after the snapshot */
+		tmp = *src;
+		tmp.bno = max(dst_end, paddr_min);
+		tmp.blkcount = *paddr_end - tmp.bno;
+		ret = apfs_insert_merged_pext(query, &tmp, owner);
+		if (ret)
+			apfs_err(sb, "insertion failed for paddr 0x%llx", tmp.bno);
+		*paddr_end = tmp.bno;
+		goto out;
+	}
+
+	if (dst_end > *paddr_end || dst_start < paddr_min) {
+		ret = apfs_split_phys_ext(query, dst_end > *paddr_end ? *paddr_end : paddr_min);
+		if (ret) {
+			apfs_err(sb, "failed to split pext 0x%llx-0x%llx", dst_start, dst_end);
+			goto out;
+		}
+		/* The split may make the query invalid */
+		apfs_free_query(query);
+		goto restart;
+	}
+
+	if (dst_ext.kind != APFS_KIND_UPDATE) {
+		apfs_alert(sb, "pext 0x%llx-0x%llx was allocated twice", dst_start, dst_end);
+		ret = -EFSCORRUPTED;
+		goto out;
+	}
+
+	tmp = *src;
+	tmp.bno = dst_start;
+	tmp.blkcount = dst_ext.blkcount;
+	tmp.refcnt += dst_ext.refcnt;
+	if (tmp.refcnt == 0) {
+		ret = apfs_btree_remove(query);
+		if (ret) {
+			apfs_err(sb, "removal failed for paddr 0x%llx", dst_start);
+			goto out;
+		}
+		if (tmp.kind == APFS_KIND_NEW) {
+			ret = apfs_free_phys_ext(sb, &tmp);
+			if (ret)
+				apfs_err(sb, "failed to free pext at 0x%llx", dst_start);
+		}
+	} else {
+		ret = apfs_query_join_transaction(query);
+		if (ret) {
+			apfs_err(sb, "query join failed");
+			goto out;
+		}
+		val = (void *)query->node->object.data + query->off;
+		val->len_and_kind = cpu_to_le64((u64)tmp.kind << APFS_PEXT_KIND_SHIFT | tmp.blkcount);
+		val->owning_obj_id = cpu_to_le64(owner);
+		val->refcnt = cpu_to_le32(tmp.refcnt);
+	}
+	*paddr_end = dst_start;
+
+out:
+	apfs_free_query(query);
+	return ret;
+}
+
+/**
+ * apfs_remove_phys_ext_rec - Remove a physical extent record from a tree
+ * @root:	root of the extent reference tree
+ * @bno:	first block of the physical extent
+ *
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_remove_phys_ext_rec(struct apfs_node *root, u64 bno)
+{
+	struct super_block *sb = root->object.sb;
+	struct apfs_query *query = NULL;
+	int ret;
+
+	query = apfs_alloc_query(root, NULL /* parent */);
+	if (!query)
+		return -ENOMEM;
+	apfs_init_extent_key(bno, &query->key);
+	query->flags = APFS_QUERY_EXTENTREF | APFS_QUERY_EXACT;
+
+	ret = apfs_btree_query(sb, &query);
+	if (ret) {
+		apfs_err(sb, "query failed for paddr 0x%llx", bno);
+		goto out;
+	}
+	ret = apfs_btree_remove(query);
+out:
+	apfs_free_query(query);
+	return ret;
+}
+
+/**
+ * apfs_merge_extentref_tree - Merge a deleted snapshot's extent references
+ * @src_root:	root of the extent reference tree for the deleted snapshot
+ * @dst_root:	root of the tree for the next snapshot, or for the volume
+ * @budget:	number of records that may still be merged in this transaction
+ *
+ * Moves the records from @src_root into @dst_root, one by one, and frees any
+ * physical extents that are left without references. Returns 0 once @src_root
+ * is empty, -EAGAIN if the transaction did enough work already, or another
+ * negative error code in case of failure.
+ */
+int apfs_merge_extentref_tree(struct apfs_node *src_root, struct apfs_node *dst_root, int *budget)
+{
+	struct super_block *sb = src_root->object.sb;
+	struct apfs_spaceman_free_queue *fq = NULL;
+	struct apfs_btree_iter iter;
+	struct apfs_key start, end;
+	struct apfs_phys_extent pext;
+	struct apfs_phys_ext_val *val = NULL;
+	u64 owner, paddr_end;
+	int ret;
+
+	fq = &APFS_SM(sb)->sm_raw->sm_fq[APFS_SFQ_MAIN];
+
+	apfs_init_extent_key(0, &start);
+	apfs_init_extent_key(APFS_OBJ_ID_MASK, &end);
+	apfs_btree_iter_init(&iter, src_root, APFS_QUERY_EXTENTREF, &start, &end);
+
+	while (*budget > 0 && le64_to_cpu(fq->sfq_count) <= APFS_TRANS_MAIN_QUEUE_MAX) {
+		/* Each record gets removed, so the first one is always next */
+		ret = apfs_btree_iter_seek(sb, &iter, NULL /* key */);
+		if (ret) {
+			if (ret == -ENODATA)
+				ret = 0;
+			else
+				apfs_err(sb, "failed to find first pext in tree 0x%llx", src_root->object.oid);
+			goto out;
+		}
+		ret = apfs_phys_ext_from_query(iter.query, &pext);
+		if (ret) {
+			apfs_err(sb, "bad pext record in tree 0x%llx", src_root->object.oid);
+			goto out;
+		}
+		val = (void *)iter.query->node->object.data + iter.query->off;
+		owner = le64_to_cpu(val->owning_obj_id);
+		val = NULL;
+		apfs_btree_iter_release(&iter);
+
+		ret = apfs_remove_phys_ext_rec(src_root, pext.bno);
+		if (ret) {
+			apfs_err(sb, "removal failed for paddr 0x%llx", pext.bno);
+			goto out;
+		}
+
+		paddr_end = pext.bno + pext.blkcount;
+		while (paddr_end > pext.bno) {
+			ret = apfs_merge_single_pext(dst_root, &pext, owner, &paddr_end);
+			if (ret) {
+				apfs_err(sb, "failed to merge pext 0x%llx-0x%llx", pext.bno, paddr_end);
+				goto out;
+			}
+		}
+		--*budget;
+	}
+	ret = -EAGAIN;
+out:
+	apfs_btree_iter_release(&iter);
+	return ret;
+}
+
 /**
  * apfs_take_single_extent - Take a reference to a single extent
  * @sb:		filesystem superblock
@@ -2178,42 +2447,104 @@ static int apfs_range_take_reference(struct super_block *sb, u64 paddr, u64 leng
 }
 
 /**
- * apfs_clone_single_extent - Make a copy of an extent in a dstream to a new one
+ * apfs_extent_create_records - Create a sorted batch of new extent records
+ * @sb:		filesystem superblock
+ * @dstream_id:	id of the owner dstream
+ * @extents:	in-memory extents to record, sorted by logical address
+ * @count:	number of extents in @extents
+ *
+ * The records are all inserted with a single catalog search. Returns 0 on
+ * success or a negative error code in case of failure.
+ */
+static int apfs_extent_create_records(struct super_block *sb, u64 dstream_id, struct apfs_file_extent *extents, int count)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_query *query = NULL;
+	struct apfs_file_extent_key *raw_keys = NULL;
+	struct apfs_file_extent_val *raw_vals = NULL;
+	struct apfs_btree_rec *recs = NULL;
+	int ret = 0;
+	int i;
+
+	raw_keys = kmalloc_array(count, sizeof(*raw_keys), GFP_KERNEL);
+	raw_vals = kmalloc_array(count, sizeof(*raw_vals), GFP_KERNEL);
+	recs = kmalloc_array(count, sizeof(*recs), GFP_KERNEL);
+	if (!raw_keys || !raw_vals || !recs) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < count; ++i) {
+		apfs_key_set_hdr(APFS_TYPE_FILE_EXTENT, dstream_id, &raw_keys[i]);
+		raw_keys[i].logical_addr = cpu_to_le64(extents[i].logical_addr);
+		raw_vals[i].len_and_flags = cpu_to_le64(extents[i].len);
+		raw_vals[i].phys_block_num = cpu_to_le64(extents[i].phys_block_num);
+		raw_vals[i].crypto_id = cpu_to_le64(apfs_vol_is_encrypted(sb) ? dstream_id : 0); /* TODO */
+
+		recs[i].key = &raw_keys[i];
+		recs[i].key_len = sizeof(raw_keys[i]);
+		recs[i].val = &raw_vals[i];
+		recs[i].val_len = sizeof(raw_vals[i]);
+	}
+
+	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
+	if (!query) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	apfs_init_file_extent_key(dstream_id, extents[0].logical_addr, &query->key);
+	query->flags = APFS_QUERY_CAT | APFS_QUERY_EXACT;
+
+	ret = apfs_btree_query(sb, &query);
+	if (ret && ret != -ENODATA) {
+		apfs_err(sb, "query failed for id 0x%llx, addr 0x%llx", dstream_id, extents[0].logical_addr);
+		goto out;
+	}
+
+	ret = apfs_btree_insert_batch(query, recs, count);
+	if (ret)
+		apfs_err(sb, "insertion failed for id 0x%llx, %d extents", dstream_id, count);
+out:
+	apfs_free_query(query);
+	kfree(recs);
+	kfree(raw_vals);
+	kfree(raw_keys);
+	return ret;
+}
+
+/**
+ * apfs_clone_extent_batch - Make a copy of some extents in a dstream
  * @dstream:	old dstream
  * @new_id:	id of the new dstream
- * @log_addr:	logical address for the extent
+ * @extents:	the extents to copy, sorted by logical address
+ * @count:	number of extents in @extents
  *
- * Duplicates the logical extent, and updates the references to the physical
- * extents as required. Sets @addr to the end of the extent, so that the caller
- * can continue in the same place. Returns 0 on success, or a negative error
- * code in case of failure.
+ * Duplicates the logical extents, and updates the references to the physical
+ * extents as required. Returns 0 on success, or a negative error code in case
+ * of failure.
  */
-static int apfs_clone_single_extent(struct apfs_dstream_info *dstream, u64 new_id, u64 *log_addr)
+static int apfs_clone_extent_batch(struct apfs_dstream_info *dstream, u64 new_id, struct apfs_file_extent *extents, int count)
 {
 	struct super_block *sb = dstream->ds_sb;
-	struct apfs_file_extent extent;
+	struct apfs_file_extent *extent = NULL;
 	int err;
+	int i;
 
-	err = apfs_extent_read(dstream, *log_addr >> sb->s_blocksize_bits, &extent);
-	if (err) {
-		apfs_err(sb, "failed to read an extent to clone for dstream 0x%llx", dstream->ds_id);
-		return err;
-	}
-	err = apfs_extent_create_record(sb, new_id, &extent);
+	err = apfs_extent_create_records(sb, new_id, extents, count);
 	if (err) {
-		apfs_err(sb, "failed to create extent record for clone of dstream 0x%llx", dstream->ds_id);
+		apfs_err(sb, "failed to create extent records for clone of dstream 0x%llx", dstream->ds_id);
 		return err;
 	}
 
-	if (!apfs_ext_is_hole(&extent)) {
-		err = apfs_range_take_reference(sb, extent.phys_block_num, extent.len);
+	for (i = 0; i < count; ++i) {
+		extent = &extents[i];
+		if (apfs_ext_is_hole(extent))
+			continue;
+		err = apfs_range_take_reference(sb, extent->phys_block_num, extent->len);
 		if (err) {
-			apfs_err(sb, "failed to take a reference to physical range 0x%llx-0x%llx", extent.phys_block_num, extent.len);
+			apfs_err(sb, "failed to take a reference to physical range 0x%llx-0x%llx", extent->phys_block_num, extent->len);
 			return err;
 		}
 	}
-
-	*log_addr += extent.len;
 	return 0;
 }
 
@@ -2222,18 +2553,829 @@ static int apfs_clone_single_extent(struct apfs_dstream_info *dstream, u64 new_i
  * @dstream:	old dstream
  * @new_id:	id for the new dstream
  *
+ * The extents are read in batches with a b-tree iterator, and the copies are
+ * only created once each batch is complete, all with a single bulk insertion.
+ * This way the catalog is searched from the root once per batch instead of
+ * once per extent.
+ *
  * Returns 0 on success, or a negative error code in case of failure.
  */
 int apfs_clone_extents(struct apfs_dstream_info *dstream, u64 new_id)
 {
+	struct super_block *sb = dstream->ds_sb;
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_btree_iter iter;
+	struct apfs_file_extent *batch = NULL;
+	struct apfs_key start, end;
 	u64 next = 0;
-	int err;
+	int count;
+	int ret, err;
 
-	while (next < dstream->ds_size) {
-		err = apfs_clone_single_extent(dstream, new_id, &next);
-		if (err)
-			return err;
+	/* The extents must all be on disk for the iterator to find them */
+	ret = apfs_flush_extent_cache(dstream);
+	if (ret) {
+		apfs_err(sb, "extent cache flush failed for dstream 0x%llx", dstream->ds_id);
+		return ret;
 	}
+
+	batch = kmalloc_array(APFS_CLONE_BATCH, sizeof(*batch), GFP_KERNEL);
+	if (!batch)
+		return -ENOMEM;
+
+	apfs_init_file_extent_key(dstream->ds_id, 0 /* offset */, &start);
+	apfs_init_file_extent_key(dstream->ds_id, dstream->ds_size, &end);
+	apfs_btree_iter_init(&iter, sbi->s_cat_root, APFS_QUERY_CAT, &start, &end);
+
+	ret = apfs_btree_iter_seek(sb, &iter, NULL /* key */);
+	while (!ret) {
+		/* Read the whole batch before the catalog gets modified */
+		count = 0;
+		do {
+			ret = apfs_extent_from_query(iter.query, &batch[count]);
+			if (ret) {
+				apfs_err(sb, "bad extent record for dstream 0x%llx", dstream->ds_id);
+				goto out;
+			}
+			if (batch[count].logical_addr != next) {
+				apfs_err(sb, "no extent for addr 0x%llx in dstream 0x%llx", next, dstream->ds_id);
+				ret = -EFSCORRUPTED;
+				goto out;
+			}
+			next += batch[count].len;
+			++count;
+		} while (count < APFS_CLONE_BATCH && !(ret = apfs_btree_iter_next(sb, &iter)));
+		if (ret && ret != -ENODATA)
+			break;
+
+		err = apfs_clone_extent_batch(dstream, new_id, batch, count);
+		if (err) {
+			ret = err;
+			goto out;
+		}
+
+		/* The path is stale now, so this searches the tree again */
+		if (!ret)
+			ret = apfs_btree_iter_next(sb, &iter);
+	}
+	if (ret != -ENODATA) {
+		apfs_err(sb, "failed to list extents for dstream 0x%llx", dstream->ds_id);
+		goto out;
+	}
+	ret = 0;
+
+	if (next < dstream->ds_size) {
+		apfs_err(sb, "no extent for addr 0x%llx in dstream 0x%llx", next, dstream->ds_id);
+		ret = -EFSCORRUPTED;
+	}
+
+out:
+	apfs_btree_iter_release(&iter);
+	kfree(batch);
+	return ret;
+}
+
+/**
+ * apfs_punch_extents - Remove all extents in a logical range of a dstream
+ * @dstream:	data stream info
+ * @start:	first logical address in the range
+ * @end:	first logical address after the range
+ *
+ * Extents that cross the limits of the range get split first. The range must
+ * be block-aligned, and it may go past the last extent. Returns 0 on success,
+ * or a negative error code in case of failure.
+ */
+static int apfs_punch_extents(struct apfs_dstream_info *dstream, u64 start, u64 end)
+{
+	struct super_block *sb = dstream->ds_sb;
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_query *query = NULL;
+	struct apfs_file_extent extent;
+	u64 extent_end;
+	int ret = 0;
+
+	while (start < end) {
+		query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
+		if (!query)
+			return -ENOMEM;
+		apfs_init_file_extent_key(dstream->ds_id, start, &query->key);
+		query->flags = APFS_QUERY_CAT;
+
+		ret = apfs_btree_query(sb, &query);
+		if (ret && ret != -ENODATA) {
+			apfs_err(sb, "query failed for id 0x%llx, addr 0x%llx", dstream->ds_id, start);
+			goto out;
+		}
+		if (ret == -ENODATA || !apfs_query_found_extent(query)) {
+			ret = 0;
+			goto out;
+		}
+
+		ret = apfs_extent_from_query(query, &extent);
+		if (ret) {
+			apfs_err(sb, "bad extent record for dstream 0x%llx", dstream->ds_id);
+			goto out;
+		}
+		extent_end = extent.logical_addr + extent.len;
+
+		/* Nothing left to remove after the last extent */
+		if (extent_end <= start)
+			goto out;
+
+		if (extent.logical_addr < start) {
+			ret = apfs_split_extent(query, start);
+		} else if (extent_end > end) {
+			ret = apfs_split_extent(query, end);
+		} else {
+			ret = apfs_btree_remove(query);
+			if (ret) {
+				apfs_err(sb, "removal failed for id 0x%llx, addr 0x%llx", dstream->ds_id, start);
+				goto out;
+			}
+			if (apfs_ext_is_hole(&extent)) {
+				dstream->ds_sparse_bytes -= extent.len;
+			} else {
+				ret = apfs_range_put_reference(sb, extent.phys_block_num, extent.len);
+				if (ret) {
+					apfs_err(sb, "failed to put range 0x%llx-0x%llx", extent.phys_block_num, extent.len);
+					goto out;
+				}
+			}
+			ret = apfs_crypto_adj_refcnt(sb, extent.crypto_id, -1);
+			start = extent_end;
+		}
+		if (ret) {
+			apfs_err(sb, "failed to punch addr 0x%llx in dstream 0x%llx", start, dstream->ds_id);
+			goto out;
+		}
+		apfs_free_query(query);
+		query = NULL;
+	}
+
+out:
+	apfs_free_query(query);
+	return ret;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+
+/**
+ * apfs_remap_extent_batch - Remap the next batch of extents for a range clone
+ * @src:	source dstream
+ * @src_pos:	first logical address to remap in @src; updated on return
+ * @src_end:	block-aligned end of the range to remap in @src
+ * @dst:	destination dstream
+ * @dst_pos:	logical address in @dst that corresponds to @src_pos
+ *
+ * Replaces the extents of @dst with references to the physical blocks of up to
+ * APFS_CLONE_BATCH extents from @src. Returns 0 on success, or a negative error
+ * code in case of failure.
+ */
+static int apfs_remap_extent_batch(struct apfs_dstream_info *src, u64 *src_pos, u64 src_end, struct apfs_dstream_info *dst, u64 dst_pos)
+{
+	struct super_block *sb = src->ds_sb;
+	struct apfs_file_extent *batch = NULL;
+	struct apfs_file_extent *extent = NULL;
+	struct apfs_file_extent found;
+	u64 pos = *src_pos;
+	u64 skip;
+	int count = 0;
+	int ret, i;
+
+	/* The extents must all be on disk before the records get changed */
+	ret = apfs_flush_extent_cache(src);
+	if (!ret)
+		ret = apfs_flush_extent_cache(dst);
+	if (ret) {
+		apfs_err(sb, "extent cache flush failed");
+		return ret;
+	}
+
+	batch = kmalloc_array(APFS_CLONE_BATCH, sizeof(*batch), GFP_KERNEL);
+	if (!batch)
+		return -ENOMEM;
+
+	while (pos < src_end && count < APFS_CLONE_BATCH) {
+		ret = apfs_extent_read(src, pos >> sb->s_blocksize_bits, &found);
+		if (ret) {
+			apfs_err(sb, "failed to read extent for addr 0x%llx in dstream 0x%llx", pos, src->ds_id);
+			goto out;
+		}
+		skip = pos - found.logical_addr;
+
+		extent = &batch[count++];
+		extent->logical_addr = dst_pos + pos - *src_pos;
+		extent->len = min(found.logical_addr + found.len, src_end) - pos;
+		extent->phys_block_num = 0;
+		if (!apfs_ext_is_hole(&found))
+			extent->phys_block_num = found.phys_block_num + (skip >> sb->s_blocksize_bits);
+		extent->crypto_id = 0;
+		pos += extent->len;
+	}
+
+	ret = apfs_punch_extents(dst, dst_pos, dst_pos + pos - *src_pos);
+	if (ret) {
+		apfs_err(sb, "failed to punch range in dstream 0x%llx", dst->ds_id);
+		goto out;
+	}
+	ret = apfs_extent_create_records(sb, dst->ds_id, batch, count);
+	if (ret) {
+		apfs_err(sb, "failed to create extent records for dstream 0x%llx", dst->ds_id);
+		goto out;
+	}
+	for (i = 0; i < count; ++i) {
+		extent = &batch[i];
+		if (apfs_ext_is_hole(extent)) {
+			dst->ds_sparse_bytes += extent->len;
+			continue;
+		}
+		ret = apfs_range_take_reference(sb, extent->phys_block_num, extent->len);
+		if (ret) {
+			apfs_err(sb, "failed to take a reference to physical range 0x%llx-0x%llx", extent->phys_block_num, extent->len);
+			goto out;
+		}
+	}
+	*src_pos = pos;
+
+out:
+	/* Both dstreams may have had their records split or removed */
+	src->ds_cached_ext.len = 0;
+	dst->ds_cached_ext.len = 0;
+	kfree(batch);
+	return ret;
+}
+
+/**
+ * apfs_remap_prepare_dst - Get the target of a range clone ready for the remap
+ * @inode:	the target inode
+ * @destoff:	offset for the remapped range
+ *
+ * Makes sure the target has an exclusive dstream, with extents that reach up
+ * to @destoff. Returns 0 on success, or a negative error code in case of
+ * failure.
+ */
+static int apfs_remap_prepare_dst(struct inode *inode, loff_t destoff)
+{
+	struct super_block *sb = inode->i_sb;
+	struct apfs_dstream_info *dstream = &APFS_I(inode)->i_dstream;
+	int err;
+
+	err = apfs_inode_create_dstream_rec(inode);
+	if (err) {
+		apfs_err(sb, "failed to create dstream for ino 0x%llx", apfs_ino(inode));
+		return err;
+	}
+
+	if (destoff <= inode->i_size)
+		return 0;
+
+	/* Must be called before i_size is changed */
+	err = apfs_truncate(dstream, destoff);
+	if (err) {
+		apfs_err(sb, "truncation failed for ino 0x%llx", apfs_ino(inode));
+		return err;
+	}
+	i_size_write(inode, destoff);
+	dstream->ds_size = destoff;
+	return 0;
+}
+
+/**
+ * apfs_remap_range - Clone or dedupe a range of blocks between two files
+ * @src_file:		source file
+ * @off:		offset of the range in @src_file
+ * @dst_file:		destination file
+ * @destoff:		offset of the range in @dst_file
+ * @len:		length of the range (0 to reach the end of @src_file)
+ * @remap_flags:	REMAP_FILE_* flags
+ *
+ * The destination extents are replaced with new references to the physical
+ * blocks of the source. Long ranges are remapped over several transactions,
+ * so the operation is not atomic. Returns the number of bytes remapped, or a
+ * negative error code in case of failure.
+ */
+static loff_t apfs_remap_range(struct file *src_file, loff_t off, struct file *dst_file, loff_t destoff, loff_t len, unsigned int remap_flags)
+{
+	struct inode *src_inode = file_inode(src_file);
+	struct inode *dst_inode = file_inode(dst_file);
+	struct apfs_inode_info *src_ai = APFS_I(src_inode);
+	struct apfs_inode_info *dst_ai = APFS_I(dst_inode);
+	struct apfs_dstream_info *src_ds = &src_ai->i_dstream;
+	struct apfs_dstream_info *dst_ds = &dst_ai->i_dstream;
+	struct super_block *sb = src_inode->i_sb;
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	u64 src_pos, src_end;
+	loff_t ret;
+	int err;
+
+	/* The crypto ids of the extents would need to be shared as well */
+	if (apfs_vol_is_encrypted(sb)) {
+		apfs_warn(sb, "range clones are not supported in encrypted volumes");
+		return -EOPNOTSUPP;
+	}
+	if ((src_ai->i_bsd_flags | dst_ai->i_bsd_flags) & APFS_INOBSD_COMPRESSED) {
+		apfs_warn(sb, "range clones are not supported for compressed files");
+		return -EOPNOTSUPP;
+	}
+
+	lock_two_nondirectories(src_inode, dst_inode);
+
+	/* This also compares the contents for dedupe requests */
+	ret = generic_remap_file_range_prep(src_file, off, dst_file, destoff, &len, remap_flags);
+	if (ret < 0 || len == 0)
+		goto out_unlock;
+	if (!src_ai->i_has_dstream) {
+		apfs_alert(sb, "ino 0x%llx has size but no dstream", apfs_ino(src_inode));
+		ret = -EFSCORRUPTED;
+		goto out_unlock;
+	}
+
+	src_pos = off;
+	src_end = round_up(off + len, sb->s_blocksize);
+	while (src_pos < src_end) {
+		err = apfs_transaction_start(sb, APFS_TRANS_REG);
+		if (err) {
+			ret = err;
+			goto out_truncate;
+		}
+		apfs_inode_join_transaction(sb, src_inode);
+		apfs_inode_join_transaction(sb, dst_inode);
+
+		if (src_pos == off) {
+			err = apfs_remap_prepare_dst(dst_inode, destoff);
+			if (err)
+				goto fail;
+		}
+
+		err = apfs_remap_extent_batch(src_ds, &src_pos, src_end, dst_ds, destoff + src_pos - off);
+		if (err) {
+			apfs_err(sb, "failed to remap range from ino 0x%llx to 0x%llx", apfs_ino(src_inode), apfs_ino(dst_inode));
+			goto fail;
+		}
+
+		if (src_pos == src_end) {
+			if (destoff + len > dst_inode->i_size) {
+				i_size_write(dst_inode, destoff + len);
+				dst_ds->ds_size = destoff + len;
+			}
+			dst_ai->i_int_flags |= APFS_INODE_WAS_EVER_CLONED;
+			src_ai->i_int_flags |= APFS_INODE_WAS_EVER_CLONED;
+
+			/* Same as whole file clones, the shared blocks need CoW */
+			sbi->s_nxi->nx_transaction.t_state |= APFS_NX_TRANS_FORCE_COMMIT;
+		}
+		err = apfs_transaction_commit(sb);
+		if (err)
+			goto fail;
+	}
+	ret = len;
+
+out_truncate:
+	/* The cached pages may still be mapped to the old blocks */
+	truncate_inode_pages_range(&dst_inode->i_data, round_down(destoff, PAGE_SIZE), round_up(destoff + len, PAGE_SIZE) - 1);
+out_unlock:
+	unlock_two_nondirectories(src_inode, dst_inode);
+	return ret;
+
+fail:
+	apfs_transaction_abort(sb);
+	ret = err;
+	goto out_truncate;
+}
+
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0) */
+
+/**
+ * apfs_count_extents - Count the extent records in a range of a dstream
+ * @dstream:	data stream info
+ * @start:	first logical address in the range
+ * @end:	first logical address after the range
+ * @count:	on return, the number of extents that overlap the range
+ *
+ * The extent cache must be clean. Returns 0 on success, or a negative error
+ * code in case of failure.
+ */
+static int apfs_count_extents(struct apfs_dstream_info *dstream, u64 start, u64 end, u64 *count)
+{
+	struct super_block *sb = dstream->ds_sb;
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_btree_iter iter;
+	struct apfs_file_extent first;
+	struct apfs_key from, to;
+	int ret;
+
+	*count = 0;
+	if (start >= end)
+		return 0;
+
+	/* The first extent may begin before the range */
+	ret = apfs_extent_read(dstream, start >> sb->s_blocksize_bits, &first);
+	if (ret)
+		return ret;
+
+	apfs_init_file_extent_key(dstream->ds_id, first.logical_addr, &from);
+	apfs_init_file_extent_key(dstream->ds_id, end, &to);
+	apfs_btree_iter_init(&iter, sbi->s_cat_root, APFS_QUERY_CAT, &from, &to);
+
+	ret = apfs_btree_iter_seek(sb, &iter, NULL /* key */);
+	while (!ret) {
+		++*count;
+		ret = apfs_btree_iter_next(sb, &iter);
+	}
+	apfs_btree_iter_release(&iter);
+	if (ret != -ENODATA) {
+		apfs_err(sb, "failed to list extents for dstream 0x%llx", dstream->ds_id);
+		return ret;
+	}
+	return 0;
+}
+
+/**
+ * apfs_defrag_find_run - Find the next run of fragmented extents in a range
+ * @dstream:	data stream info
+ * @pos:	logical address to start from; on return, the end of the search
+ * @end:	end of the range to search
+ * @flags:	APFS_DEFRAG_* flags
+ * @run:	on return, the logically contiguous pieces of the run
+ * @count:	on return, the number of pieces in @run, or 0 if none was found
+ *
+ * Holes always break runs, and so do shared extents unless the flags ask to
+ * rewrite them as well. Runs that are already physically contiguous are not
+ * reported. Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_defrag_find_run(struct apfs_dstream_info *dstream, u64 *pos, u64 end, u32 flags, struct apfs_file_extent *run, int *count)
+{
+	struct super_block *sb = dstream->ds_sb;
+	struct apfs_file_extent found;
+	struct apfs_file_extent *piece = NULL;
+	u64 blkcnt, skip;
+	int breaks = 0;
+	bool shared;
+	int ret;
+
+	*count = 0;
+	while (*pos < end) {
+		ret = apfs_extent_read(dstream, *pos >> sb->s_blocksize_bits, &found);
+		if (ret) {
+			apfs_err(sb, "failed to read extent for addr 0x%llx in dstream 0x%llx", *pos, dstream->ds_id);
+			return ret;
+		}
+		skip = *pos - found.logical_addr;
+
+		piece = &run[*count];
+		piece->logical_addr = *pos;
+		piece->len = min(found.logical_addr + found.len, end) - *pos;
+		piece->phys_block_num = 0;
+		piece->crypto_id = 0;
+		blkcnt = piece->len >> sb->s_blocksize_bits;
+
+		shared = false;
+		if (!apfs_ext_is_hole(&found)) {
+			piece->phys_block_num = found.phys_block_num + (skip >> sb->s_blocksize_bits);
+			if (!(flags & APFS_DEFRAG_SHARED)) {
+				ret = apfs_range_is_shared(sb, piece->phys_block_num, blkcnt, true /* clones */, &shared);
+				if (ret) {
+					apfs_err(sb, "failed to check range 0x%llx-0x%llx", piece->phys_block_num, blkcnt);
+					return ret;
+				}
+			}
+		}
+		if (apfs_ext_is_hole(&found) || shared) {
+			if (breaks)
+				return 0;
+			*count = 0;
+			*pos += piece->len;
+			continue;
+		}
+
+		if (*count > 0) {
+			struct apfs_file_extent *prev = &run[*count - 1];
+
+			if (prev->phys_block_num + (prev->len >> sb->s_blocksize_bits) != piece->phys_block_num)
+				++breaks;
+		}
+		++*count;
+		*pos += piece->len;
+	}
+
+	if (!breaks)
+		*count = 0;
+	return 0;
+}
+
+/**
+ * apfs_defrag_move_block - Point the page cache buffer for a block somewhere else
+ * @inode:	the inode being defragmented
+ * @pages:	pages read for the current window, already uptodate
+ * @first:	index of the first page in @pages
+ * @addr:	logical address of the block
+ * @bno:	new physical block number
+ *
+ * The buffer joins the transaction, so its data gets written to @bno on commit.
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_defrag_move_block(struct inode *inode, struct page **pages, pgoff_t first, u64 addr, u64 bno)
+{
+	struct super_block *sb = inode->i_sb;
+	struct page *page = pages[(addr >> PAGE_SHIFT) - first];
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	struct folio *folio;
+#endif
+	struct buffer_head *bh = NULL;
+	unsigned int off;
+	int err;
+
+	lock_page(page);
+	if (page->mapping != inode->i_mapping) {
+		apfs_err(sb, "page truncated during defrag of ino 0x%llx", apfs_ino(inode));
+		err = -EAGAIN;
+		goto out;
+	}
+	if (!page_has_buffers(page)) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 7, 0)
+		create_empty_buffers(page, sb->s_blocksize, 0);
+#else
+		folio = page_folio(page);
+		bh = folio_buffers(folio);
+		if (!bh)
+			bh = create_empty_buffers(folio, sb->s_blocksize, 0);
+#endif
+	}
+
+	bh = page_buffers(page);
+	for (off = addr & (PAGE_SIZE - 1); off; off -= sb->s_blocksize)
+		bh = bh->b_this_page;
+
+	apfs_map_bh(bh, sb, bno);
+	set_buffer_uptodate(bh);
+	err = apfs_transaction_join(sb, bh);
+out:
+	unlock_page(page);
+	return err;
+}
+
+/**
+ * apfs_defrag_run - Rewrite a run of extents into new, contiguous blocks
+ * @inode:	the inode being defragmented
+ * @pages:	pages read for the current window, already uptodate
+ * @first:	index of the first page in @pages
+ * @run:	the logically contiguous pieces of the run
+ * @count:	number of pieces in @run
+ * @moved:	array, at least as long as the run in blocks, for the new extents
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_defrag_run(struct inode *inode, struct page **pages, pgoff_t first, struct apfs_file_extent *run, int count, struct apfs_file_extent *moved)
+{
+	struct super_block *sb = inode->i_sb;
+	struct apfs_superblock *vsb_raw = APFS_SB(sb)->s_vsb_raw;
+	struct apfs_dstream_info *dstream = &APFS_I(inode)->i_dstream;
+	struct apfs_file_extent *last = NULL;
+	u64 start, end, addr;
+	u64 bno, goal = 0;
+	int moved_count = 0;
+	int ret, i;
+
+	start = run[0].logical_addr;
+	end = run[count - 1].logical_addr + run[count - 1].len;
+
+	/* Allocate each block right after the previous one, whenever possible */
+	for (addr = start; addr < end; addr += sb->s_blocksize) {
+		ret = apfs_spaceman_allocate_block_near(sb, goal, &bno);
+		if (ret) {
+			apfs_err(sb, "block allocation failed");
+			return ret;
+		}
+		apfs_assert_in_transaction(sb, &vsb_raw->apfs_o);
+		le64_add_cpu(&vsb_raw->apfs_fs_alloc_count, 1);
+		le64_add_cpu(&vsb_raw->apfs_total_blocks_alloced, 1);
+		goal = bno + 1;
+
+		ret = apfs_defrag_move_block(inode, pages, first, addr, bno);
+		if (ret)
+			return ret;
+
+		if (last && last->phys_block_num + (last->len >> sb->s_blocksize_bits) == bno) {
+			last->len += sb->s_blocksize;
+			continue;
+		}
+		last = &moved[moved_count++];
+		last->logical_addr = addr;
+		last->phys_block_num = bno;
+		last->len = sb->s_blocksize;
+		last->crypto_id = 0;
+	}
+
+	ret = apfs_punch_extents(dstream, start, end);
+	if (ret) {
+		apfs_err(sb, "failed to punch range in dstream 0x%llx", dstream->ds_id);
+		return ret;
+	}
+	ret = apfs_extent_create_records(sb, dstream->ds_id, moved, moved_count);
+	if (ret) {
+		apfs_err(sb, "failed to create extent records for dstream 0x%llx", dstream->ds_id);
+		return ret;
+	}
+	for (i = 0; i < moved_count; ++i) {
+		ret = apfs_insert_phys_extent(dstream, &moved[i]);
+		if (ret) {
+			apfs_err(sb, "pext insertion failed for dstream 0x%llx", dstream->ds_id);
+			return ret;
+		}
+	}
+	return 0;
+}
+
+/**
+ * apfs_defrag_window - Defragment a window of a file in a single transaction
+ * @inode:	the inode to defragment
+ * @pos:	first logical address of the window; on return, where to continue
+ * @end:	end of the window
+ * @flags:	APFS_DEFRAG_* flags
+ * @report_start: start of the whole range, for the extent counts
+ * @report_end:	end of the whole range, for the extent counts
+ * @before:	if not NULL, returns the extent count before the defrag
+ * @after:	returns the extent count after the defrag, set on the last window
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_defrag_window(struct inode *inode, u64 *pos, u64 end, u32 flags, u64 report_start, u64 report_end, u64 *before, u64 *after)
+{
+	struct super_block *sb = inode->i_sb;
+	struct apfs_dstream_info *dstream = &APFS_I(inode)->i_dstream;
+	struct address_space *mapping = inode->i_mapping;
+	struct apfs_file_extent *run = NULL, *moved = NULL;
+	struct page **pages = NULL;
+	pgoff_t first, last, idx;
+	int count;
+	int ret;
+
+	/* Write back the pages first, so that they can be moved while clean */
+	ret = filemap_write_and_wait_range(mapping, *pos, end - 1);
+	if (ret)
+		return ret;
+
+	first = *pos >> PAGE_SHIFT;
+	last = (end - 1) >> PAGE_SHIFT;
+	pages = kcalloc(last - first + 1, sizeof(*pages), GFP_KERNEL);
+	run = kmalloc_array(APFS_DEFRAG_MAX_BLOCKS, sizeof(*run), GFP_KERNEL);
+	moved = kmalloc_array(APFS_DEFRAG_MAX_BLOCKS, sizeof(*moved), GFP_KERNEL);
+	if (!pages || !run || !moved) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* The pages must be read before the transaction takes the semaphore */
+	for (idx = first; idx <= last; ++idx) {
+		pages[idx - first] = read_mapping_page(mapping, idx, NULL);
+		if (IS_ERR(pages[idx - first])) {
+			ret = PTR_ERR(pages[idx - first]);
+			pages[idx - first] = NULL;
+			goto out;
+		}
+	}
+
+	ret = apfs_transaction_start(sb, APFS_TRANS_REG);
+	if (ret)
+		goto out;
+	apfs_inode_join_transaction(sb, inode);
+
+	ret = apfs_flush_extent_cache(dstream);
+	if (ret) {
+		apfs_err(sb, "extent cache flush failed for dstream 0x%llx", dstream->ds_id);
+		goto fail;
+	}
+	if (before) {
+		ret = apfs_count_extents(dstream, report_start, report_end, before);
+		if (ret)
+			goto fail;
+	}
+
+	ret = apfs_defrag_find_run(dstream, pos, end, flags, run, &count);
+	if (ret)
+		goto fail;
+	if (count) {
+		ret = apfs_defrag_run(inode, pages, first, run, count, moved);
+		if (ret) {
+			apfs_err(sb, "failed to defrag ino 0x%llx", apfs_ino(inode));
+			goto fail;
+		}
+	}
+	dstream->ds_cached_ext.len = 0;
+
+	if (after && *pos >= report_end) {
+		ret = apfs_count_extents(dstream, report_start, report_end, after);
+		if (ret)
+			goto fail;
+	}
+
+	ret = apfs_transaction_commit(sb);
+	if (ret)
+		goto fail;
+	goto out;
+
+fail:
+	dstream->ds_cached_ext.len = 0;
+	apfs_transaction_abort(sb);
+out:
+	if (pages) {
+		for (idx = first; idx <= last; ++idx) {
+			if (pages[idx - first])
+				put_page(pages[idx - first]);
+		}
+	}
+	kfree(moved);
+	kfree(run);
+	kfree(pages);
+	return ret;
+}
+
+/**
+ * apfs_ioc_defrag - Ioctl handler to defragment a range of a file
+ * @file:	affected file
+ * @user_arg:	ioctl argument
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+int apfs_ioc_defrag(struct file *file, void __user *user_arg)
+{
+	struct inode *inode = file_inode(file);
+	struct super_block *sb = inode->i_sb;
+	struct apfs_inode_info *ai = APFS_I(inode);
+	struct apfs_ioctl_defrag arg;
+	u64 start, end, pos, win_end;
+	u64 *before = NULL;
+	int err;
+
+	if (!(file->f_mode & FMODE_WRITE) && !capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (!S_ISREG(inode->i_mode))
+		return -EINVAL;
+	if (copy_from_user(&arg, user_arg, sizeof(arg)))
+		return -EFAULT;
+	if (arg.flags & ~APFS_DEFRAG_SHARED)
+		return -EINVAL;
+
+	/* Same as range clones, the crypto ids would need some care */
+	if (apfs_vol_is_encrypted(sb)) {
+		apfs_warn(sb, "defrag is not supported in encrypted volumes");
+		return -EOPNOTSUPP;
+	}
+	if (ai->i_bsd_flags & APFS_INOBSD_COMPRESSED) {
+		apfs_warn(sb, "defrag is not supported for compressed files");
+		return -EOPNOTSUPP;
+	}
+
+	err = mnt_want_write_file(file);
+	if (err)
+		return err;
+	inode_lock(inode);
+
+	arg.extents_before = arg.extents_after = 0;
+	if (!ai->i_has_dstream)
+		goto out_unlock;
+
+	/* Cloned files share all their extents through the dstream */
+	if (ai->i_dstream.ds_shared) {
+		if (!(arg.flags & APFS_DEFRAG_SHARED))
+			goto out_unlock;
+		err = apfs_transaction_start(sb, APFS_TRANS_REG);
+		if (err)
+			goto out_unlock;
+		apfs_inode_join_transaction(sb, inode);
+		err = apfs_inode_create_exclusive_dstream(inode);
+		if (err) {
+			apfs_transaction_abort(sb);
+			goto out_unlock;
+		}
+		err = apfs_transaction_commit(sb);
+		if (err) {
+			apfs_transaction_abort(sb);
+			goto out_unlock;
+		}
+	}
+
+	start = round_down(arg.start, sb->s_blocksize);
+	end = round_up(i_size_read(inode), sb->s_blocksize);
+	if (arg.len && arg.start < end && arg.len < end - arg.start)
+		end = round_up(arg.start + arg.len, sb->s_blocksize);
+
+	before = &arg.extents_before;
+	pos = start;
+	while (pos < end) {
+		win_end = min(end, pos + ((u64)APFS_DEFRAG_MAX_BLOCKS << sb->s_blocksize_bits));
+		err = apfs_defrag_window(inode, &pos, win_end, arg.flags, start, end, before, &arg.extents_after);
+		if (err)
+			goto out_unlock;
+		before = NULL;
+	}
+
+out_unlock:
+	inode_unlock(inode);
+	mnt_drop_write_file(file);
+	if (err)
+		return err;
+	if (copy_to_user(user_arg, &arg, sizeof(arg)))
+		return -EFAULT;
 	return 0;
 }
 
@@ -37,6 +37,7 @@ static vm_fault_t apfs_page_mkwrite(struct vm_fault *vmf)
 	vm_fault_t ret = VM_FAULT_LOCKED;
 	unsigned int blocksize, block_start, len;
 	u64 size;
+	bool inplace;
 	int err = 0;
 
 	sb_start_pagefault(inode->i_sb);
@@ -81,7 +82,10 @@ static vm_fault_t apfs_page_mkwrite(struct vm_fault *vmf)
 	else
 		len = PAGE_SIZE;
 
-	/* The blocks were read on the fault, mark them as unmapped for CoW */
+	/*
+	 * The blocks were read on the fault, mark them as unmapped for CoW
+	 * unless they can be overwritten in place
+	 */
 	head = page_buffers(page);
 	blocksize = head->b_size;
 	for (bh = head, block_start = 0; bh != head || !block_start;
@@ -91,6 +95,17 @@ static vm_fault_t apfs_page_mkwrite(struct vm_fault *vmf)
 			ASSERT(!buffer_mapped(bh) || buffer_uptodate(bh));
 			if (buffer_trans(bh))
 				continue;
+			if (buffer_mapped(bh)) {
+				err = apfs_block_can_overwrite(inode, bh->b_blocknr, &inplace);
+				if (err)
+					goto out_unlock;
+				if (inplace) {
+					err = apfs_transaction_join(sb, bh);
+					if (err)
+						goto out_unlock;
+					continue;
+				}
+			}
 			clear_buffer_mapped(bh);
 		}
 	}
@@ -159,13 +174,85 @@ int apfs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 	return apfs_sync_fs(sb, true /* wait */);
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 3, 0)
+/**
+ * apfs_copy_file_data - Copy a range between files by reading the data
+ * @src_file:	source file
+ * @src_off:	offset of the range in @src_file
+ * @dst_file:	destination file
+ * @dst_off:	offset of the range in @dst_file
+ * @len:	length of the range
+ * @flags:	copy_file_range() flags
+ *
+ * Returns the number of bytes copied, or a negative error code in case of
+ * failure.
+ */
+static ssize_t apfs_copy_file_data(struct file *src_file, loff_t src_off,
+				   struct file *dst_file, loff_t dst_off,
+				   size_t len, unsigned int flags)
+{
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+	return splice_copy_file_range(src_file, src_off, dst_file, dst_off, len);
+#else
+	return generic_copy_file_range(src_file, src_off, dst_file, dst_off, len, flags);
+#endif
+}
+
+/**
+ * apfs_copy_file_range - Copy a range between files, sharing blocks if possible
+ * @src_file:	source file
+ * @src_off:	offset of the range in @src_file
+ * @dst_file:	destination file
+ * @dst_off:	offset of the range in @dst_file
+ * @len:	length of the range
+ * @flags:	copy_file_range() flags
+ *
+ * The block-aligned part of the range gets cloned, so that only the unaligned
+ * head and tail need their data copied. Returns the number of bytes copied, or
+ * a negative error code in case of failure.
+ */
 static ssize_t apfs_copy_file_range(struct file *src_file, loff_t src_off,
 				    struct file *dst_file, loff_t dst_off,
 				    size_t len, unsigned int flags)
 {
-	return (splice_copy_file_range(src_file, src_off,
-		dst_file, dst_off, len));
+	struct super_block *sb = file_inode(src_file)->i_sb;
+	u64 blkmask = sb->s_blocksize - 1;
+	size_t head, body;
+	ssize_t copied = 0;
+	ssize_t ret;
+	loff_t cloned;
+
+	/* Clones need both ranges to be in the same place inside their blocks */
+	if (file_inode(dst_file)->i_sb != sb || (src_off ^ dst_off) & blkmask)
+		return apfs_copy_file_data(src_file, src_off, dst_file, dst_off, len, flags);
+
+	head = min_t(size_t, len, (sb->s_blocksize - (src_off & blkmask)) & blkmask);
+	body = (len - head) & ~blkmask;
+	if (!body)
+		return apfs_copy_file_data(src_file, src_off, dst_file, dst_off, len, flags);
+
+	if (head) {
+		ret = apfs_copy_file_data(src_file, src_off, dst_file, dst_off, head, flags);
+		if (ret != head)
+			return ret;
+		copied = head;
+	}
+
+	cloned = apfs_remap_file_range(src_file, src_off + copied, dst_file, dst_off + copied, body, REMAP_FILE_CAN_SHORTEN);
+	if (cloned < 0) {
+		/* Some ranges can't be cloned, so fall back to a copy for those */
+		if (cloned != -EOPNOTSUPP && cloned != -EINVAL && cloned != -EXDEV)
+			return copied ? copied : cloned;
+		cloned = 0;
+	}
+	copied += cloned;
+	if (copied == len)
+		return copied;
+
+	ret = apfs_copy_file_data(src_file, src_off + copied, dst_file, dst_off + copied, len - copied, flags);
+	if (ret < 0)
+		return copied ? copied : ret;
+	return copied + ret;
 }
 #endif
 
@@ -178,10 +265,8 @@ const struct file_operations apfs_file_operations = {
 	.fsync			= apfs_fsync,
 	.unlocked_ioctl		= apfs_file_ioctl,
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 3, 0)
 	.copy_file_range	= apfs_copy_file_range,
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 3, 0)
-	.copy_file_range	= generic_copy_file_range,
 #endif
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
@@ -8,6 +8,7 @@
 #include <linux/mount.h>
 #include <linux/mpage.h>
 #include <linux/blk_types.h>
+#include <linux/xattr.h>
 #include "apfs.h"
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0) || RHEL_VERSION_GE(9, 3)
@@ -166,7 +167,7 @@ int apfs_inode_create_exclusive_dstream(struct inode *inode)
  * Does nothing if the record already exists.  TODO: support cloned files.
  * Returns 0 on success or a negative error code in case of failure.
  */
-static int apfs_inode_create_dstream_rec(struct inode *inode)
+int apfs_inode_create_dstream_rec(struct inode *inode)
 {
 	struct apfs_inode_info *ai = APFS_I(inode);
 	int err;
@@ -488,6 +489,7 @@ int __apfs_write_begin(struct file *file, struct address_space *mapping, loff_t
 	pgoff_t index = pos >> PAGE_SHIFT;
 	sector_t iblock = (sector_t)index << (PAGE_SHIFT - inode->i_blkbits);
 	loff_t i_blks_end;
+	bool inplace;
 	int err;
 
 	apfs_inode_join_transaction(sb, inode);
@@ -526,7 +528,10 @@ int __apfs_write_begin(struct file *file, struct address_space *mapping, loff_t
 #endif
 	}
 
-	/* CoW moves existing blocks, so read them but mark them as unmapped */
+	/*
+	 * CoW moves existing blocks, so read them but mark them as unmapped.
+	 * Files in in-place mode keep their unshared blocks instead.
+	 */
 	head = page_buffers(page);
 	blocksize = head->b_size;
 	i_blks_end = (inode->i_size + sb->s_blocksize - 1) >> inode->i_blkbits;
@@ -564,6 +569,18 @@ int __apfs_write_begin(struct file *file, struct address_space *mapping, loff_t
 					goto out_put_page;
 				}
 			}
+			if (buffer_mapped(bh)) {
+				err = apfs_block_can_overwrite(inode, bh->b_blocknr, &inplace);
+				if (err)
+					goto out_put_page;
+				if (inplace) {
+					/* The commit will write the block back */
+					err = apfs_transaction_join(sb, bh);
+					if (err)
+						goto out_put_page;
+					continue;
+				}
+			}
 			clear_buffer_mapped(bh);
 		}
 	}
@@ -780,6 +797,27 @@ static void apfs_inode_set_ops(struct inode *inode, dev_t rdev, bool compressed)
 	}
 }
 
+/**
+ * apfs_inode_val_dir_stats_id - Get the dir stats id from an inode record
+ * @inode_val:	the inode record value
+ * @len:	length of @inode_val
+ *
+ * Returns the id, or 0 if the inode has no dir stats.
+ */
+static u64 apfs_inode_val_dir_stats_id(struct apfs_inode_val *inode_val, int len)
+{
+	char *xval = NULL;
+	int xlen;
+
+	if (!(le64_to_cpu(inode_val->internal_flags) & APFS_INODE_MAINTAIN_DIR_STATS))
+		return 0;
+	xlen = apfs_find_xfield(inode_val->xfields, len - sizeof(*inode_val),
+				APFS_INO_EXT_TYPE_DIR_STATS_KEY, &xval);
+	if (xlen < sizeof(__le64))
+		return 0;
+	return le64_to_cpup((__le64 *)xval);
+}
+
 /**
  * apfs_inode_from_query - Read the inode found by a successful query
  * @query:	the query that found the record
@@ -888,6 +926,16 @@ static int apfs_inode_from_query(struct apfs_query *query, struct inode *inode)
 
 		rdev = le32_to_cpup(rdev_p);
 	}
+	xval = NULL;
+
+	ai->i_dir_stats_id = 0;
+	if (S_ISDIR(inode->i_mode))
+		ai->i_dir_stats_id = apfs_inode_val_dir_stats_id(inode_val, query->len);
+
+	/* Assume that the parent's dir stats are already up to date */
+	ai->i_acct_parent = inode->i_nlink ? ai->i_parent_id : 0;
+	ai->i_acct_stats = ai->i_acct_parent ? APFS_DIR_STATS_UNKNOWN : 0;
+	ai->i_acct_size = S_ISDIR(inode->i_mode) ? 0 : inode->i_size;
 
 	apfs_inode_set_ops(inode, rdev, compressed);
 	return 0;
@@ -928,6 +976,47 @@ static struct apfs_query *apfs_inode_lookup(const struct inode *inode)
 	return ERR_PTR(ret);
 }
 
+/**
+ * apfs_dir_stats_id_by_ino - Get the dir stats id for a directory
+ * @sb:		filesystem superblock
+ * @ino:	inode number for the directory
+ * @id:		on return, the dir stats id, or 0 if there are none
+ *
+ * Reads the inode record directly, so the directory doesn't need to be in the
+ * inode cache. Returns 0 on success, or a negative error code in case of
+ * failure.
+ */
+int apfs_dir_stats_id_by_ino(struct super_block *sb, u64 ino, u64 *id)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_query *query;
+	struct apfs_inode_val *inode_val;
+	int err;
+
+	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
+	if (!query)
+		return -ENOMEM;
+	apfs_init_inode_key(ino, &query->key);
+	query->flags |= APFS_QUERY_CAT | APFS_QUERY_EXACT;
+
+	err = apfs_btree_query(sb, &query);
+	if (err) {
+		apfs_err(sb, "query failed for id 0x%llx", ino);
+		goto out;
+	}
+	if (query->len < sizeof(*inode_val)) {
+		apfs_err(sb, "bad inode record for inode 0x%llx", ino);
+		err = -EFSCORRUPTED;
+		goto out;
+	}
+	inode_val = (void *)query->node->object.data + query->off;
+	*id = apfs_inode_val_dir_stats_id(inode_val, query->len);
+
+out:
+	apfs_free_query(query);
+	return err;
+}
+
 /**
  * apfs_test_inode - Check if the inode matches a 64-bit inode number
  * @inode:	inode to test
@@ -1057,6 +1146,20 @@ struct inode *apfs_iget(struct super_block *sb, u64 cnid)
 		apfs_err(sb, "refcnt check failed for ino 0x%llx", cnid);
 		goto fail;
 	}
+	/*
+	 * This costs an extra catalog query for each regular file that gets
+	 * loaded. The xattr record sits right after the inode record, so the
+	 * nodes are almost always cached already.
+	 */
+	if (S_ISREG(inode->i_mode)) {
+		err = __apfs_xattr_get(inode, APFS_XATTR_NAME_NOCOW, NULL /* buffer */, 0 /* size */);
+		if (err < 0 && err != -ENODATA) {
+			apfs_err(sb, "nocow xattr lookup failed for ino 0x%llx", cnid);
+			goto fail;
+		}
+		APFS_I(inode)->i_inplace = err >= 0;
+		err = 0;
+	}
 	up_read(&nxi->nx_big_sem);
 
 	/* Allow the user to override the ownership */
@@ -1156,23 +1259,28 @@ static int apfs_build_inode_val(struct inode *inode, const struct qstr *qname,
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
 	struct timespec64 ts;
 #endif
+	struct apfs_inode_info *ai = APFS_I(inode);
 	int total_xlen, val_len;
 	bool is_device = S_ISCHR(inode->i_mode) || S_ISBLK(inode->i_mode);
 	__le32 rdev;
+	__le64 stats_id;
 
 	/* The only required xfield is the name, and the id if it's a device */
 	total_xlen = sizeof(struct apfs_xf_blob);
 	total_xlen += sizeof(xkey) + round_up(qname->len + 1, 8);
 	if (is_device)
 		total_xlen += sizeof(xkey) + round_up(sizeof(rdev), 8);
+	if (ai->i_dir_stats_id)
+		total_xlen += sizeof(xkey) + sizeof(stats_id);
 
 	val_len = sizeof(*val) + total_xlen;
 	val = kzalloc(val_len, GFP_KERNEL);
 	if (!val)
 		return -ENOMEM;
 
-	val->parent_id = cpu_to_le64(APFS_I(inode)->i_parent_id);
+	val->parent_id = cpu_to_le64(ai->i_parent_id);
 	val->private_id = cpu_to_le64(apfs_ino(inode));
+	val->internal_flags = cpu_to_le64(ai->i_int_flags);
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 7, 0)
 	val->mod_time = cpu_to_le64(timespec64_to_ns(&inode->i_mtime));
@@ -1204,6 +1312,13 @@ static int apfs_build_inode_val(struct inode *inode, const struct qstr *qname,
 		xkey.x_size = cpu_to_le16(sizeof(rdev));
 		apfs_insert_xfield(val->xfields, total_xlen, &xkey, &rdev);
 	}
+	if (ai->i_dir_stats_id) {
+		stats_id = cpu_to_le64(ai->i_dir_stats_id);
+		xkey.x_type = APFS_INO_EXT_TYPE_DIR_STATS_KEY;
+		xkey.x_flags = APFS_XF_SYSTEM_FIELD;
+		xkey.x_size = cpu_to_le16(sizeof(stats_id));
+		apfs_insert_xfield(val->xfields, total_xlen, &xkey, &stats_id);
+	}
 
 	*val_p = val;
 	return val_len;
@@ -1462,6 +1577,68 @@ static int apfs_inode_resize_sparse(struct inode *inode, struct apfs_query *quer
 	return apfs_create_sparse_xfield(inode, query);
 }
 
+/**
+ * apfs_inode_account_dir_stats - Keep the parent's dir stats in sync with an inode
+ * @inode:	the in-memory inode
+ *
+ * The size of a file is counted by the dir stats of its primary parent, and by
+ * all their chained ancestors. Move that size around if the file was resized,
+ * moved or unlinked since the last call. For a directory with stats of its own,
+ * the whole subtree moves along with it.
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_inode_account_dir_stats(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct apfs_inode_info *ai = APFS_I(inode);
+	u64 parent = inode->i_nlink ? ai->i_parent_id : 0;
+	u64 size = S_ISDIR(inode->i_mode) ? 0 : inode->i_size;
+	u64 stats = 0;
+	int err;
+
+	if (parent == ai->i_acct_parent && size == ai->i_acct_size)
+		return 0;
+
+	/* Don't bother with the lookups if the parent counts nothing */
+	if (ai->i_acct_parent && ai->i_acct_stats == APFS_DIR_STATS_UNKNOWN) {
+		err = apfs_dir_stats_id_by_ino(sb, ai->i_acct_parent, &ai->i_acct_stats);
+		if (err)
+			return err;
+	}
+	if (parent == ai->i_acct_parent) {
+		stats = ai->i_acct_stats;
+	} else if (parent) {
+		err = apfs_dir_stats_id_by_ino(sb, parent, &stats);
+		if (err)
+			return err;
+	}
+
+	if (ai->i_dir_stats_id) {
+		if (parent != ai->i_acct_parent) {
+			err = apfs_dir_stats_rechain(sb, ai->i_dir_stats_id, stats);
+			if (err)
+				return err;
+		}
+	} else if (ai->i_acct_parent != parent || ai->i_acct_stats != stats) {
+		err = apfs_dir_stats_update(sb, ai->i_acct_stats, 0 /* children */, -(s64)ai->i_acct_size);
+		if (err)
+			return err;
+		err = apfs_dir_stats_update(sb, stats, 0 /* children */, size);
+		if (err)
+			return err;
+	} else {
+		err = apfs_dir_stats_update(sb, stats, 0 /* children */, size - ai->i_acct_size);
+		if (err)
+			return err;
+	}
+
+	ai->i_acct_parent = parent;
+	ai->i_acct_stats = stats;
+	ai->i_acct_size = size;
+	return 0;
+}
+
 /**
  * apfs_update_inode - Update an existing inode record
  * @inode:	the modified in-memory inode
@@ -1513,6 +1690,12 @@ int apfs_update_inode(struct inode *inode, char *new_name)
 	if (dstream->ds_sparse_bytes)
 		ai->i_int_flags |= APFS_INODE_IS_SPARSE;
 
+	err = apfs_inode_account_dir_stats(inode);
+	if (err) {
+		apfs_err(sb, "dir stats update failed for ino 0x%llx", apfs_ino(inode));
+		goto fail;
+	}
+
 	/* TODO: just use apfs_btree_replace()? */
 	err = apfs_query_join_transaction(query);
 	if (err) {
@@ -1647,6 +1830,14 @@ static int apfs_delete_inode(struct inode *inode)
 		return ret;
 	}
 
+	if (ai->i_dir_stats_id) {
+		ret = apfs_delete_dir_stats_rec(sb, ai->i_dir_stats_id);
+		if (ret) {
+			apfs_err(sb, "dir stats removal failed for ino 0x%llx", apfs_ino(inode));
+			return ret;
+		}
+	}
+
 	ai->i_cleaned = true;
 	return ret;
 }
@@ -1744,6 +1935,30 @@ out:
 	return err;
 }
 
+/* Workqueue for orphan cleanups and snapshot reaping, which may run for long */
+struct workqueue_struct *apfs_reclaim_wq;
+
+/**
+ * apfs_init_reclaim_wq - Create the workqueue for background reclaim
+ *
+ * Returns 0 on success, or -ENOMEM in case of failure.
+ */
+int __init apfs_init_reclaim_wq(void)
+{
+	apfs_reclaim_wq = alloc_workqueue("apfs-reclaim", WQ_UNBOUND, 0);
+	if (!apfs_reclaim_wq)
+		return -ENOMEM;
+	return 0;
+}
+
+/**
+ * apfs_destroy_reclaim_wq - Destroy the workqueue for background reclaim
+ */
+void apfs_destroy_reclaim_wq(void)
+{
+	destroy_workqueue(apfs_reclaim_wq);
+}
+
 /**
  * apfs_schedule_orphan_cleanup - Schedule cleanup for orphan inodes
  * @sb: filesystem superblock
@@ -1767,7 +1982,7 @@ void apfs_schedule_orphan_cleanup(struct super_block *sb)
 	if (atomic_read(&sbi->s_orphan_cleanup_err))
 		return;
 
-	schedule_work(&sbi->s_orphan_cleanup_work);
+	queue_work(apfs_reclaim_wq, &sbi->s_orphan_cleanup_work);
 }
 
 /**
@@ -1802,6 +2017,31 @@ static int apfs_clean_orphans(struct super_block *sb)
 	return 0;
 }
 
+/**
+ * apfs_ioc_get_reclaim_stats - Ioctl handler to report on orphan cleanups
+ * @file:	any file in the volume
+ * @user_arg:	on return, the statistics for the volume
+ *
+ * Lets the user check how much of the deletion work is still pending, now
+ * that it happens in the background.
+ */
+int apfs_ioc_get_reclaim_stats(struct file *file, void __user *user_arg)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_ioctl_reclaim_stats arg = {0};
+
+	down_read(&nxi->nx_big_sem);
+	arg.pending_files = APFS_I(sbi->s_private_dir)->i_nchildren;
+	up_read(&nxi->nx_big_sem);
+	arg.reclaimed_bytes = atomic64_read(&sbi->s_reclaimed_bytes);
+
+	if (copy_to_user(user_arg, &arg, sizeof(arg)))
+		return -EFAULT;
+	return 0;
+}
+
 void apfs_evict_inode(struct inode *inode)
 {
 	struct super_block *sb = inode->i_sb;
@@ -1913,8 +2153,21 @@ struct inode *apfs_new_inode(struct inode *dir, umode_t mode, dev_t rdev)
 	else
 		ai->i_key_class = 0;
 	ai->i_int_flags = APFS_INODE_NO_RSRC_FORK;
+	/* Only directories keep stats, and the flag would break file clones */
+	if (S_ISDIR(mode))
+		ai->i_int_flags |= APFS_I(dir)->i_int_flags & APFS_INODE_INHERITED_INTERNAL_FLAGS;
 	ai->i_bsd_flags = 0;
 
+	/* Subdirectories of a directory with stats need stats of their own */
+	ai->i_dir_stats_id = 0;
+	if (S_ISDIR(mode) && APFS_I(dir)->i_dir_stats_id) {
+		ai->i_dir_stats_id = le64_to_cpu(vsb_raw->apfs_next_obj_id);
+		le64_add_cpu(&vsb_raw->apfs_next_obj_id, 1);
+	}
+	ai->i_acct_parent = apfs_ino(dir);
+	ai->i_acct_stats = APFS_I(dir)->i_dir_stats_id;
+	ai->i_acct_size = 0;
+
 	ai->i_has_dstream = false;
 	dstream->ds_id = cnid;
 	dstream->ds_size = 0;
@@ -1966,6 +2219,7 @@ int apfs_create_inode_rec(struct super_block *sb, struct inode *inode,
 			  struct dentry *dentry)
 {
 	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_inode_info *ai = APFS_I(inode);
 	struct apfs_query *query;
 	struct apfs_inode_key raw_key;
 	struct apfs_inode_val *raw_val;
@@ -1993,9 +2247,17 @@ int apfs_create_inode_rec(struct super_block *sb, struct inode *inode,
 	}
 
 	ret = apfs_btree_insert(query, &raw_key, sizeof(raw_key), raw_val, val_len);
-	if (ret)
-		apfs_err(sb, "insertion failed for ino 0x%llx", apfs_ino(inode));
 	kfree(raw_val);
+	if (ret) {
+		apfs_err(sb, "insertion failed for ino 0x%llx", apfs_ino(inode));
+		goto fail;
+	}
+
+	if (ai->i_dir_stats_id) {
+		ret = apfs_create_dir_stats_rec(sb, ai->i_dir_stats_id, ai->i_acct_stats);
+		if (ret)
+			apfs_err(sb, "failed to create dir stats for ino 0x%llx", apfs_ino(inode));
+	}
 
 fail:
 	apfs_free_query(query);
@@ -2335,18 +2597,58 @@ static unsigned int apfs_getflags(struct inode *inode)
 		flags |= FS_IMMUTABLE_FL;
 	if (ai->i_bsd_flags & APFS_INOBSD_NODUMP)
 		flags |= FS_NODUMP_FL;
+	if (ai->i_inplace)
+		flags |= FS_NOCOW_FL;
 	return flags;
 }
 
+/**
+ * apfs_check_flags - Check that we can set the requested flags for an inode
+ * @inode: the vfs inode
+ * @flags: flags to set, in FS_IOC_SETFLAGS format
+ *
+ * Returns 0 if the flags are supported, or a negative error code otherwise.
+ */
+static int apfs_check_flags(struct inode *inode, unsigned int flags)
+{
+	if (flags & ~(FS_APPEND_FL | FS_IMMUTABLE_FL | FS_NODUMP_FL | FS_NOCOW_FL))
+		return -EOPNOTSUPP;
+	/* In-place overwrites only make sense for the data of regular files */
+	if ((flags & FS_NOCOW_FL) && !S_ISREG(inode->i_mode))
+		return -EINVAL;
+	return 0;
+}
+
 /**
  * apfs_setflags - Set an inode's bsd flags
  * @inode: the vfs inode
  * @flags: flags to set, in FS_IOC_SETFLAGS format
+ *
+ * Must be called inside a transaction that the inode has already joined.
+ * Returns 0 on success, or a negative error code in case of failure.
  */
-static void apfs_setflags(struct inode *inode, unsigned int flags)
+static int apfs_setflags(struct inode *inode, unsigned int flags)
 {
 	struct apfs_inode_info *ai = APFS_I(inode);
 	unsigned int i_flags = 0;
+	bool inplace = flags & FS_NOCOW_FL;
+	int err;
+
+	/*
+	 * APFS has no on-disk flag for in-place overwrites, so the mode is
+	 * kept in a private xattr that gets read back by apfs_iget().
+	 */
+	if (inplace != ai->i_inplace) {
+		if (inplace)
+			err = apfs_xattr_set(inode, APFS_XATTR_NAME_NOCOW, "" /* value */, 0 /* size */, 0 /* flags */);
+		else
+			err = apfs_xattr_set(inode, APFS_XATTR_NAME_NOCOW, NULL /* value */, 0 /* size */, XATTR_REPLACE);
+		if (err && err != -ENODATA) {
+			apfs_err(inode->i_sb, "failed to update nocow xattr for ino 0x%llx", apfs_ino(inode));
+			return err;
+		}
+		ai->i_inplace = inplace;
+	}
 
 	if (flags & FS_APPEND_FL) {
 		ai->i_bsd_flags |= APFS_INOBSD_APPEND;
@@ -2368,6 +2670,7 @@ static void apfs_setflags(struct inode *inode, unsigned int flags)
 		ai->i_bsd_flags &= ~APFS_INOBSD_NODUMP;
 
 	inode_set_flags(inode, i_flags, S_IMMUTABLE | S_APPEND);
+	return 0;
 }
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 13, 0)
@@ -2411,12 +2714,18 @@ static int apfs_do_ioc_setflags(struct inode *inode, unsigned int newflags)
 		return err;
 
 	apfs_inode_join_transaction(sb, inode);
-	apfs_setflags(inode, newflags);
+	err = apfs_setflags(inode, newflags);
+	if (err)
+		goto fail;
 	inode->i_ctime = current_time(inode);
 
 	err = apfs_transaction_commit(sb);
 	if (err)
-		apfs_transaction_abort(sb);
+		goto fail;
+	return 0;
+
+fail:
+	apfs_transaction_abort(sb);
 	return err;
 }
 
@@ -2447,8 +2756,9 @@ static int apfs_ioc_setflags(struct file *file, int __user *arg)
 	if (get_user(newflags, arg))
 		return -EFAULT;
 
-	if (newflags & ~(FS_APPEND_FL | FS_IMMUTABLE_FL | FS_NODUMP_FL))
-		return -EOPNOTSUPP;
+	err = apfs_check_flags(inode, newflags);
+	if (err)
+		return err;
 
 	err = mnt_want_write_file(file);
 	if (err)
@@ -2481,8 +2791,9 @@ int apfs_fileattr_set(struct user_namespace *mnt_userns, struct dentry *dentry,
 	if (sb->s_flags & SB_RDONLY)
 		return -EROFS;
 
-	if (fa->flags & ~(FS_APPEND_FL | FS_IMMUTABLE_FL | FS_NODUMP_FL))
-		return -EOPNOTSUPP;
+	err = apfs_check_flags(inode, fa->flags);
+	if (err)
+		return err;
 	if (fileattr_has_fsx(fa))
 		return -EOPNOTSUPP;
 
@@ -2493,12 +2804,18 @@ int apfs_fileattr_set(struct user_namespace *mnt_userns, struct dentry *dentry,
 		return err;
 
 	apfs_inode_join_transaction(sb, inode);
-	apfs_setflags(inode, fa->flags);
+	err = apfs_setflags(inode, fa->flags);
+	if (err)
+		goto fail;
 	inode->i_ctime = current_time(inode);
 
 	err = apfs_transaction_commit(sb);
 	if (err)
-		apfs_transaction_abort(sb);
+		goto fail;
+	return 0;
+
+fail:
+	apfs_transaction_abort(sb);
 	return err;
 }
 
@@ -2521,8 +2838,9 @@ int apfs_fileattr_set(struct mnt_idmap *idmap, struct dentry *dentry, struct fil
 	if (sb->s_flags & SB_RDONLY)
 		return -EROFS;
 
-	if (fa->flags & ~(FS_APPEND_FL | FS_IMMUTABLE_FL | FS_NODUMP_FL))
-		return -EOPNOTSUPP;
+	err = apfs_check_flags(inode, fa->flags);
+	if (err)
+		return err;
 	if (fileattr_has_fsx(fa))
 		return -EOPNOTSUPP;
 
@@ -2533,7 +2851,9 @@ int apfs_fileattr_set(struct mnt_idmap *idmap, struct dentry *dentry, struct fil
 		return err;
 
 	apfs_inode_join_transaction(sb, inode);
-	apfs_setflags(inode, fa->flags);
+	err = apfs_setflags(inode, fa->flags);
+	if (err)
+		goto fail;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 6, 0)
 	inode->i_ctime = current_time(inode);
 #else
@@ -2542,7 +2862,11 @@ int apfs_fileattr_set(struct mnt_idmap *idmap, struct dentry *dentry, struct fil
 
 	err = apfs_transaction_commit(sb);
 	if (err)
-		apfs_transaction_abort(sb);
+		goto fail;
+	return 0;
+
+fail:
+	apfs_transaction_abort(sb);
 	return err;
 }
 
@@ -2569,6 +2893,16 @@ long apfs_dir_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		return apfs_ioc_get_class(file, argp);
 	case APFS_IOC_TAKE_SNAPSHOT:
 		return apfs_ioc_take_snapshot(file, argp);
+	case APFS_IOC_DELETE_SNAPSHOT:
+		return apfs_ioc_delete_snapshot(file, argp);
+	case APFS_IOC_SNAP_DIFF:
+		return apfs_ioc_snap_diff(file, argp);
+	case APFS_IOC_GET_DIR_STATS:
+		return apfs_ioc_get_dir_stats(file, argp);
+	case APFS_IOC_GET_RECLAIM_STATS:
+		return apfs_ioc_get_reclaim_stats(file, argp);
+	case FITRIM:
+		return apfs_ioc_trim(file, argp);
 	default:
 		return -ENOTTY;
 	}
@@ -2591,6 +2925,12 @@ long apfs_file_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		return apfs_ioc_get_class(file, argp);
 	case APFS_IOC_GET_PFK:
 		return apfs_ioc_get_pfk(file, argp);
+	case APFS_IOC_DEFRAG:
+		return apfs_ioc_defrag(file, argp);
+	case APFS_IOC_GET_RECLAIM_STATS:
+		return apfs_ioc_get_reclaim_stats(file, argp);
+	case FITRIM:
+		return apfs_ioc_trim(file, argp);
 	default:
 		return -ENOTTY;
 	}
@@ -30,6 +30,9 @@ int apfs_filename_cmp(struct super_block *sb,
 		return memcmp(name1, name2, len1);
 	}
 
+	if (apfs_is_ascii(name1, len1) && apfs_is_ascii(name2, len2))
+		return apfs_ascii_cmp(name1, len1, name2, len2, case_fold);
+
 	apfs_init_unicursor(&cursor1, name1, len1);
 	apfs_init_unicursor(&cursor2, name2, len2);
 
@@ -289,6 +292,55 @@ int apfs_read_omap_snap_key(void *raw, int size, struct apfs_key *key)
 	return 0;
 }
 
+/**
+ * apfs_drec_name_hash - Compute the hash of a filename for its dentry record
+ * @sb:		filesystem superblock
+ * @name:	filename
+ * @name_len:	filename length
+ *
+ * Returns the crc32c of the normalized filename; only the low bits are stored
+ * in the dentry record keys. Must only be called for normalization-insensitive
+ * volumes.
+ */
+u32 apfs_drec_name_hash(struct super_block *sb, const char *name, unsigned int name_len)
+{
+	struct apfs_unicursor cursor;
+	bool case_fold = apfs_is_case_insensitive(sb);
+	unicode_t buf[32];
+	unsigned int i, count = 0;
+	u32 hash = 0xFFFFFFFF;
+
+	/*
+	 * The hash is taken over the normalized UTF-32 characters, but there
+	 * is no need to feed them to crc32c one at a time.
+	 */
+	if (apfs_is_ascii(name, name_len)) {
+		for (i = 0; i < name_len && name[i]; ++i) {
+			buf[count++] = apfs_ascii_fold(name[i], case_fold);
+			if (count == ARRAY_SIZE(buf)) {
+				hash = crc32c(hash, buf, sizeof(buf));
+				count = 0;
+			}
+		}
+	} else {
+		apfs_init_unicursor(&cursor, name, name_len);
+		while (1) {
+			unicode_t utf32;
+
+			utf32 = apfs_normalize_next(&cursor, case_fold);
+			if (!utf32)
+				break;
+
+			buf[count++] = utf32;
+			if (count == ARRAY_SIZE(buf)) {
+				hash = crc32c(hash, buf, sizeof(buf));
+				count = 0;
+			}
+		}
+	}
+	return crc32c(hash, buf, count * sizeof(buf[0]));
+}
+
 /**
  * apfs_init_drec_key - Initialize an in-memory key for a dentry query
  * @sb:		filesystem superblock
@@ -300,10 +352,6 @@ int apfs_read_omap_snap_key(void *raw, int size, struct apfs_key *key)
 void apfs_init_drec_key(struct super_block *sb, u64 ino, const char *name,
 			unsigned int name_len, struct apfs_key *key)
 {
-	struct apfs_unicursor cursor;
-	bool case_fold = apfs_is_case_insensitive(sb);
-	u32 hash = 0xFFFFFFFF;
-
 	key->id = ino;
 	key->type = APFS_TYPE_DIR_REC;
 	if (!apfs_is_normalization_insensitive(sb)) {
@@ -319,19 +367,5 @@ void apfs_init_drec_key(struct super_block *sb, u64 ino, const char *name,
 		key->number = 0;
 		return;
 	}
-
-	apfs_init_unicursor(&cursor, name, name_len);
-
-	while (1) {
-		unicode_t utf32;
-
-		utf32 = apfs_normalize_next(&cursor, case_fold);
-		if (!utf32)
-			break;
-
-		hash = crc32c(hash, &utf32, sizeof(utf32));
-	}
-
-	/* The filename length doesn't matter, so it's left as zero */
-	key->number = hash << APFS_DREC_HASH_SHIFT;
+	apfs_init_drec_hash_key(ino, apfs_drec_name_hash(sb, name, name_len), key);
 }
@@ -7,17 +7,33 @@
 #include "apfs.h"
 #include "unicode.h"
 
+/**
+ * apfs_dentry_salt - Get the per-directory salt for the dcache name hashes
+ * @dir:	parent dentry
+ */
+static inline u32 apfs_dentry_salt(const struct dentry *dir)
+{
+	return end_name_hash(init_name_hash(dir));
+}
+
 static struct dentry *apfs_lookup(struct inode *dir, struct dentry *dentry,
 				  unsigned int flags)
 {
 	struct inode *inode = NULL;
 	u64 ino = 0;
+	u32 hash, *hashp = NULL;
 	int err;
 
 	if (dentry->d_name.len > APFS_NAME_LEN)
 		return ERR_PTR(-ENAMETOOLONG);
 
-	err = apfs_inode_by_name(dir, &dentry->d_name, &ino);
+	if (apfs_is_normalization_insensitive(dir->i_sb)) {
+		/* The dcache hash was built from the dentry record hash */
+		hash = dentry->d_name.hash ^ apfs_dentry_salt(dentry->d_parent);
+		hashp = &hash;
+	}
+
+	err = apfs_inode_by_name(dir, &dentry->d_name, hashp, &ino);
 	if (err && err != -ENODATA) {
 		apfs_err(dir->i_sb, "inode lookup by name failed");
 		return ERR_PTR(err);
@@ -78,31 +94,15 @@ const struct inode_operations apfs_special_inode_operations = {
 
 static int apfs_dentry_hash(const struct dentry *dir, struct qstr *child)
 {
-	struct apfs_unicursor cursor;
-	unsigned long hash;
-	bool case_fold = apfs_is_case_insensitive(dir->d_sb);
-
 	if (!apfs_is_normalization_insensitive(dir->d_sb))
 		return 0;
 
-	apfs_init_unicursor(&cursor, child->name, child->len);
-	hash = init_name_hash(dir);
-
-	while (1) {
-		int i;
-		unicode_t utf32;
-
-		utf32 = apfs_normalize_next(&cursor, case_fold);
-		if (!utf32)
-			break;
-
-		/* Hash the unicode character one byte at a time */
-		for (i = 0; i < 4; ++i) {
-			hash = partial_name_hash((u8)utf32, hash);
-			utf32 = utf32 >> 8;
-		}
-	}
-	child->hash = end_name_hash(hash);
+	/*
+	 * Use the same hash as the dentry records, so that the lookup can
+	 * recover it later without normalizing the name again. The salt keeps
+	 * equal names in different directories out of the same hash chain.
+	 */
+	child->hash = apfs_drec_name_hash(dir->d_sb, child->name, child->len) ^ apfs_dentry_salt(dir);
 
 	/* TODO: return error instead of truncating invalid UTF-8? */
 	return 0;
@@ -111,6 +111,27 @@ static int apfs_dentry_hash(const struct dentry *dir, struct qstr *child)
 static int apfs_dentry_compare(const struct dentry *dentry, unsigned int len,
 			       const char *str, const struct qstr *name)
 {
+	char strbuf[DNAME_INLINE_LEN];
+
+	/*
+	 * In rcu-walk mode, an inline name may get changed under us by a
+	 * rename, and the normalization code can't handle that. External names
+	 * are never modified, so they don't need this.
+	 */
+	if (len < DNAME_INLINE_LEN) {
+		memcpy(strbuf, str, len);
+		strbuf[len] = 0;
+		str = strbuf;
+		/* Make sure the compiler won't read from @str again */
+		barrier();
+	}
+
+	/*
+	 * The hashes already matched, so this is most likely a dcache hit for
+	 * the very same name. Don't bother normalizing in that case.
+	 */
+	if (len == name->len && memcmp(str, name->name, len) == 0)
+		return 0;
 	return apfs_filename_cmp(dentry->d_sb, name->name, name->len, str, len);
 }
 
@@ -122,10 +143,10 @@ static int apfs_dentry_revalidate(struct inode *dir, const struct qstr *name, st
 {
 	struct super_block *sb = dentry->d_sb;
 
-	if (flags & LOOKUP_RCU)
-		return -ECHILD;
-
 	/*
+	 * Nothing here can sleep, and the volume features are cached in the
+	 * superblock info, so this is safe for rcu-walk too.
+	 *
 	 * If we want to create a link with a name that normalizes to the same
 	 * as an existing negative dentry, then we first need to invalidate the
 	 * dentry; otherwise it would keep the existing name.
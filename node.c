@@ -54,6 +54,7 @@ void apfs_node_free(struct apfs_node *node)
 	}
 	obj->data = NULL;
 
+	kfree(node->sort_keys);
 	kfree(node);
 }
 
@@ -149,6 +150,9 @@ struct apfs_node *apfs_read_node(struct super_block *sb, u64 oid, u32 storage,
 	free_head = &raw->btn_val_free_list;
 	node->val_free_list_len = le16_to_cpu(free_head->len);
 
+	node->sort_keys = NULL;
+	atomic_set(&node->searches, 0);
+
 	node->object.sb = sb;
 	node->object.block_nr = bno;
 	node->object.oid = oid;
@@ -158,7 +162,6 @@ struct apfs_node *apfs_read_node(struct super_block *sb, u64 oid, u32 storage,
 
 	/* Ephemeral objects already got checked on mount */
 	if (!node->object.ephemeral && nxi->nx_flags & APFS_CHECK_NODES && !apfs_obj_verify_csum(sb, bh)) {
-		/* TODO: don't check this twice for virtual/physical objects */
 		apfs_err(sb, "bad checksum for node in block 0x%llx", (unsigned long long)bno);
 		apfs_node_free(node);
 		return ERR_PTR(-EFSBADCRC);
@@ -443,6 +446,9 @@ static struct apfs_node *apfs_create_node(struct super_block *sb, u32 storage)
 		goto fail;
 	}
 
+	node->sort_keys = NULL;
+	atomic_set(&node->searches, 0);
+
 	node->object.sb = sb;
 	node->object.block_nr = bno;
 	node->object.oid = oid;
@@ -544,6 +550,11 @@ void apfs_update_node(struct apfs_node *node)
 
 	apfs_assert_in_transaction(sb, &raw->btn_o);
 
+	/* The records may have changed, so the decoded keys are stale */
+	kfree(node->sort_keys);
+	node->sort_keys = NULL;
+	atomic_set(&node->searches, 0);
+
 	raw->btn_o.o_oid = cpu_to_le64(node->object.oid);
 
 	/* The node may no longer be a root, so update the object type */
@@ -640,7 +651,7 @@ int apfs_node_locate_key(struct apfs_node *node, int index, int *off)
  * block; callers must use it to make sure they never operate outside its
  * bounds.
  */
-static int apfs_node_locate_value(struct apfs_node *node, int index, int *off)
+int apfs_node_locate_value(struct apfs_node *node, int index, int *off)
 {
 	struct super_block *sb = node->object.sb;
 	struct apfs_btree_node_phys *raw;
@@ -747,52 +758,76 @@ static void apfs_create_toc_entry(struct apfs_query *query)
 }
 
 /**
- * apfs_key_from_query - Read the current key from a query structure
- * @query:	the query, with @query->key_off and @query->key_len already set
+ * apfs_read_raw_key - Parse a raw b-tree key
+ * @sb:		superblock structure
+ * @flags:	query flags, to identify the type of b-tree
+ * @raw_key:	the raw key
+ * @len:	length of the key
  * @key:	return parameter for the key
  *
- * Reads the key into @key and performs some basic sanity checks as a
- * protection against crafted filesystems.  Returns 0 on success or a
- * negative error code otherwise.
+ * Returns 0 on success or a negative error code otherwise.
  */
-static int apfs_key_from_query(struct apfs_query *query, struct apfs_key *key)
+int apfs_read_raw_key(struct super_block *sb, unsigned int flags, void *raw_key, int len, struct apfs_key *key)
 {
-	struct super_block *sb = query->node->object.sb;
-	char *raw = query->node->object.data;
-	void *raw_key = (void *)(raw + query->key_off);
 	bool hashed;
-	int err = 0;
 
-	switch (query->flags & APFS_QUERY_TREE_MASK) {
+	switch (flags & APFS_QUERY_TREE_MASK) {
 	case APFS_QUERY_CAT:
 		hashed = apfs_is_normalization_insensitive(sb);
-		err = apfs_read_cat_key(raw_key, query->key_len, key, hashed);
-		break;
+		return apfs_read_cat_key(raw_key, len, key, hashed);
 	case APFS_QUERY_OMAP:
-		err = apfs_read_omap_key(raw_key, query->key_len, key);
-		break;
+		return apfs_read_omap_key(raw_key, len, key);
 	case APFS_QUERY_FREE_QUEUE:
-		err = apfs_read_free_queue_key(raw_key, query->key_len, key);
-		break;
+		return apfs_read_free_queue_key(raw_key, len, key);
 	case APFS_QUERY_EXTENTREF:
-		err = apfs_read_extentref_key(raw_key, query->key_len, key);
-		break;
+		return apfs_read_extentref_key(raw_key, len, key);
 	case APFS_QUERY_FEXT:
-		err = apfs_read_fext_key(raw_key, query->key_len, key);
-		break;
+		return apfs_read_fext_key(raw_key, len, key);
 	case APFS_QUERY_SNAP_META:
-		err = apfs_read_snap_meta_key(raw_key, query->key_len, key);
-		break;
+		return apfs_read_snap_meta_key(raw_key, len, key);
 	case APFS_QUERY_OMAP_SNAP:
-		err = apfs_read_omap_snap_key(raw_key, query->key_len, key);
-		break;
+		return apfs_read_omap_snap_key(raw_key, len, key);
 	default:
-		apfs_alert(sb, "new query type must implement key reads (%d)", query->flags & APFS_QUERY_TREE_MASK);
-		err = -EOPNOTSUPP;
-		break;
+		apfs_alert(sb, "new query type must implement key reads (%d)", flags & APFS_QUERY_TREE_MASK);
+		return -EOPNOTSUPP;
 	}
+}
+
+/**
+ * apfs_read_node_key - Parse a raw key from a b-tree node
+ * @node:	the node
+ * @flags:	query flags, to identify the type of b-tree
+ * @off:	offset of the key in the node block
+ * @len:	length of the key
+ * @key:	return parameter for the key
+ *
+ * Returns 0 on success or a negative error code otherwise.
+ */
+static int apfs_read_node_key(struct apfs_node *node, unsigned int flags, int off, int len, struct apfs_key *key)
+{
+	struct super_block *sb = node->object.sb;
+	int err;
+
+	err = apfs_read_raw_key(sb, flags, node->object.data + off, len, key);
 	if (err)
-		apfs_err(sb, "bad node key in block 0x%llx", query->node->object.block_nr);
+		apfs_err(sb, "bad node key in block 0x%llx", node->object.block_nr);
+	return err;
+}
+
+/**
+ * apfs_key_from_query - Read the current key from a query structure
+ * @query:	the query, with @query->key_off and @query->key_len already set
+ * @key:	return parameter for the key
+ *
+ * Reads the key into @key and performs some basic sanity checks as a
+ * protection against crafted filesystems.  Returns 0 on success or a
+ * negative error code otherwise.
+ */
+int apfs_key_from_query(struct apfs_query *query, struct apfs_key *key)
+{
+	int err;
+
+	err = apfs_read_node_key(query->node, query->flags, query->key_off, query->key_len, key);
 
 	/* A multiple query must ignore some of these fields */
 	if (query->flags & APFS_QUERY_ANY_NAME)
@@ -898,6 +933,122 @@ static int apfs_node_next(struct super_block *sb, struct apfs_query *query)
 	return 0;
 }
 
+/**
+ * apfs_sort_key_hi - Get the high half of the decoded form of a key
+ * @key: the key
+ */
+static inline u64 apfs_sort_key_hi(struct apfs_key *key)
+{
+	return key->id << (64 - APFS_OBJ_TYPE_SHIFT) | key->type;
+}
+
+/**
+ * apfs_node_build_sort_keys - Decode all the keys of a node, if worthwhile
+ * @query: query about to search the node
+ *
+ * Nodes that only get searched once are left alone, since decoding every key
+ * costs more than parsing the few needed by the bisection. This is meant for
+ * root nodes and others that stay in memory; leaves are skipped because they
+ * change too often. Failures are ignored, the search can always go the slow
+ * way.
+ *
+ * Readers only hold the big lock in shared mode, and nodes like the catalog
+ * root are shared between them, so the array gets published with a cmpxchg
+ * and only one of the racing readers keeps its copy.
+ */
+static void apfs_node_build_sort_keys(struct apfs_query *query)
+{
+	struct apfs_node *node = query->node;
+	struct apfs_sort_key *sort_keys = NULL;
+	struct apfs_key key;
+	int i, off, len;
+
+	/* Fixed size keys are compared in place, see apfs_node_cmp_fast() */
+	if (apfs_node_has_fixed_kv_size(node) || apfs_node_is_leaf(node))
+		return;
+	if (node->records < APFS_SORT_KEY_MIN_RECORDS)
+		return;
+	if (READ_ONCE(node->sort_keys))
+		return;
+	if (atomic_inc_return(&node->searches) != 2)
+		return;
+
+	sort_keys = kmalloc_array(node->records, sizeof(*sort_keys), GFP_KERNEL);
+	if (!sort_keys)
+		return;
+	for (i = 0; i < node->records; ++i) {
+		len = apfs_node_locate_key(node, i, &off);
+		if (!len || apfs_read_node_key(node, query->flags, off, len, &key))
+			goto fail;
+		/* The id must leave room for the type */
+		if (key.id & APFS_OBJ_TYPE_MASK)
+			goto fail;
+		sort_keys[i].hi = apfs_sort_key_hi(&key);
+		sort_keys[i].lo = key.number;
+	}
+	/* Implies a full barrier, so the contents are visible before the pointer */
+	if (cmpxchg(&node->sort_keys, NULL, sort_keys))
+		goto fail;
+	return;
+
+fail:
+	kfree(sort_keys);
+}
+
+/**
+ * apfs_node_cmp_fast - Compare the current record with the query key quickly
+ * @query:	the query, with @query->key_off and @query->key_len already set
+ * @cmp:	on return, the result of apfs_keycmp() for the record and the key
+ *
+ * Uses the decoded keys for the node if they exist, and reads the fixed size
+ * keys of omap and free queue nodes in place. Returns false if the record key
+ * needs to be parsed instead, because the fast comparison is not possible or
+ * because the names will decide.
+ */
+static bool apfs_node_cmp_fast(struct apfs_query *query, int *cmp)
+{
+	struct apfs_node *node = query->node;
+	struct apfs_key *key = &query->key;
+	struct apfs_sort_key *sort_keys = smp_load_acquire(&node->sort_keys);
+	u64 hi, lo, key_hi;
+
+	if (sort_keys) {
+		if (key->id & APFS_OBJ_TYPE_MASK)
+			return false;
+		hi = sort_keys[query->index].hi;
+		lo = sort_keys[query->index].lo;
+		key_hi = apfs_sort_key_hi(key);
+	} else if (apfs_node_has_fixed_kv_size(node) && query->key_len == 2 * sizeof(__le64) &&
+		   query->flags & (APFS_QUERY_OMAP | APFS_QUERY_FREE_QUEUE)) {
+		/* Both key types are a pair of 64-bit numbers, with no type */
+		__le64 *raw_key = (void *)(node->object.data + query->key_off);
+
+		if (key->type)
+			return false;
+		hi = le64_to_cpu(raw_key[0]);
+		lo = le64_to_cpu(raw_key[1]);
+		key_hi = key->id;
+	} else {
+		return false;
+	}
+
+	if (query->flags & APFS_QUERY_ANY_NUMBER)
+		lo = 0;
+	if (hi != key_hi) {
+		*cmp = hi < key_hi ? -1 : 1;
+		return true;
+	}
+	if (lo != key->number) {
+		*cmp = lo < key->number ? -1 : 1;
+		return true;
+	}
+	if (!key->name || query->flags & APFS_QUERY_ANY_NAME) {
+		*cmp = 0;
+		return true;
+	}
+	return false;
+}
+
 /**
  * apfs_node_query - Execute a query on a single node
  * @sb:		filesystem superblock
@@ -933,6 +1084,8 @@ int apfs_node_query(struct super_block *sb, struct apfs_query *query)
 	if (query->flags & APFS_QUERY_NEXT)
 		return apfs_node_next(sb, query);
 
+	apfs_node_build_sort_keys(query);
+
 	/* Search by bisection */
 	cmp = 1;
 	left = 0;
@@ -953,13 +1106,14 @@ int apfs_node_query(struct super_block *sb, struct apfs_query *query)
 
 		query->key_len = apfs_node_locate_key(node, query->index,
 						      &query->key_off);
-		err = apfs_key_from_query(query, &curr_key);
-		if (err) {
-			apfs_err(sb, "bad key for index %d", query->index);
-			return err;
+		if (!apfs_node_cmp_fast(query, &cmp)) {
+			err = apfs_key_from_query(query, &curr_key);
+			if (err) {
+				apfs_err(sb, "bad key for index %d", query->index);
+				return err;
+			}
+			cmp = apfs_keycmp(&curr_key, &query->key);
 		}
-
-		cmp = apfs_keycmp(&curr_key, &query->key);
 		if (cmp == 0 && !(query->flags & APFS_QUERY_MULTIPLE))
 			break;
 	} while (left != right);
@@ -1136,8 +1290,53 @@ static int apfs_btree_inc_height(struct apfs_query *query)
 }
 
 /**
- * apfs_copy_record_range - Copy a range of records to an empty node
- * @dest_node:	destination node
+ * apfs_node_toc_size - Size needed for the table of contents of a node
+ * @sb:		superblock structure
+ * @type:	tree type for the node
+ * @flags:	flags for the node
+ * @records:	number of records that will be in the node
+ */
+static int apfs_node_toc_size(struct super_block *sb, u32 type, u16 flags, int records)
+{
+	int toc_size, toc_entry_size;
+
+	if (flags & APFS_BTNODE_FIXED_KV_SIZE)
+		toc_entry_size = sizeof(struct apfs_kvoff);
+	else
+		toc_entry_size = sizeof(struct apfs_kvloc);
+	toc_size = apfs_node_min_table_size(sb, type, flags);
+	if (toc_size < toc_entry_size * records)
+		toc_size = toc_entry_size * round_up(records, APFS_BTREE_TOC_ENTRY_INCREMENT);
+	return toc_size;
+}
+
+/**
+ * apfs_node_reset_layout - Empty a node to get it ready for a record copy
+ * @node:	the node
+ * @records:	number of records that will be copied to the node
+ */
+static void apfs_node_reset_layout(struct apfs_node *node, int records)
+{
+	struct super_block *sb = node->object.sb;
+	struct apfs_btree_node_phys *raw = (void *)node->object.data;
+
+	apfs_assert_in_transaction(sb, &raw->btn_o);
+
+	node->records = 0;
+	node->key_free_list_len = 0;
+	node->val_free_list_len = 0;
+
+	/* Resize the table of contents so that all the records fit */
+	node->key = sizeof(*raw) + apfs_node_toc_size(sb, node->tree_type, node->flags, records);
+	node->free = node->key;
+	node->val = sb->s_blocksize;
+	if (apfs_node_is_root(node))
+		node->val -= sizeof(struct apfs_btree_info);
+}
+
+/**
+ * apfs_append_record_range - Copy a range of records to the end of a node
+ * @dest_node:	destination node, with a table of contents big enough
  * @src_node:	source node
  * @start:	index of first record in range
  * @end:	index of first record after the range
@@ -1145,38 +1344,20 @@ static int apfs_btree_inc_height(struct apfs_query *query)
  * Doesn't modify the info footer of root nodes. Returns 0 on success or a
  * negative error code in case of failure.
  */
-static int apfs_copy_record_range(struct apfs_node *dest_node,
-				  struct apfs_node *src_node,
-				  int start, int end)
+static int apfs_append_record_range(struct apfs_node *dest_node,
+				    struct apfs_node *src_node,
+				    int start, int end)
 {
 	struct super_block *sb = dest_node->object.sb;
 	struct apfs_btree_node_phys *dest_raw;
 	struct apfs_btree_node_phys *src_raw;
 	struct apfs_query *query = NULL;
-	int toc_size, toc_entry_size;
 	int err;
 	int i;
 
 	dest_raw = (void *)dest_node->object.data;
 	src_raw = (void *)src_node->object.data;
 
-	ASSERT(!dest_node->records);
-	apfs_assert_in_transaction(sb, &dest_raw->btn_o);
-
-	/* Resize the table of contents so that all the records fit */
-	if (apfs_node_has_fixed_kv_size(src_node))
-		toc_entry_size = sizeof(struct apfs_kvoff);
-	else
-		toc_entry_size = sizeof(struct apfs_kvloc);
-	toc_size = apfs_node_min_table_size(sb, src_node->tree_type, src_node->flags);
-	if (toc_size < toc_entry_size * (end - start))
-		toc_size = toc_entry_size * round_up(end - start, APFS_BTREE_TOC_ENTRY_INCREMENT);
-	dest_node->key = sizeof(*dest_raw) + toc_size;
-	dest_node->free = dest_node->key;
-	dest_node->val = sb->s_blocksize;
-	if (apfs_node_is_root(dest_node))
-		dest_node->val -= sizeof(struct apfs_btree_info);
-
 	/* We'll use a temporary query structure to move the records around */
 	query = apfs_alloc_query(dest_node, NULL /* parent */);
 	if (!query) {
@@ -1189,7 +1370,7 @@ static int apfs_copy_record_range(struct apfs_node *dest_node,
 		int len, off;
 
 		len = apfs_node_locate_key(src_node, i, &off);
-		if (dest_node->free + len > sb->s_blocksize) {
+		if (dest_node->free + len > dest_node->val) {
 			apfs_err(sb, "key of length %d doesn't fit", len);
 			goto fail;
 		}
@@ -1201,7 +1382,7 @@ static int apfs_copy_record_range(struct apfs_node *dest_node,
 
 		len = apfs_node_locate_value(src_node, i, &off);
 		dest_node->val -= len;
-		if (dest_node->val < 0) {
+		if (dest_node->val < dest_node->free) {
 			apfs_err(sb, "value of length %d doesn't fit", len);
 			goto fail;
 		}
@@ -1210,7 +1391,7 @@ static int apfs_copy_record_range(struct apfs_node *dest_node,
 		query->off = dest_node->val;
 		query->len = len;
 
-		query->index = i - start;
+		query->index = dest_node->records;
 		apfs_create_toc_entry(query);
 	}
 	err = 0;
@@ -1220,6 +1401,25 @@ fail:
 	return err;
 }
 
+/**
+ * apfs_copy_record_range - Copy a range of records to an empty node
+ * @dest_node:	destination node
+ * @src_node:	source node
+ * @start:	index of first record in range
+ * @end:	index of first record after the range
+ *
+ * Doesn't modify the info footer of root nodes. Returns 0 on success or a
+ * negative error code in case of failure.
+ */
+static int apfs_copy_record_range(struct apfs_node *dest_node,
+				  struct apfs_node *src_node,
+				  int start, int end)
+{
+	ASSERT(!dest_node->records);
+	apfs_node_reset_layout(dest_node, end - start);
+	return apfs_append_record_range(dest_node, src_node, start, end);
+}
+
 /**
  * apfs_attach_child - Attach a new node to its parent
  * @query:	query pointing to the previous record in the parent
@@ -1263,6 +1463,8 @@ static int apfs_node_temp_dup(const struct apfs_node *original, struct apfs_node
 	if (!dup)
 		return -ENOMEM;
 	*dup = *original;
+	dup->sort_keys = NULL;
+	atomic_set(&dup->searches, 0);
 	dup->object.o_bh = NULL;
 	dup->object.data = NULL;
 	dup->object.ephemeral = false;
@@ -1279,6 +1481,46 @@ static int apfs_node_temp_dup(const struct apfs_node *original, struct apfs_node
 	return 0;
 }
 
+/**
+ * apfs_free_queue_split_point - Pick where to split a free queue node
+ * @query:	query pointing to the node
+ * @tmp:	in-memory duplicate of the node
+ *
+ * Free queue records are sorted by xid, so new ones always go near the end of
+ * the tree, while the oldest ones get drained from the front. Records from
+ * older transactions will never have company again, so there is no point in
+ * leaving room for it: keep them all in the original node if we can, and only
+ * move the records for the current transaction. Otherwise half the space of
+ * each node would be wasted, and the tree would reach its node limit when it
+ * is still mostly empty.
+ *
+ * Returns the number of records to keep in the original node, or 0 if the
+ * usual split in halves should be used instead.
+ */
+static int apfs_free_queue_split_point(struct apfs_query *query, struct apfs_node *tmp)
+{
+	struct apfs_nxsb_info *nxi = APFS_NXI(tmp->object.sb);
+	struct apfs_spaceman_free_queue_key *key = NULL;
+	int record_count = tmp->records;
+	int i, len, off;
+
+	for (i = record_count / 2 + 1; i < record_count; ++i) {
+		len = apfs_node_locate_key(tmp, i, &off);
+		if (len != sizeof(*key))
+			return 0;
+		key = (void *)tmp->object.data + off;
+		if (le64_to_cpu(key->sfqk_xid) == nxi->nx_xid)
+			break;
+	}
+
+	/* Make sure the record for the query ends up in the new node */
+	if (i > query->index)
+		i = query->index;
+	if (i <= record_count / 2)
+		return 0;
+	return i;
+}
+
 /**
  * apfs_node_split - Split a b-tree node in two
  * @query: query pointing to the node
@@ -1330,6 +1572,19 @@ int apfs_node_split(struct apfs_query *query)
 	}
 	new_rec_count = record_count / 2;
 	old_rec_count = record_count - new_rec_count;
+	if ((query->flags & APFS_QUERY_TREE_MASK) == APFS_QUERY_FREE_QUEUE) {
+		int split = apfs_free_queue_split_point(query, tmp_node);
+
+		if (split) {
+			old_rec_count = split;
+			new_rec_count = record_count - old_rec_count;
+		}
+	} else if ((query->flags & APFS_QUERY_BULK) && query->index == record_count - 1) {
+		/* Sorted insertions keep appending, so leave the node nearly full */
+		old_rec_count = record_count * APFS_BTREE_BULK_FILL_PCT / 100;
+		old_rec_count = clamp(old_rec_count, 1, record_count - 1);
+		new_rec_count = record_count - old_rec_count;
+	}
 
 	/*
 	 * The second half of the records go into a new node. This is done
@@ -1415,6 +1670,125 @@ out:
 	return err;
 }
 
+/**
+ * apfs_node_rec_bytes - Space taken by the keys and values in a node
+ * @node: the node
+ */
+static int apfs_node_rec_bytes(struct apfs_node *node)
+{
+	struct super_block *sb = node->object.sb;
+	int val_end = sb->s_blocksize;
+
+	if (apfs_node_is_root(node))
+		val_end -= sizeof(struct apfs_btree_info);
+	return node->free - node->key - node->key_free_list_len +
+	       val_end - node->val - node->val_free_list_len;
+}
+
+/**
+ * apfs_node_underflows - Check if a node is too empty and should be merged
+ * @node: the node to check
+ */
+bool apfs_node_underflows(struct apfs_node *node)
+{
+	struct super_block *sb = node->object.sb;
+
+	return apfs_node_rec_bytes(node) * 100 < sb->s_blocksize * APFS_BTREE_UNDERFLOW_PCT;
+}
+
+/**
+ * apfs_node_can_merge - Check if two sibling nodes fit together comfortably
+ * @left:	the first node
+ * @right:	the node that comes right after @left
+ *
+ * The merged node is still expected to have room for new records, or else it
+ * would just get split again soon.
+ */
+bool apfs_node_can_merge(struct apfs_node *left, struct apfs_node *right)
+{
+	struct super_block *sb = left->object.sb;
+	int size;
+
+	if (left->tree_type != right->tree_type || left->flags != right->flags)
+		return false;
+	size = sizeof(struct apfs_btree_node_phys);
+	size += apfs_node_toc_size(sb, left->tree_type, left->flags, left->records + right->records);
+	size += apfs_node_rec_bytes(left) + apfs_node_rec_bytes(right);
+	return size * 100 <= sb->s_blocksize * APFS_BTREE_MERGE_PCT;
+}
+
+/**
+ * apfs_node_merge - Move all the records from a node to its left sibling
+ * @left:	the node that will get all the records
+ * @right:	the node that comes right after @left
+ *
+ * The caller must make sure that the records fit, and must get rid of @right
+ * afterwards. Returns 0 on success or a negative error code in case of failure.
+ */
+int apfs_node_merge(struct apfs_node *left, struct apfs_node *right)
+{
+	struct super_block *sb = left->object.sb;
+	struct apfs_node *tmp_node = NULL;
+	int left_count = left->records;
+	int err;
+
+	/* The left records may need to move around to make room */
+	err = apfs_node_temp_dup(left, &tmp_node);
+	if (err)
+		return err;
+	apfs_node_reset_layout(left, left_count + right->records);
+	err = apfs_append_record_range(left, tmp_node, 0, left_count);
+	if (err)
+		goto fail;
+	err = apfs_append_record_range(left, right, 0, right->records);
+	if (err)
+		goto fail;
+	apfs_update_node(left);
+
+fail:
+	if (err)
+		apfs_err(sb, "record copy failed");
+	apfs_node_free(tmp_node);
+	return err;
+}
+
+/**
+ * apfs_btree_dec_height - Decrease the height of a b-tree
+ * @root:	the root node, which must have a single record
+ * @child:	the only child of @root
+ *
+ * Moves all the records of @child to @root, unless they don't fit. The caller
+ * must get rid of @child afterwards. Returns 0 on success, 1 if the records
+ * don't fit (and nothing was changed), or a negative error code in case of
+ * failure.
+ */
+int apfs_btree_dec_height(struct apfs_node *root, struct apfs_node *child)
+{
+	struct super_block *sb = root->object.sb;
+	struct apfs_btree_node_phys *root_raw = (void *)root->object.data;
+	struct apfs_btree_node_phys *child_raw = (void *)child->object.data;
+	u16 flags = child->flags | APFS_BTNODE_ROOT;
+	int size, err;
+
+	ASSERT(root->records == 1);
+
+	size = sizeof(*root_raw) + apfs_node_toc_size(sb, root->tree_type, flags, child->records);
+	size += apfs_node_rec_bytes(child);
+	if (size > sb->s_blocksize - sizeof(struct apfs_btree_info))
+		return 1;
+
+	root->flags = flags;
+	apfs_node_reset_layout(root, child->records);
+	err = apfs_append_record_range(root, child, 0, child->records);
+	if (err) {
+		apfs_err(sb, "record copy failed");
+		return err;
+	}
+	root_raw->btn_level = child_raw->btn_level; /* TODO: move to update_node() */
+	apfs_update_node(root);
+	return 0;
+}
+
 /* TODO: the following 4 functions could be reused elsewhere */
 
 /**
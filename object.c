@@ -40,7 +40,17 @@ int apfs_obj_verify_csum(struct super_block *sb, struct buffer_head *bh)
 	/* The checksum may be stale until the transaction is committed */
 	if (buffer_trans(bh))
 		return 1;
-	return apfs_multiblock_verify_csum(bh->b_data, sb->s_blocksize);
+
+	/*
+	 * Snapshot mounts share the block device buffers with the live volume,
+	 * so each immutable block only needs to be checked once.
+	 */
+	if (buffer_checked(bh))
+		return 1;
+	if (!apfs_multiblock_verify_csum(bh->b_data, sb->s_blocksize))
+		return 0;
+	set_buffer_checked(bh);
+	return 1;
 }
 
 /**
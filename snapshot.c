@@ -685,3 +685,1491 @@ fail:
 	apfs_node_free(snap_root);
 	return err;
 }
+
+/**
+ * apfs_snap_meta_val - Get the value for a snapshot metadata record
+ * @query: the query that found the record
+ *
+ * Returns a pointer to the value, or NULL if the record is corrupted.
+ */
+static struct apfs_snap_metadata_val *apfs_snap_meta_val(struct apfs_query *query)
+{
+	char *raw = query->node->object.data;
+
+	if (query->len < sizeof(struct apfs_snap_metadata_val)) {
+		apfs_err(query->node->object.sb, "bad value length (%d)", query->len);
+		return NULL;
+	}
+	return (struct apfs_snap_metadata_val *)(raw + query->off);
+}
+
+/**
+ * apfs_snapshot_is_mounted - Check if a snapshot of this volume is mounted
+ * @sb:		filesystem superblock
+ * @name:	name of the snapshot
+ */
+static bool apfs_snapshot_is_mounted(struct super_block *sb, const char *name)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_sb_info *curr = NULL;
+	bool mounted = false;
+
+	mutex_lock(&nxs_mutex);
+	list_for_each_entry(curr, &nxi->vol_list, list) {
+		if (curr->s_vol_nr != sbi->s_vol_nr || !curr->s_snap_name)
+			continue;
+		if (strcmp(curr->s_snap_name, name) == 0) {
+			mounted = true;
+			break;
+		}
+	}
+	mutex_unlock(&nxs_mutex);
+	return mounted;
+}
+
+static int apfs_delete_snap_name_rec(struct apfs_node *snap_root, const char *name)
+{
+	struct super_block *sb = snap_root->object.sb;
+	struct apfs_query *query = NULL;
+	int err;
+
+	query = apfs_alloc_query(snap_root, NULL /* parent */);
+	if (!query)
+		return -ENOMEM;
+	apfs_init_snap_name_key(name, &query->key);
+	query->flags |= APFS_QUERY_SNAP_META | APFS_QUERY_EXACT;
+
+	err = apfs_btree_query(sb, &query);
+	if (err) {
+		apfs_err(sb, "query failed (%s)", name);
+		goto fail;
+	}
+	err = apfs_btree_remove(query);
+	if (err)
+		apfs_err(sb, "removal failed (%s)", name);
+fail:
+	apfs_free_query(query);
+	query = NULL;
+	return err;
+}
+
+/**
+ * apfs_update_snap_metadata_rec - Edit the metadata record for a snapshot
+ * @snap_root:	root of the snapshot metadata tree, already in the transaction
+ * @xid:	transaction id for the snapshot
+ * @flags:	flags to set in the record
+ * @extref_oid:	new oid for the extent reference tree, or zero to keep it
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_update_snap_metadata_rec(struct apfs_node *snap_root, u64 xid, u32 flags, u64 extref_oid)
+{
+	struct super_block *sb = snap_root->object.sb;
+	struct apfs_query *query = NULL;
+	struct apfs_snap_metadata_val *val = NULL;
+	int err;
+
+	query = apfs_alloc_query(snap_root, NULL /* parent */);
+	if (!query)
+		return -ENOMEM;
+	apfs_init_snap_metadata_key(xid, &query->key);
+	query->flags |= APFS_QUERY_SNAP_META | APFS_QUERY_EXACT;
+
+	err = apfs_btree_query(sb, &query);
+	if (err) {
+		apfs_err(sb, "query failed for xid 0x%llx", xid);
+		goto fail;
+	}
+	err = apfs_query_join_transaction(query);
+	if (err) {
+		apfs_err(sb, "query join failed");
+		goto fail;
+	}
+	val = apfs_snap_meta_val(query);
+	if (!val) {
+		err = -EFSCORRUPTED;
+		goto fail;
+	}
+	val->flags |= cpu_to_le32(flags);
+	if (extref_oid)
+		val->extentref_tree_oid = cpu_to_le64(extref_oid);
+fail:
+	apfs_free_query(query);
+	query = NULL;
+	return err;
+}
+
+/**
+ * apfs_do_ioc_delete_snapshot - Actual work for apfs_ioc_delete_snapshot()
+ * @mntpoint:	inode of the mount point
+ * @name:	label for the snapshot
+ *
+ * Only the name record is removed right away, the metadata record stays around
+ * with APFS_SNAP_MERGE_IN_PROGRESS set until the reaper is done freeing all the
+ * blocks. This way the deletion survives an unmount. Returns 0 on success, or
+ * a negative error code in case of failure.
+ */
+static int apfs_do_ioc_delete_snapshot(struct inode *mntpoint, const char *name)
+{
+	struct super_block *sb = mntpoint->i_sb;
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_superblock *vsb_raw = NULL;
+	struct apfs_node *snap_root = NULL;
+	u64 xid = 0;
+	int err;
+
+	err = apfs_transaction_start(sb, APFS_TRANS_REG);
+	if (err)
+		return err;
+	vsb_raw = sbi->s_vsb_raw;
+
+	/* Same as for creation, exit cleanly if the name can't be used */
+	snap_root = apfs_read_node(sb, le64_to_cpu(vsb_raw->apfs_snap_meta_tree_oid), APFS_OBJ_PHYSICAL, false /* write */);
+	if (IS_ERR(snap_root)) {
+		apfs_err(sb, "failed to read snap meta root 0x%llx", le64_to_cpu(vsb_raw->apfs_snap_meta_tree_oid));
+		err = PTR_ERR(snap_root);
+		snap_root = NULL;
+		goto fail;
+	}
+	err = apfs_snapshot_name_to_xid(snap_root, name, &xid);
+	apfs_node_free(snap_root);
+	snap_root = NULL;
+	if (err == -ENODATA || (!err && apfs_snapshot_is_mounted(sb, name))) {
+		err = apfs_transaction_commit(sb);
+		if (err)
+			goto fail;
+		if (xid) {
+			apfs_warn(sb, "snapshot is mounted (%s)", name);
+			return -EBUSY;
+		}
+		apfs_info(sb, "no snapshot under that name (%s)", name);
+		return -ENOENT;
+	}
+	if (err)
+		goto fail;
+
+	snap_root = apfs_read_node(sb, le64_to_cpu(vsb_raw->apfs_snap_meta_tree_oid), APFS_OBJ_PHYSICAL, true /* write */);
+	if (IS_ERR(snap_root)) {
+		apfs_err(sb, "failed to read snap meta root 0x%llx", le64_to_cpu(vsb_raw->apfs_snap_meta_tree_oid));
+		err = PTR_ERR(snap_root);
+		snap_root = NULL;
+		goto fail;
+	}
+	apfs_assert_in_transaction(sb, &vsb_raw->apfs_o);
+	vsb_raw->apfs_snap_meta_tree_oid = cpu_to_le64(snap_root->object.oid);
+
+	err = apfs_delete_snap_name_rec(snap_root, name);
+	if (err) {
+		apfs_err(sb, "name rec deletion failed");
+		goto fail;
+	}
+	err = apfs_update_snap_metadata_rec(snap_root, xid, APFS_SNAP_MERGE_IN_PROGRESS, 0 /* extref_oid */);
+	if (err) {
+		apfs_err(sb, "failed to flag meta rec for xid 0x%llx", xid);
+		goto fail;
+	}
+	apfs_node_free(snap_root);
+	snap_root = NULL;
+
+	err = apfs_transaction_commit(sb);
+	if (err)
+		goto fail;
+	apfs_schedule_reaper(sb);
+	return 0;
+
+fail:
+	apfs_node_free(snap_root);
+	snap_root = NULL;
+	apfs_transaction_abort(sb);
+	return err;
+}
+
+/**
+ * apfs_ioc_delete_snapshot - Ioctl handler for APFS_IOC_DELETE_SNAPSHOT
+ * @file:	affected file
+ * @arg:	ioctl argument
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+int apfs_ioc_delete_snapshot(struct file *file, void __user *user_arg)
+{
+	struct inode *inode = file_inode(file);
+	struct super_block *sb = inode->i_sb;
+	struct apfs_ioctl_snap_name *arg = NULL;
+	size_t name_len;
+	int err;
+
+	if (apfs_ino(inode) != APFS_ROOT_DIR_INO_NUM) {
+		apfs_info(sb, "snapshot deletion must be requested on mountpoint");
+		return -ENOTTY;
+	}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 12, 0)
+	if (!inode_owner_or_capable(inode))
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0) && !RHEL_VERSION_GE(9, 6)
+	if (!inode_owner_or_capable(&init_user_ns, inode))
+#else
+	if (!inode_owner_or_capable(&nop_mnt_idmap, inode))
+#endif
+		return -EPERM;
+
+	err = mnt_want_write_file(file);
+	if (err)
+		return err;
+
+	arg = kzalloc(sizeof(*arg), GFP_KERNEL);
+	if (!arg) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	if (copy_from_user(arg, user_arg, sizeof(*arg))) {
+		err = -EFAULT;
+		goto fail;
+	}
+
+	name_len = strnlen(arg->name, sizeof(arg->name));
+	if (name_len == sizeof(arg->name)) {
+		apfs_warn(sb, "snapshot name is too long (%d)", (int)name_len);
+		err = -EINVAL;
+		goto fail;
+	}
+
+	err = apfs_do_ioc_delete_snapshot(inode, arg->name);
+fail:
+	kfree(arg);
+	arg = NULL;
+	mnt_drop_write_file(file);
+	return err;
+}
+
+/*
+ * A snapshot that was deleted, but whose blocks are still being reaped. The
+ * previous and next snapshots are the ones that share blocks with it.
+ */
+struct apfs_reap_target {
+	u64 xid;		/* Transaction id for the deleted snapshot */
+	u64 sblock_oid;		/* Its volume superblock */
+	u64 extref_oid;		/* Its extent reference tree */
+	u64 prev_xid;		/* Previous snapshot, or zero if none */
+	u64 next_xid;		/* Next snapshot, or zero if none */
+	u64 next_extref_oid;	/* Extent reference tree for the next one */
+};
+
+/**
+ * apfs_reap_find_target - Find the oldest deleted snapshot
+ * @snap_root:	root of the snapshot metadata tree
+ * @tgt:	on return, the snapshot to reap
+ *
+ * Returns 0 on success, -ENODATA if there are no deleted snapshots left, or
+ * another negative error code in case of failure.
+ */
+static int apfs_reap_find_target(struct apfs_node *snap_root, struct apfs_reap_target *tgt)
+{
+	struct super_block *sb = snap_root->object.sb;
+	struct apfs_btree_iter iter;
+	struct apfs_key start, end;
+	struct apfs_snap_metadata_val *val = NULL;
+	int ret;
+
+	memset(tgt, 0, sizeof(*tgt));
+
+	apfs_init_snap_metadata_key(0, &start);
+	apfs_init_snap_metadata_key(APFS_SNAP_NAME_OBJ_ID, &end);
+	apfs_btree_iter_init(&iter, snap_root, APFS_QUERY_SNAP_META, &start, &end);
+
+	for (ret = apfs_btree_iter_seek(sb, &iter, NULL /* key */); !ret;
+	     ret = apfs_btree_iter_next(sb, &iter)) {
+		val = apfs_snap_meta_val(iter.query);
+		if (!val) {
+			ret = -EFSCORRUPTED;
+			break;
+		}
+		if (tgt->xid) {
+			tgt->next_xid = iter.key.id;
+			tgt->next_extref_oid = le64_to_cpu(val->extentref_tree_oid);
+			break;
+		}
+		if (le32_to_cpu(val->flags) & APFS_SNAP_MERGE_IN_PROGRESS) {
+			tgt->xid = iter.key.id;
+			tgt->sblock_oid = le64_to_cpu(val->sblock_oid);
+			tgt->extref_oid = le64_to_cpu(val->extentref_tree_oid);
+		} else {
+			tgt->prev_xid = iter.key.id;
+		}
+	}
+	apfs_btree_iter_release(&iter);
+
+	if (ret == -ENODATA)
+		ret = 0;
+	if (ret) {
+		apfs_err(sb, "failed to list snapshots");
+		return ret;
+	}
+	return tgt->xid ? 0 : -ENODATA;
+}
+
+/**
+ * apfs_reap_extentrefs - Merge a deleted snapshot's extent references
+ * @snap_root:	root of the snapshot metadata tree, already in the transaction
+ * @tgt:	the deleted snapshot
+ * @src_root:	on return, the root of its extent reference tree
+ * @budget:	number of records that may still be processed
+ *
+ * The reference counts get moved into the tree for the next snapshot, or for
+ * the volume itself if there is none. Returns 0 once they are all moved, or a
+ * negative error code, which is -EAGAIN if the transaction is big enough.
+ */
+static int apfs_reap_extentrefs(struct apfs_node *snap_root, const struct apfs_reap_target *tgt, struct apfs_node **src_root, int *budget)
+{
+	struct super_block *sb = snap_root->object.sb;
+	struct apfs_superblock *vsb_raw = APFS_SB(sb)->s_vsb_raw;
+	struct apfs_node *dst_root = NULL;
+	u64 dst_oid;
+	int err;
+
+	*src_root = apfs_read_node(sb, tgt->extref_oid, APFS_OBJ_PHYSICAL, true /* write */);
+	if (IS_ERR(*src_root)) {
+		apfs_err(sb, "failed to read extref root 0x%llx", tgt->extref_oid);
+		err = PTR_ERR(*src_root);
+		*src_root = NULL;
+		return err;
+	}
+	err = apfs_update_snap_metadata_rec(snap_root, tgt->xid, 0 /* flags */, (*src_root)->object.oid);
+	if (err)
+		return err;
+
+	if (!tgt->next_xid) {
+		/* The live tree must be up to date before any merges */
+		err = apfs_transaction_flush_all_inodes(sb);
+		if (err) {
+			apfs_err(sb, "failed to flush all inodes");
+			return err;
+		}
+	}
+
+	dst_oid = tgt->next_xid ? tgt->next_extref_oid : le64_to_cpu(vsb_raw->apfs_extentref_tree_oid);
+	dst_root = apfs_read_node(sb, dst_oid, APFS_OBJ_PHYSICAL, true /* write */);
+	if (IS_ERR(dst_root)) {
+		apfs_err(sb, "failed to read extref root 0x%llx", dst_oid);
+		return PTR_ERR(dst_root);
+	}
+	if (tgt->next_xid) {
+		err = apfs_update_snap_metadata_rec(snap_root, tgt->next_xid, 0 /* flags */, dst_root->object.oid);
+		if (err)
+			goto out;
+	} else {
+		apfs_assert_in_transaction(sb, &vsb_raw->apfs_o);
+		vsb_raw->apfs_extentref_tree_oid = cpu_to_le64(dst_root->object.oid);
+	}
+
+	err = apfs_merge_extentref_tree(*src_root, dst_root, budget);
+out:
+	apfs_node_free(dst_root);
+	return err;
+}
+
+/**
+ * apfs_reap_omap_versions - Delete the object versions only seen by a snapshot
+ * @sb:		filesystem superblock
+ * @tgt:	the deleted snapshot
+ * @budget:	number of records that may still be processed
+ *
+ * A version is no longer needed if the previous snapshot is older than it, and
+ * the next snapshot can already see a newer one. Objects deleted while there
+ * were snapshots are followed by a deletion marker, which counts as the newer
+ * version; the marker itself goes away once no older versions remain. Returns 0
+ * once the whole omap was checked, or a negative error code, which is -EAGAIN
+ * if the transaction is big enough. In that case the position is saved for the
+ * next call.
+ */
+static int apfs_reap_omap_versions(struct super_block *sb, const struct apfs_reap_target *tgt, int *budget)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_spaceman_free_queue *fq = NULL;
+	struct apfs_btree_iter iter;
+	struct apfs_key start, end, resume;
+	struct apfs_omap_map map = {0};
+	u64 prev_oid = 0, prev_ver = 0;
+	bool have_prev = false, prev_tomb = false;
+	bool kept = sbi->s_reap_kept;
+	int ret;
+
+	fq = &APFS_SM(sb)->sm_raw->sm_fq[APFS_SFQ_MAIN];
+
+	apfs_init_omap_key(0, 0, &start);
+	apfs_init_omap_key(U64_MAX, U64_MAX, &end);
+	apfs_init_omap_key(sbi->s_reap_oid, sbi->s_reap_ver, &resume);
+	apfs_btree_iter_init(&iter, sbi->s_omap->omap_root, APFS_QUERY_OMAP, &start, &end);
+
+	for (ret = apfs_btree_iter_seek(sb, &iter, &resume); !ret;
+	     ret = apfs_btree_iter_next(sb, &iter)) {
+		ret = apfs_omap_map_from_query(iter.query, &map);
+		if (ret) {
+			apfs_err(sb, "bad omap record for oid 0x%llx", iter.key.id);
+			goto out;
+		}
+
+		if (have_prev && prev_oid == iter.key.id) {
+			if (!prev_tomb && prev_ver > tgt->prev_xid && prev_ver <= tgt->xid &&
+			    (!tgt->next_xid || iter.key.number <= tgt->next_xid)) {
+				ret = apfs_delete_omap_version(sb, prev_oid, prev_ver);
+				if (ret) {
+					apfs_err(sb, "failed to delete oid 0x%llx, xid 0x%llx", prev_oid, prev_ver);
+					goto out;
+				}
+			} else {
+				kept = true;
+			}
+		} else if (have_prev) {
+			kept = false;
+		}
+
+		/* The next call will start from this record again */
+		if (--*budget <= 0 || le64_to_cpu(fq->sfq_count) > APFS_TRANS_MAIN_QUEUE_MAX) {
+			sbi->s_reap_oid = iter.key.id;
+			sbi->s_reap_ver = iter.key.number;
+			sbi->s_reap_kept = kept;
+			ret = -EAGAIN;
+			goto out;
+		}
+
+		have_prev = true;
+		prev_oid = iter.key.id;
+		prev_ver = iter.key.number;
+		prev_tomb = map.flags & APFS_OMAP_VAL_DELETED;
+
+		if (prev_tomb && !kept) {
+			ret = apfs_delete_omap_version(sb, prev_oid, prev_ver);
+			if (ret) {
+				apfs_err(sb, "failed to delete marker for oid 0x%llx", prev_oid);
+				goto out;
+			}
+		}
+	}
+	if (ret == -ENODATA)
+		ret = 0;
+	else
+		apfs_err(sb, "failed to list omap records");
+out:
+	apfs_btree_iter_release(&iter);
+	return ret;
+}
+
+/**
+ * apfs_reap_omap_snapshot - Remove a deleted snapshot from the omap
+ * @sb:		filesystem superblock
+ * @tgt:	the deleted snapshot
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_reap_omap_snapshot(struct super_block *sb, const struct apfs_reap_target *tgt)
+{
+	struct apfs_superblock *vsb_raw = APFS_SB(sb)->s_vsb_raw;
+	struct apfs_omap *omap = APFS_SB(sb)->s_omap;
+	struct buffer_head *bh = NULL;
+	struct apfs_omap_phys *omap_raw = NULL;
+	struct apfs_node *root = NULL;
+	struct apfs_query *query = NULL;
+	u64 omap_blk;
+	int err;
+
+	omap_blk = le64_to_cpu(vsb_raw->apfs_omap_oid);
+	bh = apfs_read_object_block(sb, omap_blk, true /* write */, false /* preserve */);
+	if (IS_ERR(bh)) {
+		apfs_err(sb, "CoW failed for bno 0x%llx", omap_blk);
+		return PTR_ERR(bh);
+	}
+	omap_raw = (struct apfs_omap_phys *)bh->b_data;
+
+	root = apfs_read_node(sb, le64_to_cpu(omap_raw->om_snapshot_tree_oid), APFS_OBJ_PHYSICAL, true /* write */);
+	if (IS_ERR(root)) {
+		apfs_err(sb, "failed to read omap snap root 0x%llx", le64_to_cpu(omap_raw->om_snapshot_tree_oid));
+		err = PTR_ERR(root);
+		root = NULL;
+		goto fail;
+	}
+
+	query = apfs_alloc_query(root, NULL /* parent */);
+	if (!query) {
+		err = -ENOMEM;
+		goto fail;
+	}
+	apfs_init_omap_snap_key(tgt->xid, &query->key);
+	query->flags = APFS_QUERY_OMAP_SNAP | APFS_QUERY_EXACT;
+
+	err = apfs_btree_query(sb, &query);
+	if (err) {
+		apfs_err(sb, "query failed for xid 0x%llx", tgt->xid);
+		goto fail;
+	}
+	err = apfs_btree_remove(query);
+	if (err) {
+		apfs_err(sb, "removal failed for xid 0x%llx", tgt->xid);
+		goto fail;
+	}
+
+	apfs_assert_in_transaction(sb, &omap_raw->om_o);
+	omap_raw->om_snapshot_tree_oid = cpu_to_le64(root->object.block_nr);
+	le32_add_cpu(&omap_raw->om_snap_count, -1);
+	if (le64_to_cpu(omap_raw->om_most_recent_snap) == tgt->xid)
+		omap_raw->om_most_recent_snap = cpu_to_le64(tgt->prev_xid);
+	if (omap->omap_latest_snap == tgt->xid)
+		omap->omap_latest_snap = tgt->prev_xid;
+
+fail:
+	apfs_free_query(query);
+	query = NULL;
+	apfs_node_free(root);
+	root = NULL;
+	omap_raw = NULL;
+	brelse(bh);
+	bh = NULL;
+	return err;
+}
+
+/**
+ * apfs_reap_finish - Get rid of what's left of a deleted snapshot
+ * @snap_root:	root of the snapshot metadata tree, already in the transaction
+ * @tgt:	the deleted snapshot
+ * @src_root:	root of its extent reference tree, which is now empty
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_reap_finish(struct apfs_node *snap_root, const struct apfs_reap_target *tgt, struct apfs_node *src_root)
+{
+	struct super_block *sb = snap_root->object.sb;
+	struct apfs_superblock *vsb_raw = APFS_SB(sb)->s_vsb_raw;
+	struct apfs_query *query = NULL;
+	int err;
+
+	query = apfs_alloc_query(snap_root, NULL /* parent */);
+	if (!query)
+		return -ENOMEM;
+	apfs_init_snap_metadata_key(tgt->xid, &query->key);
+	query->flags |= APFS_QUERY_SNAP_META | APFS_QUERY_EXACT;
+
+	err = apfs_btree_query(sb, &query);
+	if (err) {
+		apfs_err(sb, "query failed for xid 0x%llx", tgt->xid);
+		goto fail;
+	}
+	err = apfs_btree_remove(query);
+	if (err) {
+		apfs_err(sb, "removal failed for xid 0x%llx", tgt->xid);
+		goto fail;
+	}
+
+	err = apfs_reap_omap_snapshot(sb, tgt);
+	if (err) {
+		apfs_err(sb, "failed to update omap snapshots");
+		goto fail;
+	}
+
+	/* Snapshot superblocks are not counted in the allocation count */
+	err = apfs_free_queue_insert(sb, tgt->sblock_oid, 1);
+	if (err) {
+		apfs_err(sb, "free queue insertion failed for 0x%llx", tgt->sblock_oid);
+		goto fail;
+	}
+	err = apfs_delete_node(src_root, APFS_QUERY_EXTENTREF);
+	if (err) {
+		apfs_err(sb, "failed to delete extref root 0x%llx", src_root->object.oid);
+		goto fail;
+	}
+
+	apfs_assert_in_transaction(sb, &vsb_raw->apfs_o);
+	le64_add_cpu(&vsb_raw->apfs_num_snapshots, -1);
+fail:
+	apfs_free_query(query);
+	query = NULL;
+	return err;
+}
+
+/**
+ * apfs_reap_read_snap_root - Read the root of the snapshot metadata tree
+ * @sb:		filesystem superblock
+ * @write:	get write access to the root?
+ *
+ * Returns the root node, or an error pointer in case of failure.
+ */
+static struct apfs_node *apfs_reap_read_snap_root(struct super_block *sb, bool write)
+{
+	struct apfs_superblock *vsb_raw = APFS_SB(sb)->s_vsb_raw;
+	struct apfs_node *snap_root = NULL;
+
+	snap_root = apfs_read_node(sb, le64_to_cpu(vsb_raw->apfs_snap_meta_tree_oid), APFS_OBJ_PHYSICAL, write);
+	if (IS_ERR(snap_root)) {
+		apfs_err(sb, "failed to read snap meta root 0x%llx", le64_to_cpu(vsb_raw->apfs_snap_meta_tree_oid));
+		return snap_root;
+	}
+	if (write) {
+		apfs_assert_in_transaction(sb, &vsb_raw->apfs_o);
+		vsb_raw->apfs_snap_meta_tree_oid = cpu_to_le64(snap_root->object.oid);
+	}
+	return snap_root;
+}
+
+/**
+ * apfs_reap_find_target_ro - Find the snapshot to reap, outside a transaction
+ * @sb:		filesystem superblock
+ * @tgt:	on return, the snapshot to reap
+ *
+ * Returns 0 on success, -ENODATA if there is nothing to reap, or another
+ * negative error code in case of failure.
+ */
+static int apfs_reap_find_target_ro(struct super_block *sb, struct apfs_reap_target *tgt)
+{
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_node *snap_root = NULL;
+	int err;
+
+	down_read(&nxi->nx_big_sem);
+	snap_root = apfs_reap_read_snap_root(sb, false /* write */);
+	if (IS_ERR(snap_root)) {
+		err = PTR_ERR(snap_root);
+		goto out;
+	}
+	err = apfs_reap_find_target(snap_root, tgt);
+	apfs_node_free(snap_root);
+out:
+	up_read(&nxi->nx_big_sem);
+	return err;
+}
+
+/**
+ * apfs_reap_step - Make some progress with the deletion of snapshots
+ * @sb: filesystem superblock
+ *
+ * Each call runs a single transaction of limited size, so that the reaper never
+ * holds the container lock for long. No transaction is started if there is no
+ * work to do. Returns -EAGAIN if there may be more work left, 0 if there is
+ * none, or another negative error code in case of failure.
+ */
+static int apfs_reap_step(struct super_block *sb)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_node *snap_root = NULL, *src_root = NULL;
+	struct apfs_reap_target tgt;
+	int budget = APFS_REAP_MAX_RECORDS;
+	int err, commit_err;
+
+	/* Most mounts with snapshots have nothing to reap */
+	err = apfs_reap_find_target_ro(sb, &tgt);
+	if (err == -ENODATA)
+		return 0;
+	if (err)
+		return err;
+
+	err = apfs_transaction_start(sb, APFS_TRANS_DEL);
+	if (err)
+		return err;
+
+	/* Search again, in case something changed before the transaction */
+	snap_root = apfs_reap_read_snap_root(sb, false /* write */);
+	if (IS_ERR(snap_root)) {
+		err = PTR_ERR(snap_root);
+		snap_root = NULL;
+		goto fail;
+	}
+	err = apfs_reap_find_target(snap_root, &tgt);
+	apfs_node_free(snap_root);
+	snap_root = NULL;
+	if (err == -ENODATA) {
+		err = 0;
+		goto commit;
+	}
+	if (err)
+		goto fail;
+
+	/* The in-memory progress only applies to the same snapshot */
+	if (sbi->s_reap_xid != tgt.xid) {
+		sbi->s_reap_xid = tgt.xid;
+		sbi->s_reap_oid = 0;
+		sbi->s_reap_ver = 0;
+		sbi->s_reap_kept = false;
+		sbi->s_reap_extrefs_done = false;
+		sbi->s_reap_omap_done = false;
+	}
+
+	if (!sbi->s_reap_extrefs_done) {
+		snap_root = apfs_reap_read_snap_root(sb, true /* write */);
+		if (IS_ERR(snap_root)) {
+			err = PTR_ERR(snap_root);
+			snap_root = NULL;
+			goto fail;
+		}
+		err = apfs_reap_extentrefs(snap_root, &tgt, &src_root, &budget);
+		if (err == -EAGAIN)
+			goto commit;
+		if (err) {
+			apfs_err(sb, "failed to merge extrefs for xid 0x%llx", tgt.xid);
+			goto fail;
+		}
+		sbi->s_reap_extrefs_done = true;
+	}
+
+	if (!sbi->s_reap_omap_done) {
+		err = apfs_reap_omap_versions(sb, &tgt, &budget);
+		if (err == -EAGAIN)
+			goto commit;
+		if (err) {
+			apfs_err(sb, "failed to reap omap for xid 0x%llx", tgt.xid);
+			goto fail;
+		}
+		sbi->s_reap_omap_done = true;
+	}
+
+	if (!snap_root) {
+		snap_root = apfs_reap_read_snap_root(sb, true /* write */);
+		if (IS_ERR(snap_root)) {
+			err = PTR_ERR(snap_root);
+			snap_root = NULL;
+			goto fail;
+		}
+	}
+	if (!src_root) {
+		/* The merge left the empty root in place, it just gets freed */
+		src_root = apfs_read_node(sb, tgt.extref_oid, APFS_OBJ_PHYSICAL, false /* write */);
+		if (IS_ERR(src_root)) {
+			apfs_err(sb, "failed to read extref root 0x%llx", tgt.extref_oid);
+			err = PTR_ERR(src_root);
+			src_root = NULL;
+			goto fail;
+		}
+	}
+	err = apfs_reap_finish(snap_root, &tgt, src_root);
+	if (err) {
+		apfs_err(sb, "failed to finish reaping xid 0x%llx", tgt.xid);
+		goto fail;
+	}
+	sbi->s_reap_xid = 0;
+	err = -EAGAIN;
+
+commit:
+	apfs_node_free(src_root);
+	src_root = NULL;
+	apfs_node_free(snap_root);
+	snap_root = NULL;
+	commit_err = apfs_transaction_commit(sb);
+	if (commit_err) {
+		err = commit_err;
+		goto fail;
+	}
+	return err;
+
+fail:
+	apfs_node_free(src_root);
+	src_root = NULL;
+	apfs_node_free(snap_root);
+	snap_root = NULL;
+	apfs_transaction_abort(sb);
+	/* The saved position may now be ahead of the changes on disk */
+	sbi->s_reap_xid = 0;
+	return err;
+}
+
+/**
+ * apfs_schedule_reaper - Schedule the reaper for deleted snapshots
+ * @sb: filesystem superblock
+ */
+void apfs_schedule_reaper(struct super_block *sb)
+{
+	/* Same as for orphans, future mounts will pick up where we left off */
+	if (atomic_read(&sb->s_active) == 0)
+		return;
+	queue_work(apfs_reclaim_wq, &APFS_SB(sb)->s_reaper_work);
+}
+
+void apfs_reaper_work(struct work_struct *work)
+{
+	struct super_block *sb = NULL;
+	struct apfs_sb_info *sbi = NULL;
+	int err;
+
+	sbi = container_of(work, struct apfs_sb_info, s_reaper_work);
+	sb = sbi->s_private_dir->i_sb;
+
+	if (sb->s_flags & SB_RDONLY) {
+		apfs_alert(sb, "attempt to reap snapshots in read-only mount");
+		return;
+	}
+
+	/* Requeue between transactions so that other work gets a chance */
+	err = apfs_reap_step(sb);
+	if (err == -EAGAIN)
+		apfs_schedule_reaper(sb);
+	else if (err)
+		apfs_err(sb, "snapshot reaper failed (err:%d)", err);
+}
+
+/*
+ * Position in the catalog of a snapshot, for the diff ioctl. The current entry
+ * may be a whole subtree that has not been read yet, so that it can be skipped
+ * if the other snapshot shares it.
+ */
+struct apfs_diff_cursor {
+	struct super_block *sb;
+	u64 xid;		/* Transaction id for omap lookups */
+	int top;		/* Level of the root node */
+	int level;		/* Level of the current entry */
+	struct apfs_node *nodes[APFS_BTREE_MAX_HEIGHT]; /* Path, from @level up */
+	int index[APFS_BTREE_MAX_HEIGHT];
+	bool end;		/* Are all records consumed? */
+	struct apfs_key key;	/* Key for the current entry */
+	u64 child_bno;		/* Block for the current subtree, if known */
+};
+
+/**
+ * apfs_diff_node_level - Get the level of a node in its b-tree
+ * @node: the node
+ */
+static inline int apfs_diff_node_level(struct apfs_node *node)
+{
+	struct apfs_btree_node_phys *raw = (void *)node->object.data;
+
+	return le16_to_cpu(raw->btn_level);
+}
+
+/**
+ * apfs_diff_read_node - Read a catalog node as it was in a snapshot
+ * @cur:	cursor for the snapshot
+ * @bno:	block number for the node
+ * @level:	expected level for the node
+ *
+ * Returns the node on success, or an error pointer in case of failure.
+ */
+static struct apfs_node *apfs_diff_read_node(struct apfs_diff_cursor *cur, u64 bno, int level)
+{
+	struct super_block *sb = cur->sb;
+	struct apfs_node *node = NULL;
+
+	/* The omap was already checked, so read the block directly */
+	node = apfs_read_node(sb, bno, APFS_OBJ_PHYSICAL, false /* write */);
+	if (IS_ERR(node)) {
+		apfs_err(sb, "failed to read node 0x%llx", bno);
+		return node;
+	}
+	if (apfs_diff_node_level(node) != level || node->records == 0) {
+		apfs_err(sb, "bad catalog node 0x%llx", bno);
+		apfs_node_free(node);
+		return ERR_PTR(-EFSCORRUPTED);
+	}
+	return node;
+}
+
+/**
+ * apfs_diff_load_entry - Read the key for the current entry of a cursor
+ * @cur: the cursor
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_diff_load_entry(struct apfs_diff_cursor *cur)
+{
+	struct apfs_node *node = cur->nodes[cur->level];
+	int off, len;
+
+	cur->child_bno = 0;
+	len = apfs_node_locate_key(node, cur->index[cur->level], &off);
+	if (!len)
+		return -EFSCORRUPTED;
+	return apfs_read_raw_key(cur->sb, APFS_QUERY_CAT, node->object.data + off, len, &cur->key);
+}
+
+/**
+ * apfs_diff_child_bno - Find the block for the current subtree of a cursor
+ * @cur: the cursor, which must be set on an index node
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_diff_child_bno(struct apfs_diff_cursor *cur)
+{
+	struct apfs_node *node = cur->nodes[cur->level];
+	struct apfs_omap *omap = APFS_SB(cur->sb)->s_omap;
+	__le64 *raw_oid = NULL;
+	int off, len;
+
+	if (cur->child_bno)
+		return 0;
+	len = apfs_node_locate_value(node, cur->index[cur->level], &off);
+	if (len != sizeof(*raw_oid)) {
+		apfs_err(cur->sb, "bad index value in node 0x%llx", node->object.block_nr);
+		return -EFSCORRUPTED;
+	}
+	raw_oid = (void *)node->object.data + off;
+	return apfs_omap_lookup_snap_block(cur->sb, omap, le64_to_cpup(raw_oid), cur->xid, &cur->child_bno);
+}
+
+/**
+ * apfs_diff_descend - Move a cursor to the first entry in its current subtree
+ * @cur: the cursor, which must be set on an index node
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_diff_descend(struct apfs_diff_cursor *cur)
+{
+	struct apfs_node *child = NULL;
+	int err;
+
+	err = apfs_diff_child_bno(cur);
+	if (err)
+		return err;
+	child = apfs_diff_read_node(cur, cur->child_bno, cur->level - 1);
+	if (IS_ERR(child))
+		return PTR_ERR(child);
+	--cur->level;
+	cur->nodes[cur->level] = child;
+	cur->index[cur->level] = 0;
+	return apfs_diff_load_entry(cur);
+}
+
+/**
+ * apfs_diff_next - Move a cursor past its current entry
+ * @cur: the cursor
+ *
+ * The cursor stays at the level of the next entry, without reading any new
+ * nodes. Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_diff_next(struct apfs_diff_cursor *cur)
+{
+	while (++cur->index[cur->level] >= cur->nodes[cur->level]->records) {
+		if (cur->level == cur->top) {
+			cur->end = true;
+			return 0;
+		}
+		apfs_node_free(cur->nodes[cur->level]);
+		cur->nodes[cur->level] = NULL;
+		++cur->level;
+	}
+	return apfs_diff_load_entry(cur);
+}
+
+/**
+ * apfs_diff_seek - Move a cursor to the first record that is not before a key
+ * @cur: the cursor, which must be at the root
+ * @key: the key to search
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_diff_seek(struct apfs_diff_cursor *cur, struct apfs_key *key)
+{
+	struct apfs_node *node = NULL;
+	int *index = NULL;
+	int cmp = 1;
+	int err;
+
+	while (true) {
+		node = cur->nodes[cur->level];
+		index = &cur->index[cur->level];
+		for (*index = 0; *index < node->records; ++*index) {
+			err = apfs_diff_load_entry(cur);
+			if (err)
+				return err;
+			cmp = apfs_keycmp(&cur->key, key);
+			if (cmp >= 0)
+				break;
+		}
+		if (cur->level == 0)
+			break;
+		/* Index keys come before the whole subtree, so go back one */
+		if (*index > 0 && (*index == node->records || cmp > 0))
+			--*index;
+		err = apfs_diff_load_entry(cur);
+		if (err)
+			return err;
+		err = apfs_diff_descend(cur);
+		if (err)
+			return err;
+	}
+
+	if (*index < node->records)
+		return 0;
+	--*index;
+	return apfs_diff_next(cur);
+}
+
+/**
+ * apfs_diff_cursor_init - Set a cursor on the root of a snapshot's catalog
+ * @sb:		filesystem superblock
+ * @cur:	cursor to initialize
+ * @root_oid:	virtual object id for the root of the catalog
+ * @xid:	transaction id for the snapshot
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_diff_cursor_init(struct super_block *sb, struct apfs_diff_cursor *cur, u64 root_oid, u64 xid)
+{
+	struct apfs_node *root = NULL;
+	u64 bno;
+	int err;
+
+	memset(cur, 0, sizeof(*cur));
+	cur->sb = sb;
+	cur->xid = xid;
+
+	err = apfs_omap_lookup_snap_block(sb, APFS_SB(sb)->s_omap, root_oid, xid, &bno);
+	if (err)
+		return err;
+	root = apfs_read_node(sb, bno, APFS_OBJ_PHYSICAL, false /* write */);
+	if (IS_ERR(root)) {
+		apfs_err(sb, "failed to read catalog root 0x%llx", bno);
+		return PTR_ERR(root);
+	}
+
+	cur->top = cur->level = apfs_diff_node_level(root);
+	if (cur->top >= APFS_BTREE_MAX_HEIGHT) {
+		apfs_err(sb, "btree is too high");
+		apfs_node_free(root);
+		cur->top = cur->level = 0;
+		return -EFSCORRUPTED;
+	}
+	cur->nodes[cur->top] = root;
+	if (root->records == 0) {
+		cur->end = true;
+		return 0;
+	}
+	return apfs_diff_load_entry(cur);
+}
+
+/**
+ * apfs_diff_cursor_release - Free all nodes held by a cursor
+ * @cur: the cursor
+ */
+static void apfs_diff_cursor_release(struct apfs_diff_cursor *cur)
+{
+	int i;
+
+	for (i = 0; i < APFS_BTREE_MAX_HEIGHT; ++i) {
+		apfs_node_free(cur->nodes[i]);
+		cur->nodes[i] = NULL;
+	}
+}
+
+/*
+ * State for a single call to the snapshot diff ioctl
+ */
+struct apfs_diff_ctx {
+	struct apfs_diff_cursor old;	/* Cursor for the older snapshot */
+	struct apfs_diff_cursor new;	/* Cursor for the newer snapshot */
+	struct apfs_snap_diff_entry *entries;
+	u32 count;			/* Size of @entries */
+	u32 filled;			/* Entries already set */
+	struct apfs_key pos;		/* Where the next call should start */
+	bool pos_reported;		/* Was the object at @pos reported? */
+	bool has_reported;		/* Was any object reported yet? */
+	u64 reported_id;		/* Last object with a non-extent entry */
+};
+
+/**
+ * apfs_diff_record_val - Locate the value for the current record of a cursor
+ * @cur:	the cursor, which must be set on a leaf
+ * @len:	on return, the length of the value
+ *
+ * Returns a pointer to the value.
+ */
+static void *apfs_diff_record_val(struct apfs_diff_cursor *cur, int *len)
+{
+	struct apfs_node *node = cur->nodes[0];
+	int off;
+
+	*len = apfs_node_locate_value(node, cur->index[0], &off);
+	return (void *)node->object.data + off;
+}
+
+/**
+ * apfs_diff_extent_len - Get the length of a file extent record
+ * @cur: the cursor, which must be set on a file extent record, or NULL
+ */
+static u64 apfs_diff_extent_len(struct apfs_diff_cursor *cur)
+{
+	struct apfs_file_extent_val *ext = NULL;
+	int len;
+
+	if (!cur)
+		return 0;
+	ext = apfs_diff_record_val(cur, &len);
+	if (len != sizeof(*ext))
+		return 0;
+	return le64_to_cpu(ext->len_and_flags) & APFS_FILE_EXTENT_LEN_MASK;
+}
+
+/**
+ * apfs_diff_report - Report a catalog record that changed between snapshots
+ * @ctx:	diff context
+ * @old:	cursor on the old version of the record, or NULL if none
+ * @new:	cursor on the new version of the record, or NULL if none
+ *
+ * Returns 0 on success, or -EOVERFLOW if there is no room left for the entry.
+ */
+static int apfs_diff_report(struct apfs_diff_ctx *ctx, struct apfs_diff_cursor *old, struct apfs_diff_cursor *new)
+{
+	struct apfs_key *key = old ? &old->key : &new->key;
+	struct apfs_snap_diff_entry *last = NULL, *entry = NULL;
+	u64 len;
+
+	if (ctx->filled)
+		last = &ctx->entries[ctx->filled - 1];
+
+	if (key->type == APFS_TYPE_FILE_EXTENT) {
+		len = max(apfs_diff_extent_len(old), apfs_diff_extent_len(new));
+		/* Merge contiguous ranges to keep the report short */
+		if (last && last->kind == APFS_SNAP_DIFF_EXTENT && last->id == key->id &&
+		    last->offset + last->length == key->number) {
+			last->length += len;
+			return 0;
+		}
+		if (ctx->filled == ctx->count) {
+			apfs_init_file_extent_key(key->id, key->number, &ctx->pos);
+			ctx->pos_reported = ctx->has_reported && ctx->reported_id == key->id;
+			return -EOVERFLOW;
+		}
+		entry = &ctx->entries[ctx->filled++];
+		entry->kind = APFS_SNAP_DIFF_EXTENT;
+		entry->id = key->id;
+		entry->offset = key->number;
+		entry->length = len;
+		return 0;
+	}
+
+	/* Report each object once, the inode record always comes first */
+	if (ctx->has_reported && ctx->reported_id == key->id)
+		return 0;
+	if (ctx->filled == ctx->count) {
+		/*
+		 * Start again from this record. Names are not saved, so any
+		 * records with the same id, type and number will be seen again,
+		 * but they all belong to this object, which is still unreported.
+		 */
+		ctx->pos = *key;
+		ctx->pos.name = NULL;
+		ctx->pos_reported = false;
+		return -EOVERFLOW;
+	}
+	ctx->has_reported = true;
+	ctx->reported_id = key->id;
+	entry = &ctx->entries[ctx->filled++];
+	entry->id = key->id;
+	entry->kind = APFS_SNAP_DIFF_CHANGED;
+	if (key->type == APFS_TYPE_INODE && !old)
+		entry->kind = APFS_SNAP_DIFF_CREATED;
+	else if (key->type == APFS_TYPE_INODE && !new)
+		entry->kind = APFS_SNAP_DIFF_DELETED;
+	return 0;
+}
+
+/**
+ * apfs_diff_compare_records - Compare the current records of both cursors
+ * @ctx: diff context, with both cursors set on records with the same key
+ *
+ * Returns 0 on success, or -EOVERFLOW if there is no room left for the entry.
+ */
+static int apfs_diff_compare_records(struct apfs_diff_ctx *ctx)
+{
+	void *old_val = NULL, *new_val = NULL;
+	int old_len, new_len;
+
+	old_val = apfs_diff_record_val(&ctx->old, &old_len);
+	new_val = apfs_diff_record_val(&ctx->new, &new_len);
+	if (old_len == new_len && memcmp(old_val, new_val, old_len) == 0)
+		return 0;
+	return apfs_diff_report(ctx, &ctx->old, &ctx->new);
+}
+
+/**
+ * apfs_diff_step - Make progress with the comparison of two catalogs
+ * @ctx: diff context
+ *
+ * Subtrees that are the same physical node in both snapshots are skipped right
+ * away; everything else gets compared record by record. Returns 0 on success,
+ * -EOVERFLOW if the report is full, or another negative error code in case of
+ * failure.
+ */
+static int apfs_diff_step(struct apfs_diff_ctx *ctx)
+{
+	struct apfs_diff_cursor *old = &ctx->old, *new = &ctx->new;
+	int cmp, err;
+
+	if (old->end || new->end) {
+		struct apfs_diff_cursor *cur = old->end ? new : old;
+
+		if (cur->level)
+			return apfs_diff_descend(cur);
+		err = apfs_diff_report(ctx, old->end ? NULL : old, new->end ? NULL : new);
+		if (err)
+			return err;
+		return apfs_diff_next(cur);
+	}
+
+	if (old->level && new->level) {
+		if (old->level > new->level)
+			return apfs_diff_descend(old);
+		if (new->level > old->level)
+			return apfs_diff_descend(new);
+
+		err = apfs_diff_child_bno(old);
+		if (err)
+			return err;
+		err = apfs_diff_child_bno(new);
+		if (err)
+			return err;
+		if (old->child_bno == new->child_bno) {
+			err = apfs_diff_next(old);
+			if (err)
+				return err;
+			return apfs_diff_next(new);
+		}
+	}
+
+	/*
+	 * A subtree must be opened before the other side moves past its first
+	 * key. Otherwise its key comes later than all records below the other
+	 * one, so those records can be reported already.
+	 */
+	cmp = apfs_keycmp(&old->key, &new->key);
+	if (old->level && cmp <= 0)
+		return apfs_diff_descend(old);
+	if (new->level && cmp >= 0)
+		return apfs_diff_descend(new);
+	if (cmp < 0) {
+		err = apfs_diff_report(ctx, old, NULL);
+		if (err)
+			return err;
+		return apfs_diff_next(old);
+	}
+	if (cmp > 0) {
+		err = apfs_diff_report(ctx, NULL, new);
+		if (err)
+			return err;
+		return apfs_diff_next(new);
+	}
+
+	err = apfs_diff_compare_records(ctx);
+	if (err)
+		return err;
+	err = apfs_diff_next(old);
+	if (err)
+		return err;
+	return apfs_diff_next(new);
+}
+
+/**
+ * apfs_snap_catalog_root - Find the catalog root for a snapshot
+ * @sb:		filesystem superblock
+ * @name:	name of the snapshot, or an empty string for the mounted volume
+ * @xid:	on return, transaction id for omap lookups
+ * @root_oid:	on return, object id for the root of the catalog
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_snap_catalog_root(struct super_block *sb, const char *name, u64 *xid, u64 *root_oid)
+{
+	struct apfs_sb_info *sbi = APFS_SB(sb);
+	struct apfs_superblock *vsb_raw = sbi->s_vsb_raw;
+	struct apfs_node *snap_root = NULL;
+	struct buffer_head *bh = NULL;
+	u64 sblock_oid = 0;
+	int err;
+
+	if (!*name) {
+		*xid = sbi->s_snap_xid ? sbi->s_snap_xid : -1;
+		*root_oid = le64_to_cpu(vsb_raw->apfs_root_tree_oid);
+		return 0;
+	}
+
+	snap_root = apfs_read_node(sb, le64_to_cpu(vsb_raw->apfs_snap_meta_tree_oid), APFS_OBJ_PHYSICAL, false /* write */);
+	if (IS_ERR(snap_root)) {
+		apfs_err(sb, "failed to read snap meta root 0x%llx", le64_to_cpu(vsb_raw->apfs_snap_meta_tree_oid));
+		return PTR_ERR(snap_root);
+	}
+	err = apfs_snapshot_name_to_xid(snap_root, name, xid);
+	if (err) {
+		if (err == -ENODATA) {
+			apfs_info(sb, "no snapshot under that name (%s)", name);
+			err = -ENOENT;
+		}
+		goto out;
+	}
+	err = apfs_snapshot_xid_to_sblock(snap_root, *xid, &sblock_oid);
+	if (err)
+		goto out;
+
+	bh = apfs_read_object_block(sb, sblock_oid, false /* write */, false /* preserve */);
+	if (IS_ERR(bh)) {
+		apfs_err(sb, "failed to read snapshot superblock 0x%llx", sblock_oid);
+		err = PTR_ERR(bh);
+		bh = NULL;
+		goto out;
+	}
+	vsb_raw = (struct apfs_superblock *)bh->b_data;
+	if (le32_to_cpu(vsb_raw->apfs_magic) != APFS_MAGIC) {
+		apfs_err(sb, "wrong magic in snapshot superblock 0x%llx", sblock_oid);
+		err = -EFSCORRUPTED;
+		goto out;
+	}
+	*root_oid = le64_to_cpu(vsb_raw->apfs_root_tree_oid);
+
+out:
+	brelse(bh);
+	bh = NULL;
+	apfs_node_free(snap_root);
+	snap_root = NULL;
+	return err;
+}
+
+/**
+ * apfs_do_snap_diff - Actual work for apfs_ioc_snap_diff()
+ * @sb:		filesystem superblock
+ * @arg:	ioctl argument, already copied from userland
+ * @ctx:	diff context, with the entry array already allocated
+ *
+ * Returns 0 on success, or a negative error code in case of failure.
+ */
+static int apfs_do_snap_diff(struct super_block *sb, struct apfs_ioctl_snap_diff *arg, struct apfs_diff_ctx *ctx)
+{
+	u64 old_xid, new_xid, old_root, new_root;
+	int err;
+
+	err = apfs_snap_catalog_root(sb, arg->from, &old_xid, &old_root);
+	if (err)
+		return err;
+	err = apfs_snap_catalog_root(sb, arg->to, &new_xid, &new_root);
+	if (err)
+		return err;
+	if (old_xid >= new_xid) {
+		apfs_warn(sb, "snapshots for diff are out of order");
+		return -EINVAL;
+	}
+
+	err = apfs_diff_cursor_init(sb, &ctx->old, old_root, old_xid);
+	if (err)
+		goto out;
+	err = apfs_diff_cursor_init(sb, &ctx->new, new_root, new_xid);
+	if (err)
+		goto out;
+
+	/* Starting from the root keeps more subtrees whole, so they get skipped */
+	if (arg->pos_id || arg->pos_type || arg->pos_number) {
+		ctx->pos.id = arg->pos_id;
+		ctx->pos.type = arg->pos_type;
+		ctx->pos.number = arg->pos_number;
+		ctx->pos.name = NULL;
+		/* Don't report the object a second time if the last call did */
+		if (arg->flags & APFS_SNAP_DIFF_REPORTED) {
+			ctx->has_reported = true;
+			ctx->reported_id = arg->pos_id;
+		}
+		if (!ctx->old.end)
+			err = apfs_diff_seek(&ctx->old, &ctx->pos);
+		if (!err && !ctx->new.end)
+			err = apfs_diff_seek(&ctx->new, &ctx->pos);
+		if (err)
+			goto out;
+	}
+	arg->flags = 0;
+
+	while (!ctx->old.end || !ctx->new.end) {
+		err = apfs_diff_step(ctx);
+		if (err == -EOVERFLOW) {
+			arg->pos_id = ctx->pos.id;
+			arg->pos_type = ctx->pos.type;
+			arg->pos_number = ctx->pos.number;
+			if (ctx->pos_reported)
+				arg->flags |= APFS_SNAP_DIFF_REPORTED;
+			err = 0;
+			goto out;
+		}
+		if (err) {
+			apfs_err(sb, "failed to compare catalogs");
+			goto out;
+		}
+	}
+	arg->flags |= APFS_SNAP_DIFF_DONE;
+
+out:
+	apfs_diff_cursor_release(&ctx->old);
+	apfs_diff_cursor_release(&ctx->new);
+	return err;
+}
+
+/**
+ * apfs_ioc_snap_diff - Ioctl handler for APFS_IOC_SNAP_DIFF
+ * @file:	affected file
+ * @arg:	ioctl argument
+ *
+ * Reports the inodes and file extents that changed between two snapshots, in
+ * order of object id. Big reports take several calls, each one picking up at
+ * the position saved by the one before. Returns 0 on success, or a negative
+ * error code in case of failure.
+ */
+int apfs_ioc_snap_diff(struct file *file, void __user *user_arg)
+{
+	struct inode *inode = file_inode(file);
+	struct super_block *sb = inode->i_sb;
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_ioctl_snap_diff *arg = NULL;
+	struct apfs_diff_ctx *ctx = NULL;
+	int err;
+
+	if (apfs_ino(inode) != APFS_ROOT_DIR_INO_NUM) {
+		apfs_info(sb, "snapshot diff must be requested on mountpoint");
+		return -ENOTTY;
+	}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 12, 0)
+	if (!inode_owner_or_capable(inode))
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0) && !RHEL_VERSION_GE(9, 6)
+	if (!inode_owner_or_capable(&init_user_ns, inode))
+#else
+	if (!inode_owner_or_capable(&nop_mnt_idmap, inode))
+#endif
+		return -EPERM;
+
+	arg = kzalloc(sizeof(*arg), GFP_KERNEL);
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!arg || !ctx) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	if (copy_from_user(arg, user_arg, sizeof(*arg))) {
+		err = -EFAULT;
+		goto fail;
+	}
+	if (strnlen(arg->from, sizeof(arg->from)) == sizeof(arg->from) ||
+	    strnlen(arg->to, sizeof(arg->to)) == sizeof(arg->to)) {
+		apfs_warn(sb, "snapshot name is too long");
+		err = -EINVAL;
+		goto fail;
+	}
+	if (!*arg->from || !arg->count) {
+		err = -EINVAL;
+		goto fail;
+	}
+
+	ctx->count = min_t(u32, arg->count, APFS_SNAP_DIFF_MAX_ENTRIES);
+	ctx->entries = kcalloc(ctx->count, sizeof(*ctx->entries), GFP_KERNEL);
+	if (!ctx->entries) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	down_read(&nxi->nx_big_sem);
+	err = apfs_do_snap_diff(sb, arg, ctx);
+	up_read(&nxi->nx_big_sem);
+	if (err)
+		goto fail;
+
+	arg->count = ctx->filled;
+	if (copy_to_user(u64_to_user_ptr(arg->entries), ctx->entries, ctx->filled * sizeof(*ctx->entries)) ||
+	    copy_to_user(user_arg, arg, sizeof(*arg)))
+		err = -EFAULT;
+fail:
+	if (ctx)
+		kfree(ctx->entries);
+	kfree(ctx);
+	ctx = NULL;
+	kfree(arg);
+	arg = NULL;
+	return err;
+}
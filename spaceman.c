@@ -3,8 +3,11 @@
  * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
  */
 
+#include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
+#include <linux/mount.h>
+#include <linux/rbtree.h>
 #include <linux/slab.h>
 #include "apfs.h"
 
@@ -506,6 +509,42 @@ static int apfs_ip_mark_free(struct super_block *sb, u64 bno)
  */
 static int apfs_main_free(struct super_block *sb, u64 bno);
 
+/**
+ * apfs_discard_supported - Check if the main device supports discard requests
+ * @sb:	superblock structure
+ */
+bool apfs_discard_supported(struct super_block *sb)
+{
+	struct block_device *bdev = APFS_NXI(sb)->nx_blkdev_info->blki_bdev;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 19, 0)
+	return blk_queue_discard(bdev_get_queue(bdev));
+#else
+	return bdev_max_discard_sectors(bdev) != 0;
+#endif
+}
+
+/**
+ * apfs_issue_discard - Tell the device that a range of blocks is now unused
+ * @sb:		superblock structure
+ * @bno:	first block in the range
+ * @count:	number of blocks in the range
+ *
+ * The blocks must already be free, and must not be reallocated until this
+ * returns. Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_issue_discard(struct super_block *sb, u64 bno, u64 count)
+{
+	struct block_device *bdev = APFS_NXI(sb)->nx_blkdev_info->blki_bdev;
+	int shift = sb->s_blocksize_bits - SECTOR_SHIFT;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 19, 0)
+	return blkdev_issue_discard(bdev, bno << shift, count << shift, GFP_NOFS, 0 /* flags */);
+#else
+	return blkdev_issue_discard(bdev, bno << shift, count << shift, GFP_NOFS);
+#endif
+}
+
 /**
  * apfs_flush_fq_rec - Delete a single fq record and mark its blocks as free
  * @root:	free queue root node
@@ -559,6 +598,16 @@ static int apfs_flush_fq_rec(struct apfs_node *root, u64 xid, u64 *len)
 	}
 	*len = fqrec.len;
 
+	/*
+	 * The blocks may get reallocated as soon as we return, so the discard
+	 * can't be left running in the background. A failure here is not a
+	 * problem for the filesystem though.
+	 */
+	if (APFS_NXI(sb)->nx_flags & APFS_DISCARD && !apfs_block_in_ip(sm, fqrec.bno)) {
+		if (apfs_issue_discard(sb, fqrec.bno, fqrec.len))
+			apfs_warn(sb, "discard failed for 0x%llx-0x%llx", fqrec.bno, fqrec.len);
+	}
+
 fail:
 	apfs_free_query(query);
 	return err;
@@ -587,13 +636,43 @@ static u64 apfs_free_queue_oldest_xid(struct apfs_node *root)
 }
 
 /**
- * apfs_flush_free_queue - Free ip blocks queued by old transactions
+ * apfs_free_queue_needs_flush - Check if a free queue should be flushed whole
+ * @sb:		superblock structure
+ * @qid:	queue to check
+ *
+ * Free queues are usually drained a little bit on each transaction, to avoid
+ * long stalls after large deletions. This is not good enough when we run low
+ * on space, or when the queue is getting too big.
+ */
+static bool apfs_free_queue_needs_flush(struct super_block *sb, unsigned int qid)
+{
+	struct apfs_spaceman *sm = APFS_SM(sb);
+	struct apfs_spaceman_phys *sm_raw = sm->sm_raw;
+	struct apfs_spaceman_free_queue *fq = &sm_raw->sm_fq[qid];
+	u64 count = le64_to_cpu(fq->sfq_count);
+	int maxnodes;
+
+	if (qid == APFS_SFQ_IP)
+		return count * 6 > le64_to_cpu(sm_raw->sm_ip_block_count);
+
+	if (count > APFS_TRANS_MAIN_QUEUE_MAX / 2)
+		return true;
+	if (sm->sm_free_count < APFS_TRANS_MAIN_QUEUE_MAX)
+		return true;
+	maxnodes = le16_to_cpu(fq->sfq_tree_node_limit);
+	maxnodes = (maxnodes + 1) >> 1;
+	return sm->sm_main_fq_nodes > 1 && sm->sm_main_fq_nodes >= maxnodes;
+}
+
+/**
+ * apfs_flush_free_queue - Free blocks queued by old transactions
  * @sb:		superblock structure
  * @qid:	queue to be freed
+ * @whole:	flush all old records, instead of just APFS_FQ_DRAIN_BUDGET
  *
  * Returns 0 on success or a negative error code in case of failure.
  */
-static int apfs_flush_free_queue(struct super_block *sb, unsigned int qid)
+static int apfs_flush_free_queue(struct super_block *sb, unsigned int qid, bool whole)
 {
 	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	struct apfs_spaceman *sm = APFS_SM(sb);
@@ -602,7 +681,11 @@ static int apfs_flush_free_queue(struct super_block *sb, unsigned int qid)
 	struct apfs_node *fq_root;
 	struct apfs_btree_info *fq_info = NULL;
 	u64 oldest = le64_to_cpu(fq->sfq_oldest_xid);
-	int err;
+	u64 drained = 0;
+	int err = 0;
+
+	if (!oldest || oldest == nxi->nx_xid)
+		return 0;
 
 	fq_root = apfs_read_node(sb, le64_to_cpu(fq->sfq_tree_oid),
 				 APFS_OBJ_EPHEMERAL, true /* write */);
@@ -622,7 +705,7 @@ static int apfs_flush_free_queue(struct super_block *sb, unsigned int qid)
 		if (oldest == nxi->nx_xid)
 			break;
 
-		while (true) {
+		while (whole || drained < APFS_FQ_DRAIN_BUDGET) {
 			u64 count = 0;
 
 			/* Probably not very efficient... */
@@ -635,16 +718,19 @@ static int apfs_flush_free_queue(struct super_block *sb, unsigned int qid)
 				goto fail;
 			} else {
 				le64_add_cpu(&fq->sfq_count, -count);
+				drained += count;
 			}
 		}
 		oldest = apfs_free_queue_oldest_xid(fq_root);
 		fq->sfq_oldest_xid = cpu_to_le64(oldest);
+		if (!whole && drained >= APFS_FQ_DRAIN_BUDGET)
+			break;
 	}
 
 	if (qid == APFS_SFQ_MAIN) {
 		fq_info = (void *)fq_root->object.data + sb->s_blocksize - sizeof(*fq_info);
 		sm->sm_main_fq_nodes = le64_to_cpu(fq_info->bt_node_count);
-		if (sm->sm_main_fq_nodes != 1) {
+		if (whole && sm->sm_main_fq_nodes != 1) {
 			apfs_alert(sb, "main queue wasn't flushed in full - bug!");
 			err = -EFSCORRUPTED;
 			goto fail;
@@ -657,15 +743,16 @@ fail:
 }
 
 /**
- * apfs_allocate_spaceman - Allocate an in-memory spaceman struct, if needed
+ * apfs_allocate_spaceman - Allocate and set up the in-memory spaceman struct
  * @sb:		superblock structure
  * @raw:	on-disk spaceman struct
  * @size:	size of the on-disk spaceman
  *
- * Returns the spaceman and sets it in the superblock info. Also performs all
- * initializations for the internal pool, including reading all the ip bitmaps.
- * This is a bit out of place here, but it's convenient because it has to
- * happen only once.
+ * Returns the spaceman and sets it in the superblock info. The spaceman is
+ * built only once, for the first transaction after a read-write mount, and
+ * from then on it's kept up to date by the allocation and free functions. This
+ * includes all initializations for the internal pool, and reading all the ip
+ * bitmaps.
  *
  * On failure, returns an error pointer.
  */
@@ -675,12 +762,9 @@ static struct apfs_spaceman *apfs_allocate_spaceman(struct super_block *sb, stru
 	struct apfs_spaceman *spaceman = NULL;
 	int blk_bitcnt = sb->s_blocksize * 8;
 	size_t sm_size;
-	u32 bmap_cnt;
+	u32 bmap_cnt, sm_flags;
 	int err;
 
-	if (nxi->nx_spaceman)
-		return nxi->nx_spaceman;
-
 	/* We don't expect filesystems this big, it would be like 260 TiB */
 	bmap_cnt = le32_to_cpu(raw->sm_ip_bm_size_in_blocks);
 	if (bmap_cnt > 200) {
@@ -701,101 +785,103 @@ static struct apfs_spaceman *apfs_allocate_spaceman(struct super_block *sb, stru
 	spaceman->sm_raw = raw;
 	spaceman->sm_size = size;
 
+	sm_flags = le32_to_cpu(raw->sm_flags);
+	/* Undocumented feature, but it's too common to refuse to mount */
+	if (sm_flags & APFS_SM_FLAG_VERSIONED)
+		pr_warn_once("APFS: space manager is versioned\n");
+
+	/* Only read the main device; fusion drives are not yet supported */
+	err = apfs_read_spaceman_dev(sb, &raw->sm_dev[APFS_SD_MAIN]);
+	if (err) {
+		apfs_err(sb, "failed to read main device");
+		goto fail;
+	}
+
+	spaceman->sm_blocks_per_chunk = le32_to_cpu(raw->sm_blocks_per_chunk);
+	spaceman->sm_chunks_per_cib = le32_to_cpu(raw->sm_chunks_per_cib);
+	if (spaceman->sm_chunks_per_cib > apfs_max_chunks_per_cib(sb)) {
+		apfs_err(sb, "too many chunks per cib (%u)", spaceman->sm_chunks_per_cib);
+		err = -EFSCORRUPTED;
+		goto fail;
+	}
+
 	spaceman->sm_ip_bmaps_count = bmap_cnt;
 	spaceman->sm_ip_bmaps_mask = blk_bitcnt - 1;
 	spaceman->sm_ip_bmaps_shift = order_base_2(blk_bitcnt);
 
-	/* This must happen only once, so it's easier to just leave it here */
 	err = apfs_read_ip_bitmaps(sb);
 	if (err) {
 		apfs_err(sb, "failed to read the ip bitmaps");
-		kfree(spaceman);
-		nxi->nx_spaceman = spaceman = NULL;
-		return ERR_PTR(err);
+		goto fail;
 	}
 
 	return nxi->nx_spaceman;
+
+fail:
+	kfree(spaceman);
+	nxi->nx_spaceman = spaceman = NULL;
+	return ERR_PTR(err);
 }
 
 /**
- * apfs_read_spaceman - Find and read the space manager
+ * apfs_read_spaceman - Prepare the space manager for a new transaction
  * @sb: superblock structure
  *
- * Reads the space manager structure from disk and initializes its in-memory
- * counterpart; returns 0 on success, or a negative error code in case of
- * failure.
+ * Sets up the in-memory space manager on the first call, and then only does
+ * the little work that is needed on each new xid: updating the object header
+ * and draining the free queues. Returns 0 on success, or a negative error code
+ * in case of failure.
  */
 int apfs_read_spaceman(struct super_block *sb)
 {
 	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	struct apfs_nx_superblock *raw_sb = nxi->nx_raw;
-	struct apfs_spaceman *spaceman = NULL;
+	struct apfs_spaceman *spaceman = nxi->nx_spaceman;
 	struct apfs_ephemeral_object_info *sm_eph_info = NULL;
 	struct apfs_spaceman_phys *sm_raw;
-	u32 sm_flags;
 	u64 oid = le64_to_cpu(raw_sb->nx_spaceman_oid);
 	int err;
 
 	if (sb->s_flags & SB_RDONLY) /* The space manager won't be needed */
 		return 0;
 
-	sm_eph_info = apfs_ephemeral_object_lookup(sb, oid);
-	if (IS_ERR(sm_eph_info)) {
-		apfs_err(sb, "no spaceman object for oid 0x%llx", oid);
-		return PTR_ERR(sm_eph_info);
-	}
-	sm_raw = (struct apfs_spaceman_phys *)sm_eph_info->object;
-	sm_raw->sm_o.o_xid = cpu_to_le64(nxi->nx_xid);
-
-	spaceman = apfs_allocate_spaceman(sb, sm_raw, sm_eph_info->size);
-	if (IS_ERR(spaceman)) {
-		apfs_err(sb, "failed to allocate spaceman");
-		err = PTR_ERR(spaceman);
-		goto fail;
-	}
-
-	spaceman->sm_free_cache_base = spaceman->sm_free_cache_blkcnt = 0;
-
-	sm_flags = le32_to_cpu(sm_raw->sm_flags);
-	/* Undocumented feature, but it's too common to refuse to mount */
-	if (sm_flags & APFS_SM_FLAG_VERSIONED)
-		pr_warn_once("APFS: space manager is versioned\n");
+	if (!spaceman) {
+		/* Ephemeral objects stay in memory, so this won't move */
+		sm_eph_info = apfs_ephemeral_object_lookup(sb, oid);
+		if (IS_ERR(sm_eph_info)) {
+			apfs_err(sb, "no spaceman object for oid 0x%llx", oid);
+			return PTR_ERR(sm_eph_info);
+		}
+		sm_raw = (struct apfs_spaceman_phys *)sm_eph_info->object;
 
-	/* Only read the main device; fusion drives are not yet supported */
-	err = apfs_read_spaceman_dev(sb, &sm_raw->sm_dev[APFS_SD_MAIN]);
-	if (err) {
-		apfs_err(sb, "failed to read main device");
-		goto fail;
+		spaceman = apfs_allocate_spaceman(sb, sm_raw, sm_eph_info->size);
+		if (IS_ERR(spaceman)) {
+			apfs_err(sb, "failed to allocate spaceman");
+			return PTR_ERR(spaceman);
+		}
 	}
+	sm_raw = spaceman->sm_raw;
+	sm_raw->sm_o.o_xid = cpu_to_le64(nxi->nx_xid);
 
-	spaceman->sm_blocks_per_chunk =
-				le32_to_cpu(sm_raw->sm_blocks_per_chunk);
-	spaceman->sm_chunks_per_cib = le32_to_cpu(sm_raw->sm_chunks_per_cib);
-	if (spaceman->sm_chunks_per_cib > apfs_max_chunks_per_cib(sb)) {
-		apfs_err(sb, "too many chunks per cib (%u)", spaceman->sm_chunks_per_cib);
-		err = -EFSCORRUPTED;
-		goto fail;
-	}
+	/* The cache gets flushed on commit, so this should be a no-op */
+	apfs_free_queue_drop_cache(spaceman);
 
 	/*
-	 * We flush free queues whole when each transaction begins, to make it
-	 * harder for the btrees to become too unbalanced.
+	 * Each new transaction drains a bounded number of blocks from the
+	 * free queues, so that a big deletion doesn't stall the next few
+	 * writes. The queues are only flushed whole when under pressure.
 	 */
-	err = apfs_flush_free_queue(sb, APFS_SFQ_IP);
+	err = apfs_flush_free_queue(sb, APFS_SFQ_IP, apfs_free_queue_needs_flush(sb, APFS_SFQ_IP));
 	if (err) {
 		apfs_err(sb, "failed to flush ip fq");
-		goto fail;
+		return err;
 	}
-	err = apfs_flush_free_queue(sb, APFS_SFQ_MAIN);
+	err = apfs_flush_free_queue(sb, APFS_SFQ_MAIN, apfs_free_queue_needs_flush(sb, APFS_SFQ_MAIN));
 	if (err) {
 		apfs_err(sb, "failed to flush main fq");
-		goto fail;
+		return err;
 	}
 	return 0;
-
-fail:
-	spaceman->sm_raw = NULL;
-	return err;
 }
 
 /**
@@ -854,15 +940,22 @@ static u64 apfs_ip_find_free(struct super_block *sb)
  * @sb:		superblock structure
  * @bitmap:	allocation bitmap for the chunk, which should have free blocks
  * @addr:	number of the first block in the chunk
+ * @goal:	preferred block number, or 0 for none
  *
- * Returns the block number for a free block, or 0 in case of corruption.
+ * Returns the block number for a free block, or 0 in case of corruption. The
+ * search starts at @goal if it belongs to the chunk.
  */
-static u64 apfs_chunk_find_free(struct super_block *sb, char *bitmap, u64 addr)
+static u64 apfs_chunk_find_free(struct super_block *sb, char *bitmap, u64 addr, u64 goal)
 {
 	int bitcount = sb->s_blocksize * 8;
-	u64 bno;
+	u64 bno, start = 0;
+
+	if (goal > addr && goal < addr + bitcount)
+		start = goal - addr;
 
-	bno = find_next_zero_bit_le(bitmap, bitcount, 0 /* offset */);
+	bno = find_next_zero_bit_le(bitmap, bitcount, start);
+	if (bno >= bitcount && start)
+		bno = find_next_zero_bit_le(bitmap, start, 0 /* offset */);
 	if (bno >= bitcount)
 		return 0;
 	return addr + bno;
@@ -989,10 +1082,6 @@ static int apfs_free_queue_try_insert(struct super_block *sb, u64 bno, u64 count
 		goto fail;
 	}
 
-	if (!fq->sfq_oldest_xid)
-		fq->sfq_oldest_xid = cpu_to_le64(nxi->nx_xid);
-	le64_add_cpu(&fq->sfq_count, count);
-
 	if (qid == APFS_SFQ_MAIN)
 		sm->sm_main_fq_nodes = le64_to_cpu(fq_info->bt_node_count);
 
@@ -1002,6 +1091,30 @@ fail:
 	return err;
 }
 
+/**
+ * apfs_free_queue_account - Update the block count for a free queue
+ * @sb:		superblock structure
+ * @bno:	first block number to free
+ * @count:	number of consecutive blocks to free
+ *
+ * Freed blocks are counted as soon as they are queued, even if they are still
+ * in the cache, so that the transaction heuristics can rely on the count.
+ */
+static void apfs_free_queue_account(struct super_block *sb, u64 bno, u64 count)
+{
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_spaceman *sm = APFS_SM(sb);
+	struct apfs_spaceman_free_queue *fq;
+	unsigned int qid;
+
+	qid = apfs_block_in_ip(sm, bno) ? APFS_SFQ_IP : APFS_SFQ_MAIN;
+	fq = &sm->sm_raw->sm_fq[qid];
+
+	if (!fq->sfq_oldest_xid)
+		fq->sfq_oldest_xid = cpu_to_le64(nxi->nx_xid);
+	le64_add_cpu(&fq->sfq_count, count);
+}
+
 /**
  * apfs_free_queue_insert_nocache - Add a block range to its free queue
  * @sb:		superblock structure
@@ -1009,11 +1122,12 @@ fail:
  * @count:	number of consecutive blocks to free
  *
  * Same as apfs_free_queue_insert(), but writes to the free queue directly,
- * bypassing the cache of the latest freed block range.
+ * bypassing the cache of freed block ranges. The caller is responsible for
+ * calling apfs_free_queue_account().
  *
  * Returns 0 on success or a negative error code in case of failure.
  */
-int apfs_free_queue_insert_nocache(struct super_block *sb, u64 bno, u64 count)
+static int apfs_free_queue_insert_nocache(struct super_block *sb, u64 bno, u64 count)
 {
 	unsigned int qid;
 	int err;
@@ -1031,61 +1145,158 @@ int apfs_free_queue_insert_nocache(struct super_block *sb, u64 bno, u64 count)
 	return 0;
 }
 
+/*
+ * A range of freed blocks in the cache, waiting to be put in its free queue
+ */
+struct apfs_free_range {
+	struct rb_node	fr_node;
+	u64		fr_bno;		/* First block in the range */
+	u64		fr_count;	/* Number of blocks in the range */
+};
+
 /**
  * apfs_free_queue_insert - Add a block range to its free queue
  * @sb:		superblock structure
  * @bno:	first block number to free
  * @count:	number of consecutive blocks to free
  *
- * Uses a cache to delay the actual tree operations as much as possible.
+ * Uses a cache to delay the actual tree operations until the transaction
+ * commits, so that adjacent ranges can be merged into a single record even if
+ * they are not freed in order.
  *
  * Returns 0 on success or a negative error code in case of failure.
  */
 int apfs_free_queue_insert(struct super_block *sb, u64 bno, u64 count)
 {
 	struct apfs_spaceman *sm = APFS_SM(sb);
-	int err;
+	struct rb_node **p = &sm->sm_free_cache.rb_node, *parent = NULL;
+	struct apfs_free_range *range = NULL, *prev = NULL, *next = NULL;
+	bool in_ip = apfs_block_in_ip(sm, bno);
+
+	while (*p) {
+		parent = *p;
+		range = rb_entry(parent, struct apfs_free_range, fr_node);
+		if (bno < range->fr_bno) {
+			next = range;
+			p = &parent->rb_left;
+		} else if (bno >= range->fr_bno + range->fr_count) {
+			prev = range;
+			p = &parent->rb_right;
+		} else {
+			break;
+		}
+	}
+	if (*p || (next && bno + count > next->fr_bno)) {
+		apfs_alert(sb, "range 0x%llx-0x%llx was already freed", bno, count);
+		return -EFSCORRUPTED;
+	}
 
-	if (sm->sm_free_cache_base == 0) {
-		/* Nothing yet cached */
-		sm->sm_free_cache_base = bno;
-		sm->sm_free_cache_blkcnt = count;
+	apfs_free_queue_account(sb, bno, count);
+
+	/* Never merge ranges that don't belong to a single free queue */
+	if (prev && (prev->fr_bno + prev->fr_count != bno || apfs_block_in_ip(sm, prev->fr_bno) != in_ip))
+		prev = NULL;
+	if (next && (bno + count != next->fr_bno || apfs_block_in_ip(sm, next->fr_bno) != in_ip))
+		next = NULL;
+
+	if (prev) {
+		prev->fr_count += count;
+		if (next) {
+			prev->fr_count += next->fr_count;
+			rb_erase(&next->fr_node, &sm->sm_free_cache);
+			kfree(next);
+			--sm->sm_free_cache_count;
+		}
+		return 0;
+	}
+	if (next) {
+		next->fr_bno = bno;
+		next->fr_count += count;
 		return 0;
 	}
 
-	/*
-	 * First attempt to extend the cache of freed blocks, but never cache
-	 * a range that doesn't belong to a single free queue.
-	 */
-	if (apfs_block_in_ip(sm, bno) == apfs_block_in_ip(sm, sm->sm_free_cache_base)) {
-		if (bno == sm->sm_free_cache_base + sm->sm_free_cache_blkcnt) {
-			sm->sm_free_cache_blkcnt += count;
-			return 0;
-		}
-		if (bno + count == sm->sm_free_cache_base) {
-			sm->sm_free_cache_base -= count;
-			sm->sm_free_cache_blkcnt += count;
-			return 0;
-		}
+	range = kmalloc(sizeof(*range), GFP_KERNEL);
+	if (!range) {
+		/* The cache is just an optimization, so don't fail over it */
+		return apfs_free_queue_insert_nocache(sb, bno, count);
 	}
+	range->fr_bno = bno;
+	range->fr_count = count;
+	rb_link_node(&range->fr_node, parent, p);
+	rb_insert_color(&range->fr_node, &sm->sm_free_cache);
+	++sm->sm_free_cache_count;
+	return 0;
+}
 
-	/* Failed to extend the cache, so flush it and replace it */
-	err = apfs_free_queue_insert_nocache(sb, sm->sm_free_cache_base, sm->sm_free_cache_blkcnt);
-	if (err) {
-		apfs_err(sb, "fq cache flush failed (0x%llx-0x%llx)", sm->sm_free_cache_base, sm->sm_free_cache_blkcnt);
-		return err;
+/**
+ * apfs_free_queue_flush_cache - Put all cached freed ranges in the free queues
+ * @sb:	superblock structure
+ *
+ * The ranges are inserted in order, so the free queue records get appended
+ * one after the other. Returns 0 on success or a negative error code in case
+ * of failure.
+ */
+int apfs_free_queue_flush_cache(struct super_block *sb)
+{
+	struct apfs_spaceman *sm = APFS_SM(sb);
+	struct apfs_free_range *range = NULL;
+	struct rb_node *node = NULL;
+	int err;
+
+	while ((node = rb_first(&sm->sm_free_cache))) {
+		range = rb_entry(node, struct apfs_free_range, fr_node);
+		rb_erase(node, &sm->sm_free_cache);
+		--sm->sm_free_cache_count;
+
+		err = apfs_free_queue_insert_nocache(sb, range->fr_bno, range->fr_count);
+		if (err) {
+			apfs_err(sb, "fq cache flush failed (0x%llx-0x%llx)", range->fr_bno, range->fr_count);
+			kfree(range);
+			return err;
+		}
+		kfree(range);
 	}
-	sm->sm_free_cache_base = bno;
-	sm->sm_free_cache_blkcnt = count;
 	return 0;
 }
 
+/**
+ * apfs_free_queue_drop_cache - Discard all cached freed ranges
+ * @sm:	in-memory spaceman structure
+ */
+void apfs_free_queue_drop_cache(struct apfs_spaceman *sm)
+{
+	struct apfs_free_range *range = NULL, *tmp = NULL;
+
+	rbtree_postorder_for_each_entry_safe(range, tmp, &sm->sm_free_cache, fr_node)
+		kfree(range);
+	sm->sm_free_cache = RB_ROOT;
+	sm->sm_free_cache_count = 0;
+}
+
+/**
+ * apfs_free_queue_cache_nodes - Estimate free queue growth from the cache
+ * @sb:	superblock structure
+ *
+ * Returns the number of nodes that flushing the cache of freed ranges may add
+ * to the free queues, assuming the worst case of half-full leaves.
+ */
+u64 apfs_free_queue_cache_nodes(struct super_block *sb)
+{
+	struct apfs_spaceman *sm = APFS_SM(sb);
+	u32 recsz, per_node;
+
+	recsz = sizeof(struct apfs_kvoff) + sizeof(struct apfs_spaceman_free_queue_key) + sizeof(__le64);
+	per_node = (sb->s_blocksize - sizeof(struct apfs_btree_node_phys)) / recsz;
+	per_node = max(per_node >> 1, 1U);
+	return DIV_ROUND_UP(sm->sm_free_cache_count, per_node);
+}
+
 /**
  * apfs_chunk_alloc_free - Allocate or free block in given CIB and chunk
  * @sb:		superblock structure
  * @cib_bh:	buffer head for the chunk-info block
  * @index:	index of this chunk's info structure inside @cib
- * @bno:	block number
+ * @bno:	block number (on allocation, the preferred block number or 0)
  * @is_alloc:	true to allocate, false to free
  */
 static int apfs_chunk_alloc_free(struct super_block *sb,
@@ -1221,7 +1432,7 @@ static int apfs_chunk_alloc_free(struct super_block *sb,
 
 	/* Finally, allocate / free the actual block that was requested */
 	if (is_alloc) {
-		*bno = apfs_chunk_find_free(sb, bmap, le64_to_cpu(ci->ci_addr));
+		*bno = apfs_chunk_find_free(sb, bmap, le64_to_cpu(ci->ci_addr), *bno);
 		if (!*bno) {
 			apfs_err(sb, "no free blocks in chunk");
 			err = -EFSCORRUPTED;
@@ -1250,7 +1461,7 @@ fail:
  * @sb:		superblock structure
  * @cib_bh:	buffer head for the chunk-info block
  * @index:	index of this chunk's info structure inside @cib
- * @bno:	on return, the allocated block number
+ * @bno:	preferred block number, or 0; on return, the allocated block
  *
  * Finds a free block in the chunk and marks it as used; the buffer at @cib_bh
  * may be replaced if needed for copy-on-write.  Returns 0 on success, or a
@@ -1269,13 +1480,16 @@ static int apfs_chunk_allocate_block(struct super_block *sb,
  * @cib_bh:	buffer head for the chunk-info block
  * @bno:	on return, the allocated block number
  * @backwards:	start the search on the last chunk
+ * @goal:	preferred block number, or 0 for none
+ * @start:	index of the first chunk to check (ignored for @backwards)
  *
- * Finds a free block among all the chunks in the cib and marks it as used; the
+ * Finds a free block among the chunks in the cib and marks it as used; the
  * buffer at @cib_bh may be replaced if needed for copy-on-write.  Returns 0 on
  * success, or a negative error code in case of failure.
  */
 static int apfs_cib_allocate_block(struct super_block *sb,
-				   struct buffer_head **cib_bh, u64 *bno, bool backwards)
+				   struct buffer_head **cib_bh, u64 *bno, bool backwards,
+				   u64 goal, u32 start)
 {
 	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	struct apfs_spaceman *sm = APFS_SM(sb);
@@ -1296,12 +1510,15 @@ static int apfs_cib_allocate_block(struct super_block *sb,
 		return -EFSCORRUPTED;
 	}
 
-	for (i = 0; i < chunk_count; ++i) {
+	if (backwards)
+		start = 0;
+	for (i = start; i < chunk_count; ++i) {
 		int index;
 		int err;
 
 		index = backwards ? chunk_count - 1 - i : i;
 
+		*bno = goal;
 		err = apfs_chunk_allocate_block(sb, cib_bh, index, bno);
 		if (err == -ENOSPC) /* This chunk is full */
 			continue;
@@ -1312,6 +1529,46 @@ static int apfs_cib_allocate_block(struct super_block *sb,
 	return -ENOSPC;
 }
 
+/**
+ * apfs_spaceman_allocate_from_cib - Allocate a single block from a given cib
+ * @sb:		superblock structure
+ * @index:	index of the cib
+ * @bno:	on return, the allocated block number
+ * @backwards:	start the search on the last chunk
+ * @goal:	preferred block number, or 0 for none
+ * @start:	index of the first chunk to check (ignored for @backwards)
+ *
+ * Returns 0 on success, or a negative error code in case of failure, which
+ * will be -ENOSPC if the cib has no free blocks left.
+ */
+static int apfs_spaceman_allocate_from_cib(struct super_block *sb, u32 index, u64 *bno,
+					   bool backwards, u64 goal, u32 start)
+{
+	struct apfs_spaceman *sm = APFS_SM(sb);
+	struct buffer_head *cib_bh;
+	u64 cib_bno;
+	int err;
+
+	cib_bno = apfs_spaceman_read_cib_addr(sb, index);
+	cib_bh = apfs_sb_bread(sb, cib_bno);
+	if (!cib_bh) {
+		apfs_err(sb, "failed to read cib");
+		return -EIO;
+	}
+
+	err = apfs_cib_allocate_block(sb, &cib_bh, bno, backwards, goal, start);
+	if (!err) {
+		/* The cib may have been moved */
+		apfs_spaceman_write_cib_addr(sb, index, cib_bh->b_blocknr);
+		/* The free block count has changed */
+		apfs_write_spaceman(sm);
+	}
+	brelse(cib_bh);
+	if (err && err != -ENOSPC)
+		apfs_err(sb, "error during allocation");
+	return err;
+}
+
 /**
  * apfs_spaceman_allocate_block - Allocate a single on-disk block
  * @sb:		superblock structure
@@ -1327,33 +1584,15 @@ int apfs_spaceman_allocate_block(struct super_block *sb, u64 *bno, bool backward
 	int i;
 
 	for (i = 0; i < sm->sm_cib_count; ++i) {
-		struct buffer_head *cib_bh;
-		u64 cib_bno;
 		int index;
 		int err;
 
 		/* Keep extents and metadata separate to limit fragmentation */
 		index = backwards ? sm->sm_cib_count - 1 - i : i;
 
-		cib_bno = apfs_spaceman_read_cib_addr(sb, index);
-		cib_bh = apfs_sb_bread(sb, cib_bno);
-		if (!cib_bh) {
-			apfs_err(sb, "failed to read cib");
-			return -EIO;
-		}
-
-		err = apfs_cib_allocate_block(sb, &cib_bh, bno, backwards);
-		if (!err) {
-			/* The cib may have been moved */
-			apfs_spaceman_write_cib_addr(sb, index, cib_bh->b_blocknr);
-			/* The free block count has changed */
-			apfs_write_spaceman(sm);
-		}
-		brelse(cib_bh);
+		err = apfs_spaceman_allocate_from_cib(sb, index, bno, backwards, 0 /* goal */, 0 /* start */);
 		if (err == -ENOSPC) /* This cib is full */
 			continue;
-		if (err)
-			apfs_err(sb, "error during allocation");
 		return err;
 	}
 	/*
@@ -1364,6 +1603,60 @@ int apfs_spaceman_allocate_block(struct super_block *sb, u64 *bno, bool backward
 	return -ENOSPC;
 }
 
+/**
+ * apfs_spaceman_allocate_block_near - Allocate a single block close to a goal
+ * @sb:		superblock structure
+ * @goal:	preferred block number, or 0 to use the allocation cursor
+ * @bno:	on return, the allocated block number
+ *
+ * Like apfs_spaceman_allocate_block() for data blocks, but the search starts
+ * at the chunk for @goal and moves forward from there, wrapping around at the
+ * end of the container. This keeps each file close to its previous extents,
+ * even with several concurrent writers. Returns 0 on success, or a negative
+ * error code in case of failure.
+ */
+int apfs_spaceman_allocate_block_near(struct super_block *sb, u64 goal, u64 *bno)
+{
+	struct apfs_spaceman *sm = APFS_SM(sb);
+	u64 cib_idx, chunk_idx;
+	u32 i;
+	int err;
+
+	if (!goal)
+		goal = sm->sm_data_cursor;
+	if (!goal || goal >= sm->sm_block_count || apfs_block_in_ip(sm, goal) ||
+	    !sm->sm_blocks_per_chunk || !sm->sm_chunks_per_cib)
+		return apfs_spaceman_allocate_block(sb, bno, false /* backwards */);
+
+	/* TODO: use bitshifts instead of do_div() */
+	chunk_idx = goal;
+	do_div(chunk_idx, sm->sm_blocks_per_chunk);
+	cib_idx = chunk_idx;
+	chunk_idx = do_div(cib_idx, sm->sm_chunks_per_cib);
+	if (cib_idx >= sm->sm_cib_count)
+		return apfs_spaceman_allocate_block(sb, bno, false /* backwards */);
+
+	/*
+	 * The goal cib gets checked twice: first from the goal chunk onwards,
+	 * and at the end from the start, after wrapping around.
+	 */
+	for (i = 0; i <= sm->sm_cib_count; ++i) {
+		u32 index = (cib_idx + i) % sm->sm_cib_count;
+
+		if (i == 0)
+			err = apfs_spaceman_allocate_from_cib(sb, index, bno, false /* backwards */, goal, chunk_idx);
+		else
+			err = apfs_spaceman_allocate_from_cib(sb, index, bno, false /* backwards */, 0 /* goal */, 0 /* start */);
+		if (err == -ENOSPC) /* This cib is full */
+			continue;
+		if (!err)
+			sm->sm_data_cursor = *bno + 1;
+		return err;
+	}
+	apfs_err(sb, "ran out of space during transaction");
+	return -ENOSPC;
+}
+
 /**
  * apfs_chunk_free - Mark a regular block as free given CIB and chunk
  * @sb:		superblock structure
@@ -1477,3 +1770,259 @@ int apfs_spaceman_get_free_blkcnt(struct super_block *sb, u64 *blkcnt)
 	*blkcnt += le64_to_cpu(dev->sm_free_count);
 	return 0;
 }
+
+/*
+ * State for a FITRIM request, with all block ranges in blocks
+ */
+struct apfs_trim_ctx {
+	u64 start;	/* First block to trim */
+	u64 end;	/* First block past the trimmed range */
+	u64 minlen;	/* Shortest free range worth discarding */
+	u64 run_bno;	/* First block of the free run being collected */
+	u64 run_len;	/* Length of the free run being collected */
+	u64 trimmed;	/* Number of blocks discarded so far */
+};
+
+/**
+ * apfs_trim_flush_run - Discard the free run collected so far, if long enough
+ * @sb:		superblock structure
+ * @ctx:	trim request state
+ *
+ * Returns 0 on success or a negative error code in case of failure.
+ */
+static int apfs_trim_flush_run(struct super_block *sb, struct apfs_trim_ctx *ctx)
+{
+	int err;
+
+	if (ctx->run_len && ctx->run_len >= ctx->minlen) {
+		err = apfs_issue_discard(sb, ctx->run_bno, ctx->run_len);
+		if (err) {
+			apfs_err(sb, "discard failed for 0x%llx-0x%llx", ctx->run_bno, ctx->run_len);
+			return err;
+		}
+		ctx->trimmed += ctx->run_len;
+	}
+	ctx->run_len = 0;
+	return 0;
+}
+
+/**
+ * apfs_trim_add_run - Add a range of free blocks to a trim request
+ * @sb:		superblock structure
+ * @ctx:	trim request state
+ * @bno:	first free block
+ * @count:	number of free blocks
+ *
+ * Adjacent ranges are merged so that they can be discarded together. Returns
+ * 0 on success or a negative error code in case of failure.
+ */
+static int apfs_trim_add_run(struct super_block *sb, struct apfs_trim_ctx *ctx, u64 bno, u64 count)
+{
+	u64 last = bno + count;
+	int err;
+
+	bno = max(bno, ctx->start);
+	last = min(last, ctx->end);
+	if (bno >= last)
+		return 0;
+
+	if (ctx->run_len && ctx->run_bno + ctx->run_len == bno) {
+		ctx->run_len += last - bno;
+		return 0;
+	}
+	err = apfs_trim_flush_run(sb, ctx);
+	if (err)
+		return err;
+	ctx->run_bno = bno;
+	ctx->run_len = last - bno;
+	return 0;
+}
+
+/**
+ * apfs_trim_cib - Discard the free blocks for all chunks in a cib
+ * @sb:		superblock structure
+ * @index:	index of the cib
+ * @ctx:	trim request state
+ *
+ * Must be called with the big lock held, at least for reading, so that none of
+ * the free blocks can get allocated before they are discarded. Returns 0 on
+ * success or a negative error code in case of failure.
+ */
+static int apfs_trim_cib(struct super_block *sb, u32 index, struct apfs_trim_ctx *ctx)
+{
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_spaceman *sm = APFS_SM(sb);
+	struct apfs_chunk_info_block *cib = NULL;
+	struct buffer_head *cib_bh = NULL, *bmap_bh = NULL;
+	u32 bitcount = sb->s_blocksize * 8;
+	u32 chunk_count, i;
+	int err = 0;
+
+	cib_bh = apfs_sb_bread(sb, apfs_spaceman_read_cib_addr(sb, index));
+	if (!cib_bh) {
+		apfs_err(sb, "failed to read cib");
+		return -EIO;
+	}
+	if (nxi->nx_flags & APFS_CHECK_NODES && !apfs_obj_verify_csum(sb, cib_bh)) {
+		apfs_err(sb, "bad checksum for chunk-info block");
+		err = -EFSBADCRC;
+		goto out;
+	}
+	cib = (struct apfs_chunk_info_block *)cib_bh->b_data;
+
+	/* Avoid out-of-bounds operations on corrupted cibs */
+	chunk_count = le32_to_cpu(cib->cib_chunk_info_count);
+	if (chunk_count > sm->sm_chunks_per_cib) {
+		apfs_err(sb, "too many chunks in cib (%u)", chunk_count);
+		err = -EFSCORRUPTED;
+		goto out;
+	}
+
+	for (i = 0; i < chunk_count; ++i) {
+		struct apfs_chunk_info *ci = &cib->cib_chunk_info[i];
+		u64 addr = le64_to_cpu(ci->ci_addr);
+		u32 blkcnt = le32_to_cpu(ci->ci_block_count);
+		unsigned long bit, next;
+		char *bmap = NULL;
+
+		if (blkcnt > bitcount) {
+			apfs_err(sb, "too many blocks in chunk (%u)", blkcnt);
+			err = -EFSCORRUPTED;
+			goto out;
+		}
+		if (!ci->ci_free_count || addr >= ctx->end || addr + blkcnt <= ctx->start)
+			continue;
+
+		/* No bitmap means that all blocks in the chunk are free */
+		if (!ci->ci_bitmap_addr) {
+			err = apfs_trim_add_run(sb, ctx, addr, blkcnt);
+			if (err)
+				goto out;
+			continue;
+		}
+
+		bmap_bh = apfs_sb_bread(sb, le64_to_cpu(ci->ci_bitmap_addr));
+		if (!bmap_bh) {
+			apfs_err(sb, "failed to read bitmap block");
+			err = -EIO;
+			goto out;
+		}
+		bmap = bmap_bh->b_data;
+
+		bit = find_next_zero_bit_le(bmap, blkcnt, 0 /* offset */);
+		while (bit < blkcnt) {
+			next = find_next_bit_le(bmap, blkcnt, bit);
+			err = apfs_trim_add_run(sb, ctx, addr + bit, next - bit);
+			if (err)
+				goto out;
+			if (next >= blkcnt)
+				break;
+			bit = find_next_zero_bit_le(bmap, blkcnt, next);
+		}
+		brelse(bmap_bh);
+		bmap_bh = NULL;
+	}
+
+	/* Other transactions may allocate these blocks once we are done here */
+	err = apfs_trim_flush_run(sb, ctx);
+
+out:
+	brelse(bmap_bh);
+	brelse(cib_bh);
+	return err;
+}
+
+/**
+ * apfs_ioc_trim - Ioctl handler for FITRIM
+ * @file:	affected file
+ * @arg:	ioctl argument
+ *
+ * Discards all free blocks in the requested range of the container. Nothing
+ * gets modified, so the bitmaps are walked with the big lock held only for
+ * reading, and it gets released between chunk-info blocks so that transactions
+ * are not blocked for too long. Returns 0 on success, or a negative error code
+ * in case of failure.
+ */
+int apfs_ioc_trim(struct file *file, void __user *user_arg)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
+	struct apfs_spaceman *sm = NULL;
+	struct apfs_trim_ctx ctx = {0};
+	struct fstrim_range range;
+	u64 cib_idx, len;
+	bool first = true;
+	int err;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (!apfs_discard_supported(sb))
+		return -EOPNOTSUPP;
+	if (copy_from_user(&range, user_arg, sizeof(range)))
+		return -EFAULT;
+
+	ctx.start = range.start >> sb->s_blocksize_bits;
+	len = range.len >> sb->s_blocksize_bits;
+	ctx.end = len > U64_MAX - ctx.start ? U64_MAX : ctx.start + len;
+	ctx.minlen = max_t(u64, 1, DIV_ROUND_UP(range.minlen, sb->s_blocksize));
+
+	err = mnt_want_write_file(file);
+	if (err)
+		return err;
+
+	/* The space manager is only set up by the first transaction */
+	if (!APFS_SM(sb)) {
+		err = apfs_transaction_start(sb, APFS_TRANS_REG);
+		if (err)
+			goto out;
+		err = apfs_transaction_commit(sb);
+		if (err) {
+			apfs_transaction_abort(sb);
+			goto out;
+		}
+	}
+
+	for (cib_idx = 0;; ++cib_idx) {
+		down_read(&nxi->nx_big_sem);
+		sm = APFS_SM(sb);
+
+		if (!sm->sm_blocks_per_chunk || !sm->sm_chunks_per_cib) {
+			up_read(&nxi->nx_big_sem);
+			apfs_err(sb, "block or chunk count not set");
+			err = -EFSCORRUPTED;
+			goto out;
+		}
+		if (first) {
+			/* TODO: use bitshifts instead of do_div() */
+			cib_idx = ctx.start;
+			do_div(cib_idx, sm->sm_blocks_per_chunk);
+			do_div(cib_idx, sm->sm_chunks_per_cib);
+			first = false;
+		}
+		if (cib_idx >= sm->sm_cib_count || ctx.start >= sm->sm_block_count) {
+			up_read(&nxi->nx_big_sem);
+			break;
+		}
+
+		err = apfs_trim_cib(sb, cib_idx, &ctx);
+		up_read(&nxi->nx_big_sem);
+		if (err)
+			break;
+
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			break;
+		}
+		cond_resched();
+	}
+
+out:
+	mnt_drop_write_file(file);
+	if (err)
+		return err;
+
+	range.len = ctx.trimmed << sb->s_blocksize_bits;
+	if (copy_to_user(user_arg, &range, sizeof(range)))
+		return -EFAULT;
+	return 0;
+}
@@ -14,6 +14,7 @@
 #include <linux/statfs.h>
 #include <linux/seq_file.h>
 #include "apfs.h"
+#include "unicode.h"
 #include "version.h"
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(7, 0, 0)
 #include <linux/fs_context.h>
@@ -501,6 +502,7 @@ static inline void apfs_free_main_super(struct apfs_sb_info *sbi)
 	list_del(&nxi->nx_list);
 	sm = nxi->nx_spaceman;
 	if (sm) {
+		apfs_free_queue_drop_cache(sm);
 		for (bmap_idx = 0; bmap_idx < sm->sm_ip_bmaps_count; ++bmap_idx) {
 			kfree(sm->sm_ip_bmaps[bmap_idx].block);
 			sm->sm_ip_bmaps[bmap_idx].block = NULL;
@@ -699,7 +701,6 @@ static struct apfs_omap *apfs_get_omap(struct super_block *sb)
 	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	struct apfs_sb_info *curr = NULL;
 	struct apfs_omap *omap = NULL;
-	struct apfs_omap_cache *cache = NULL;
 
 	lockdep_assert_held(&nxs_mutex);
 
@@ -716,10 +717,8 @@ static struct apfs_omap *apfs_get_omap(struct super_block *sb)
 				 */
 				continue;
 			}
-			cache = &omap->omap_cache;
+			/* The cache records are xid-aware, so share them too */
 			++omap->omap_refcnt;
-			/* Right now the cache can't be shared like this */
-			cache->disabled = true;
 			return omap;
 		}
 	}
@@ -910,6 +909,7 @@ static void apfs_put_super(struct super_block *sb)
 
 	/* Cleanups won't reschedule themselves during unmount */
 	flush_work(&sbi->s_orphan_cleanup_work);
+	flush_work(&sbi->s_reaper_work);
 
 	/* We are about to commit anyway */
 	trans = &APFS_NXI(sb)->nx_transaction;
@@ -994,6 +994,11 @@ static struct inode *apfs_alloc_inode(struct super_block *sb)
 	ai->i_nchildren = 0;
 	INIT_LIST_HEAD(&ai->i_list);
 	ai->i_cleaned = false;
+	ai->i_inplace = false;
+	ai->i_dir_stats_id = 0;
+	ai->i_acct_parent = 0;
+	ai->i_acct_stats = 0;
+	ai->i_acct_size = 0;
 	return &ai->vfs_inode;
 }
 
@@ -1140,6 +1145,10 @@ static int apfs_show_options(struct seq_file *seq, struct dentry *root)
 						     sbi->s_gid));
 	if (nxi->nx_flags & APFS_CHECK_NODES)
 		seq_puts(seq, ",cknodes");
+	if (nxi->nx_flags & APFS_DISCARD)
+		seq_puts(seq, ",discard");
+	if (nxi->nx_flags & APFS_PREFETCH)
+		seq_puts(seq, ",prefetch");
 	if (nxi->nx_tier2_info)
 		seq_printf(seq, ",tier2=%s", nxi->nx_tier2_info->blki_path);
 
@@ -1201,13 +1210,15 @@ static const struct super_operations apfs_sops = {
 };
 
 enum {
-	Opt_readwrite, Opt_cknodes, Opt_uid, Opt_gid, Opt_vol, Opt_snap, Opt_tier2, Opt_err,
+	Opt_readwrite, Opt_cknodes, Opt_discard, Opt_prefetch, Opt_uid, Opt_gid, Opt_vol, Opt_snap, Opt_tier2, Opt_err,
 };
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(7, 0, 0)
 static const match_table_t tokens = {
 	{Opt_readwrite, "readwrite"},
 	{Opt_cknodes, "cknodes"},
+	{Opt_discard, "discard"},
+	{Opt_prefetch, "prefetch"},
 	{Opt_uid, "uid=%u"},
 	{Opt_gid, "gid=%u"},
 	{Opt_vol, "vol=%u"},
@@ -1219,6 +1230,8 @@ static const match_table_t tokens = {
 static const struct fs_parameter_spec apfs_param_spec[] = {
 	fsparam_flag	("readwrite",	Opt_readwrite),
 	fsparam_flag	("cknodes",	Opt_cknodes),
+	fsparam_flag	("discard",	Opt_discard),
+	fsparam_flag	("prefetch",	Opt_prefetch),
 	fsparam_uid	("uid",		Opt_uid),
 	fsparam_gid	("gid",		Opt_gid),
 	fsparam_u32	("vol",		Opt_vol),
@@ -1264,6 +1277,8 @@ static void parse_options_set_flags(struct super_block *sb, struct apfs_sb_info
 			sb->s_flags |= SB_RDONLY;
 		}
 	}
+	if (nxi->nx_flags & APFS_DISCARD && !apfs_discard_supported(sb))
+		apfs_warn(sb, "discard requested, but the device doesn't support it");
 }
 
 /**
@@ -1324,6 +1339,12 @@ static int parse_options(struct apfs_sb_info *sbi, char *options)
 			 */
 			sbi->s_mount_opt |= APFS_CHECK_NODES;
 			break;
+		case Opt_discard:
+			sbi->s_mount_opt |= APFS_DISCARD;
+			break;
+		case Opt_prefetch:
+			sbi->s_mount_opt |= APFS_PREFETCH;
+			break;
 		case Opt_uid:
 			err = match_int(&args[0], &option);
 			if (err)
@@ -1398,6 +1419,12 @@ static int apfs_parse_param(struct fs_context *fc, struct fs_parameter *param)
 		 */
 		sbi->s_mount_opt |= APFS_CHECK_NODES;
 		break;
+	case Opt_discard:
+		sbi->s_mount_opt |= APFS_DISCARD;
+		break;
+	case Opt_prefetch:
+		sbi->s_mount_opt |= APFS_PREFETCH;
+		break;
 	case Opt_uid:
 		sbi->s_uid = result.uid;
 		break;
@@ -1488,10 +1515,11 @@ static int apfs_check_nx_features(struct super_block *sb)
  */
 static int apfs_check_vol_features(struct super_block *sb)
 {
+	struct apfs_sb_info *sbi = APFS_SB(sb);
 	struct apfs_superblock *vsb_raw = NULL;
 	u64 features;
 
-	vsb_raw = APFS_SB(sb)->s_vsb_raw;
+	vsb_raw = sbi->s_vsb_raw;
 	if (!vsb_raw) {
 		apfs_alert(sb, "feature checks are misplaced");
 		return -EINVAL;
@@ -1547,6 +1575,11 @@ static int apfs_check_vol_features(struct super_block *sb)
 	if (features & APFS_INCOMPAT_EXTENT_PREALLOC_FLAG)
 		apfs_warn(sb, "extent prealloc flag is set");
 
+	/* Incompatible features can't change while mounted */
+	sbi->s_case_insensitive = features & APFS_INCOMPAT_CASE_INSENSITIVE;
+	sbi->s_norm_insensitive = sbi->s_case_insensitive ||
+				  (features & APFS_INCOMPAT_NORMALIZATION_INSENSITIVE);
+
 	features = le64_to_cpu(vsb_raw->apfs_fs_flags);
 	/* Some encrypted volumes are readable anyway */
 	if (!(features & APFS_FS_UNENCRYPTED))
@@ -1722,10 +1755,14 @@ static int apfs_fill_super(struct super_block *sb, void *data, int silent)
 	}
 
 	INIT_WORK(&sbi->s_orphan_cleanup_work, apfs_orphan_cleanup_work);
+	INIT_WORK(&sbi->s_reaper_work, apfs_reaper_work);
 	if (!(sb->s_flags & SB_RDONLY)) {
 		priv = sbi->s_private_dir;
 		if (APFS_I(priv)->i_nchildren)
-			schedule_work(&sbi->s_orphan_cleanup_work);
+			apfs_schedule_orphan_cleanup(sb);
+		/* Snapshot deletions may have been interrupted by an unmount */
+		if (sbi->s_vsb_raw->apfs_num_snapshots)
+			apfs_schedule_reaper(sb);
 	}
 	return 0;
 
@@ -2240,19 +2277,41 @@ static int __init init_apfs_fs(void)
 {
 	int err = 0;
 
-	err = init_inodecache();
+	err = apfs_init_unicode_table();
 	if (err)
 		return err;
+	err = init_inodecache();
+	if (err)
+		goto fail_unicode;
+	err = apfs_init_query_cache();
+	if (err)
+		goto fail_inodecache;
+	err = apfs_init_reclaim_wq();
+	if (err)
+		goto fail_querycache;
 	err = register_filesystem(&apfs_fs_type);
 	if (err)
-		destroy_inodecache();
+		goto fail_reclaim;
+	return 0;
+
+fail_reclaim:
+	apfs_destroy_reclaim_wq();
+fail_querycache:
+	apfs_destroy_query_cache();
+fail_inodecache:
+	destroy_inodecache();
+fail_unicode:
+	apfs_destroy_unicode_table();
 	return err;
 }
 
 static void __exit exit_apfs_fs(void)
 {
 	unregister_filesystem(&apfs_fs_type);
+	apfs_destroy_reclaim_wq();
+	apfs_destroy_query_cache();
 	destroy_inodecache();
+	apfs_destroy_unicode_table();
 }
 
 MODULE_AUTHOR("Ernesto A. Fernández");
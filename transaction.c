@@ -668,7 +668,6 @@ static int apfs_write_ephemeral_objects(struct super_block *sb)
  */
 static int apfs_transaction_commit_nx(struct super_block *sb)
 {
-	struct apfs_spaceman *sm = APFS_SM(sb);
 	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
 	struct apfs_nx_transaction *nx_trans = &nxi->nx_transaction;
 	struct apfs_bh_info *bhi, *tmp;
@@ -684,17 +683,14 @@ static int apfs_transaction_commit_nx(struct super_block *sb)
 	}
 
 	/*
-	 * Now that nothing else will be freed, flush the last update to the
-	 * free queues so that it can be committed to disk along with all the
-	 * ephemeral objects.
+	 * Now that nothing else will be freed, put all the cached ranges in
+	 * the free queues so that they can be committed to disk along with all
+	 * the ephemeral objects.
 	 */
-	if (sm->sm_free_cache_base) {
-		err = apfs_free_queue_insert_nocache(sb, sm->sm_free_cache_base, sm->sm_free_cache_blkcnt);
-		if (err) {
-			apfs_err(sb, "fq cache flush failed (0x%llx-0x%llx)", sm->sm_free_cache_base, sm->sm_free_cache_blkcnt);
-			return err;
-		}
-		sm->sm_free_cache_base = sm->sm_free_cache_blkcnt = 0;
+	err = apfs_free_queue_flush_cache(sb);
+	if (err) {
+		apfs_err(sb, "failed to flush the fq cache");
+		return err;
 	}
 	/*
 	 * Writing the ip bitmaps modifies the spaceman, so it must happen
@@ -830,6 +826,7 @@ static bool apfs_transaction_need_commit(struct super_block *sb)
 		int buffers_max = nxi->nx_trans_buffers_max;
 		int starts_max = APFS_TRANS_STARTS_MAX;
 		int mq_max = APFS_TRANS_MAIN_QUEUE_MAX;
+		u64 fq_nodes;
 		int maxnodes;
 
 		/*
@@ -861,15 +858,17 @@ static bool apfs_transaction_need_commit(struct super_block *sb)
 			return true;
 
 		/*
-		 * The main free queue can become unbalanced enough to reach
-		 * the node limit while being mostly empty. For now, the only
-		 * way I have to rebalance it is to flush it entirely with a
-		 * new transaction. We could wait longer to do it, but I don't
-		 * see the point.
+		 * Node splits in the free queues try to keep old records
+		 * packed together, but the main queue can still become
+		 * unbalanced enough to reach the node limit while being mostly
+		 * empty. The next transaction will notice and flush it whole.
+		 * Freed ranges only reach the queues on commit, so count the
+		 * nodes they may need as well.
 		 */
 		maxnodes = le16_to_cpu(fq_main->sfq_tree_node_limit);
 		maxnodes = (maxnodes + 1) >> 1;
-		if (sm->sm_main_fq_nodes > 1 && sm->sm_main_fq_nodes >= maxnodes)
+		fq_nodes = sm->sm_main_fq_nodes + apfs_free_queue_cache_nodes(sb);
+		if (fq_nodes > 1 && fq_nodes >= maxnodes)
 			return true;
 	}
 
@@ -957,6 +956,8 @@ int apfs_transaction_join(struct super_block *sb, struct buffer_head *bh)
 	nx_trans->t_buffers_count++;
 
 	set_buffer_trans(bh);
+	/* The content is about to change, so it must be checked again */
+	clear_buffer_checked(bh);
 	bh->b_private = bhi;
 	return 0;
 }
@@ -15,8 +15,10 @@
 #include <linux/version.h>
 #include "unicode.h"
 
-/* The arrays of unicode data are defined at the bottom of the file */
-/* TODO: would a single trie with all the data be more efficient? */
+/*
+ * The arrays of unicode data are defined at the bottom of the file. They are
+ * flattened into a single table for the BMP when the module is loaded.
+ */
 static u16 apfs_nfd_trie[];
 static unicode_t apfs_nfd[];
 static u16 apfs_cf_trie[];
@@ -73,6 +75,166 @@ static int apfs_trie_find(void *trie, unicode_t key, void *result, bool is_ccc)
 	return node & TRIE_SIZE_MASK;
 }
 
+/*
+ * All the normalization data for a single character: the trie values for its
+ * decomposition and case folding (as in position << TRIE_POS_SHIFT | length),
+ * and its canonical combining class.
+ */
+struct apfs_uni_props {
+	u16 nfd;
+	u16 cf;
+	u8 ccc;
+};
+
+/* The flattened table is split in pages of 256 characters */
+#define UNI_PAGE_SHIFT		8
+#define UNI_PAGE_SIZE		(1 << UNI_PAGE_SHIFT)
+#define UNI_PAGE_MASK		(UNI_PAGE_SIZE - 1)
+#define UNI_BMP_PAGES		(0x10000 >> UNI_PAGE_SHIFT)
+
+/* Pages of the table for the BMP, NULL if no character in them has any data */
+static struct apfs_uni_props *apfs_uni_pages[UNI_BMP_PAGES];
+
+/**
+ * apfs_uni_props_from_tries - Look up all the data for a character in the tries
+ * @utf32char:	the character
+ * @props:	on return, the normalization data for @utf32char
+ */
+static void apfs_uni_props_from_tries(unicode_t utf32char, struct apfs_uni_props *props)
+{
+	u16 pos;
+	u8 ccc;
+	int len;
+
+	len = apfs_trie_find(apfs_nfd_trie, utf32char, &pos, false /* is_ccc */);
+	props->nfd = len ? (pos << TRIE_POS_SHIFT) | len : 0;
+	len = apfs_trie_find(apfs_cf_trie, utf32char, &pos, false /* is_ccc */);
+	props->cf = len ? (pos << TRIE_POS_SHIFT) | len : 0;
+	apfs_trie_find(apfs_ccc_trie, utf32char, &ccc, true /* is_ccc */);
+	props->ccc = ccc;
+}
+
+/**
+ * apfs_uni_lookup - Look up all the normalization data for a character
+ * @utf32char:	the character
+ *
+ * Characters in the BMP take a single lookup in the flattened table; the rest
+ * are rare enough that they can just go through the tries.
+ */
+static inline struct apfs_uni_props apfs_uni_lookup(unicode_t utf32char)
+{
+	struct apfs_uni_props props = {0};
+	struct apfs_uni_props *page = NULL;
+
+	if (unlikely(utf32char >> 16)) {
+		apfs_uni_props_from_tries(utf32char, &props);
+		return props;
+	}
+	page = apfs_uni_pages[utf32char >> UNI_PAGE_SHIFT];
+	if (page)
+		props = page[utf32char & UNI_PAGE_MASK];
+	return props;
+}
+
+/**
+ * apfs_init_unicode_table - Build the flattened unicode table for the BMP
+ *
+ * Returns 0 on success, or -ENOMEM in case of failure.
+ */
+int __init apfs_init_unicode_table(void)
+{
+	struct apfs_uni_props props;
+	int page, i;
+
+	for (page = 0; page < UNI_BMP_PAGES; ++page) {
+		struct apfs_uni_props *table = NULL;
+
+		for (i = 0; i < UNI_PAGE_SIZE; ++i) {
+			apfs_uni_props_from_tries((page << UNI_PAGE_SHIFT) + i, &props);
+			if (!props.nfd && !props.cf && !props.ccc)
+				continue;
+			if (!table) {
+				table = kcalloc(UNI_PAGE_SIZE, sizeof(*table), GFP_KERNEL);
+				if (!table) {
+					apfs_destroy_unicode_table();
+					return -ENOMEM;
+				}
+				apfs_uni_pages[page] = table;
+			}
+			table[i] = props;
+		}
+	}
+	return 0;
+}
+
+/**
+ * apfs_destroy_unicode_table - Free the flattened unicode table
+ */
+void apfs_destroy_unicode_table(void)
+{
+	int page;
+
+	for (page = 0; page < UNI_BMP_PAGES; ++page) {
+		kfree(apfs_uni_pages[page]);
+		apfs_uni_pages[page] = NULL;
+	}
+}
+
+/* Mask with the high bit set in each byte of a word */
+#define APFS_NONASCII_MASK	((unsigned long)0x8080808080808080ULL)
+
+/**
+ * apfs_is_ascii - Check if a string is made of 7-bit ASCII characters only
+ * @str:	string to check
+ * @len:	length of the string
+ *
+ * The check is done a whole word at a time for most of the string.
+ */
+bool apfs_is_ascii(const char *str, unsigned int len)
+{
+	unsigned long word;
+
+	while (len >= sizeof(word)) {
+		memcpy(&word, str, sizeof(word));
+		if (word & APFS_NONASCII_MASK)
+			return false;
+		str += sizeof(word);
+		len -= sizeof(word);
+	}
+	while (len--) {
+		if (*str++ & 0x80)
+			return false;
+	}
+	return true;
+}
+
+/**
+ * apfs_ascii_cmp - Compare two ASCII filenames
+ * @name1:	first name to compare
+ * @len1:	length of @name1
+ * @name2:	second name to compare
+ * @len2:	length of @name2
+ * @case_fold:	compare the names case insensitively?
+ *
+ * Returns the same result as comparing both names one normalized character at
+ * a time, but without any of the trie lookups.
+ */
+int apfs_ascii_cmp(const char *name1, unsigned int len1,
+		   const char *name2, unsigned int len2, bool case_fold)
+{
+	unsigned int i;
+
+	for (i = 0;; ++i) {
+		unicode_t c1 = i < len1 ? apfs_ascii_fold(name1[i], case_fold) : 0;
+		unicode_t c2 = i < len2 ? apfs_ascii_fold(name2[i], case_fold) : 0;
+
+		if (c1 != c2)
+			return c1 < c2 ? -1 : 1;
+		if (!c1)
+			return 0;
+	}
+}
+
 /**
  * apfs_init_unicursor - Initialize an apfs_unicursor structure
  * @cursor:	cursor to initialize
@@ -169,21 +331,19 @@ static unicode_t apfs_normalize_char(unicode_t utf32char, int off,
 {
 	int nfd_len;
 	unicode_t *nfd, *cf;
-	u16 pos;
-	int ret;
+	u16 val;
 
 	if (apfs_is_precomposed_hangul(utf32char)) /* Hangul has no case */
 		return apfs_decompose_hangul(utf32char, off);
 
-	ret = apfs_trie_find(apfs_nfd_trie, utf32char,
-			     &pos, false /* is_ccc */);
-	if (!ret) {
+	val = apfs_uni_lookup(utf32char).nfd;
+	if (!val) {
 		/* The decomposition is just the same character */
 		nfd_len = 1;
 		nfd = &utf32char;
 	} else {
-		nfd_len = ret;
-		nfd = &apfs_nfd[pos];
+		nfd_len = val & TRIE_SIZE_MASK;
+		nfd = &apfs_nfd[val >> TRIE_POS_SHIFT];
 	}
 
 	if (!case_fold) {
@@ -195,15 +355,14 @@ static unicode_t apfs_normalize_char(unicode_t utf32char, int off,
 	for (; nfd_len > 0; nfd++, nfd_len--) {
 		int cf_len;
 
-		ret = apfs_trie_find(apfs_cf_trie, *nfd,
-				     &pos, false /* is_ccc */);
-		if (!ret) {
+		val = apfs_uni_lookup(*nfd).cf;
+		if (!val) {
 			/* The case folding is just the same character */
 			cf_len = 1;
 			cf = nfd;
 		} else {
-			cf_len = ret;
-			cf = &apfs_cf[pos];
+			cf_len = val & TRIE_SIZE_MASK;
+			cf = &apfs_cf[val >> TRIE_POS_SHIFT];
 		}
 
 		if (off < cf_len)
@@ -246,8 +405,7 @@ static int apfs_get_normalization_length(const char *utf8str, unsigned int total
 			if (utf32norm == NORM_END)
 				break;
 
-			apfs_trie_find(apfs_ccc_trie, utf32norm, &ccc,
-				       true /* is_ccc */);
+			ccc = apfs_uni_lookup(utf32norm).ccc;
 
 			if (ccc != 0)
 				starters_over = true;
@@ -282,14 +440,12 @@ unicode_t apfs_normalize_next(struct apfs_unicursor *cursor, bool case_fold)
 	u8 min_ccc;
 
 new_starter:
+	if (!total_len)
+		return 0;
 	if (likely(isascii(*utf8str))) {
-		if (!total_len)
-			return 0;
 		cursor->utf8curr = utf8str + 1;
 		cursor->total_len = total_len - 1;
-		if (case_fold)
-			return tolower(*utf8str);
-		return *utf8str;
+		return apfs_ascii_fold(*utf8str, case_fold);
 	}
 
 	if (cursor->length < 0) {
@@ -315,8 +471,7 @@ new_starter:
 			if (utf32norm == NORM_END)
 				break;
 
-			apfs_trie_find(apfs_ccc_trie, utf32norm, &ccc,
-				       true /* is_ccc */);
+			ccc = apfs_uni_lookup(utf32norm).ccc;
 
 			if (ccc >= min_ccc || ccc < cursor->last_ccc)
 				continue;
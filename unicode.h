@@ -6,6 +6,7 @@
 #ifndef _APFS_UNICODE_H
 #define _APFS_UNICODE_H
 
+#include <linux/ctype.h>
 #include <linux/nls.h>
 
 /*
@@ -20,8 +21,26 @@ struct apfs_unicursor {
 	u8 last_ccc;		/* CCC of the last character returned */
 };
 
+extern int apfs_init_unicode_table(void);
+extern void apfs_destroy_unicode_table(void);
+extern bool apfs_is_ascii(const char *str, unsigned int len);
+extern int apfs_ascii_cmp(const char *name1, unsigned int len1,
+			  const char *name2, unsigned int len2, bool case_fold);
 extern void apfs_init_unicursor(struct apfs_unicursor *cursor, const char *utf8str, unsigned int total_len);
 extern unicode_t apfs_normalize_next(struct apfs_unicursor *cursor,
 				     bool case_fold);
 
+/**
+ * apfs_ascii_fold - Normalize a single ASCII character
+ * @c:		the character
+ * @case_fold:	case fold the character?
+ *
+ * Normalization doesn't change ASCII characters, so only case folding has any
+ * effect. This must match what apfs_normalize_next() does for them.
+ */
+static inline unicode_t apfs_ascii_fold(unsigned char c, bool case_fold)
+{
+	return case_fold ? tolower(c) : c;
+}
+
 #endif	/* _APFS_UNICODE_H */
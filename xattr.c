@@ -390,10 +390,24 @@ static int apfs_xattr_get(struct inode *inode, const char *name, void *buffer, s
 	return ret;
 }
 
+/**
+ * apfs_xattr_is_private - Check if a xattr is reserved for the driver itself
+ * @name: name of the xattr
+ *
+ * Private xattrs hold state that the user must only change through other
+ * interfaces, so they are hidden and can't be read or written directly.
+ */
+static bool apfs_xattr_is_private(const char *name)
+{
+	return strcmp(name, APFS_XATTR_NAME_NOCOW) == 0;
+}
+
 static int apfs_xattr_osx_get(const struct xattr_handler *handler,
 				struct dentry *unused, struct inode *inode,
 				const char *name, void *buffer, size_t size)
 {
+	if (apfs_xattr_is_private(name))
+		return -ENODATA;
 	/* Ignore the fake 'osx' prefix */
 	return apfs_xattr_get(inode, name, buffer, size);
 }
@@ -819,6 +833,9 @@ static int apfs_xattr_osx_set(const struct xattr_handler *handler,
 	struct super_block *sb = inode->i_sb;
 	int err;
 
+	if (apfs_xattr_is_private(name))
+		return -EPERM;
+
 	err = apfs_transaction_start(sb, value ? APFS_TRANS_REG : APFS_TRANS_DEL);
 	if (err)
 		return err;
@@ -855,48 +872,41 @@ ssize_t apfs_listxattr(struct dentry *dentry, char *buffer, size_t size)
 	struct super_block *sb = inode->i_sb;
 	struct apfs_sb_info *sbi = APFS_SB(sb);
 	struct apfs_nxsb_info *nxi = APFS_NXI(sb);
-	struct apfs_query *query;
+	struct apfs_btree_iter iter;
+	struct apfs_key start, end;
 	u64 cnid = apfs_ino(inode);
 	size_t free = size;
 	ssize_t ret;
 
 	down_read(&nxi->nx_big_sem);
 
-	query = apfs_alloc_query(sbi->s_cat_root, NULL /* parent */);
-	if (!query) {
-		ret = -ENOMEM;
-		goto fail;
-	}
-
-	/* We want all the xattrs for the cnid, regardless of the name */
-	apfs_init_xattr_key(cnid, NULL /* name */, &query->key);
-	query->flags = APFS_QUERY_CAT | APFS_QUERY_MULTIPLE | APFS_QUERY_EXACT;
+	/*
+	 * We want all the xattrs for the cnid, regardless of the name. The
+	 * empty name sorts before all others, and sibling links come next.
+	 */
+	apfs_init_xattr_key(cnid, "" /* name */, &start);
+	apfs_init_xattr_key(cnid, NULL /* name */, &end);
+	end.type = APFS_TYPE_SIBLING_LINK;
+	apfs_btree_iter_init(&iter, sbi->s_cat_root, APFS_QUERY_CAT, &start, &end);
 
-	while (1) {
+	for (ret = apfs_btree_iter_seek(sb, &iter, NULL /* key */); !ret;
+	     ret = apfs_btree_iter_next(sb, &iter)) {
 		struct apfs_xattr xattr;
 
-		ret = apfs_btree_query(sb, &query);
-		if (ret == -ENODATA) { /* Got all the xattrs */
-			ret = size - free;
-			break;
-		}
-		if (ret) {
-			apfs_err(sb, "query failed for id 0x%llx", cnid);
-			break;
-		}
-
-		ret = apfs_xattr_from_query(query, &xattr);
+		ret = apfs_xattr_from_query(iter.query, &xattr);
 		if (ret) {
 			apfs_err(sb, "bad xattr key in inode %llx", cnid);
-			break;
+			goto fail;
 		}
+		if (apfs_xattr_is_private((char *)xattr.name))
+			continue;
 
 		if (buffer) {
 			/* Prepend the fake 'osx' prefix before listing */
 			if (xattr.name_len + XATTR_MAC_OSX_PREFIX_LEN + 1 >
 									free) {
 				ret = -ERANGE;
-				break;
+				goto fail;
 			}
 			memcpy(buffer, XATTR_MAC_OSX_PREFIX,
 			       XATTR_MAC_OSX_PREFIX_LEN);
@@ -906,9 +916,13 @@ ssize_t apfs_listxattr(struct dentry *dentry, char *buffer, size_t size)
 		}
 		free -= xattr.name_len + XATTR_MAC_OSX_PREFIX_LEN + 1;
 	}
+	if (ret == -ENODATA) /* Got all the xattrs */
+		ret = size - free;
+	else
+		apfs_err(sb, "iteration failed for id 0x%llx", cnid);
 
 fail:
-	apfs_free_query(query);
+	apfs_btree_iter_release(&iter);
 	up_read(&nxi->nx_big_sem);
 	return ret;
 }